@@ -118,9 +118,127 @@ char *bytecodenames[] = {
     "PRSTR",
     "PRMSG",
     "KBDCH",
-    "KBDLN"
+    "KBDLN",
+    "BRGTI",
+    "BRGTEI",
+    "BRLTI",
+    "BRLTEI",
+    "BREQLI",
+    "BRNEQLI",
+    "BRZI",
+    "LDIB",
+    "LDRWIB",
+    "LDRBIB",
+    "STRWIB",
+    "STRBIB",
+    "JMPR",
+    "BRCR",
+    "BRGTR",
+    "BRGTER",
+    "BRLTR",
+    "BRLTER",
+    "BREQLR",
+    "BRNEQLR",
+    "BRZR",
+    "FILE",
+    "MEM",
+    "STR",
+    "VEC",
+    "SORT",
+    "HASH",
+    "LDAWX",
+    "LDABX",
+    "STAWX",
+    "STABX",
+    "LDRWX",
+    "LDRBX",
+    "STRWX",
+    "STRBX",
+    "LDPWX",
+    "LDPBX",
+    "STPWX",
+    "STPBX"
 };
 
+/*
+ * Function codes for VM_FILE
+ */
+char *filefnnames[] = {
+    "OPEN",
+    "CLOSE",
+    "READ",
+    "WRITE",
+    "SEEK",
+    "MAP",
+    "UNMAP"
+};
+
+/*
+ * Function codes for VM_MEM
+ */
+char *memfnnames[] = {
+    "COPY",
+    "FILL",
+    "CMP",
+    "ALLOC",
+    "FREE"
+};
+
+/*
+ * Function codes for VM_STR
+ */
+char *strfnnames[] = {
+    "LEN",
+    "CPY",
+    "CAT",
+    "CMP",
+    "CHR",
+    "FIND"
+};
+
+/*
+ * Function codes for VM_VEC
+ */
+char *vecfnnames[] = {
+    "W",
+    "B",
+    "WK",
+    "BK",
+    "RW",
+    "RB"
+};
+
+/*
+ * Function codes for VM_SORT
+ */
+char *sortfnnames[] = {
+    "W",
+    "B",
+    "SEARCHW",
+    "SEARCHB"
+};
+
+/*
+ * Function codes for VM_HASH
+ */
+char *hashfnnames[] = {
+    "NEW",
+    "PUT",
+    "GET",
+    "DEL",
+    "NEXT"
+};
+
+/*
+ * Function code names and number of function codes for each library
+ * opcode, starting with VM_FILE
+ */
+char **fnnames[] = { filefnnames, memfnnames, strfnnames, vecfnnames, sortfnnames, hashfnnames };
+unsigned char numfns[] = { FILE_UNMAP + 1, MEM_FREE + 1, STR_FIND + 1, VEC_RB + 1, SORT_SEARCHB + 1,
+                           HASH_NEXT + 1 };
+
+#define NUMBYTECODES (sizeof(bytecodenames) / sizeof(bytecodenames[0]))
+
 /*
  * Call stack grows down from top of memory.
  * If it hits CALLSTACKLIM then VM will quit with error
@@ -175,9 +293,28 @@ void disassemble_instruction()
       case VM_STABYTEIMM:
       case VM_STRWORDIMM:
       case VM_STRBYTEIMM:
+      case VM_LDAWORDIDX:
+      case VM_LDABYTEIDX:
+      case VM_STAWORDIDX:
+      case VM_STABYTEIDX:
+      case VM_LDRWORDIDX:
+      case VM_LDRBYTEIDX:
+      case VM_STRWORDIDX:
+      case VM_STRBYTEIDX:
+      case VM_LDPWORDIDX:
+      case VM_LDPBYTEIDX:
+      case VM_STPWORDIDX:
+      case VM_STPBYTEIDX:
       case VM_JMPIMM:
       case VM_BRNCHIMM:
       case VM_JSRIMM:
+      case VM_BRGTIMM:
+      case VM_BRGTEIMM:
+      case VM_BRLTIMM:
+      case VM_BRLTEIMM:
+      case VM_BREQLIMM:
+      case VM_BRNEQLIMM:
+      case VM_BRZIMM:
         _printhexbyte(memory[pc++]);
         printchar(' ');
         _printhexbyte(memory[pc++]);
@@ -189,6 +326,64 @@ void disassemble_instruction()
         printdec(memory[pc-2] + (memory[pc-1] << 8));
         print(")");
         break;
+      case VM_LDIMMB:
+      case VM_LDRWORDIMMB:
+      case VM_LDRBYTEIMMB:
+      case VM_STRWORDIMMB:
+      case VM_STRBYTEIMMB:
+        _printhexbyte(memory[pc++]);
+        print("      ");
+        print(bytecodenames[memory[pc-2]]);
+        printchar(' ');
+        if (memory[pc-2] == VM_LDIMMB) {
+            printhexbyte(memory[pc-1]);
+            print(" (");
+            printdec(memory[pc-1]);
+        } else {
+            /* Signed frame relative address */
+            printhex((signed char) memory[pc-1]);
+            print(" (");
+            if (memory[pc-1] & 0x80) {
+                printchar('-');
+                printdec(256 - memory[pc-1]);
+            } else {
+                printdec(memory[pc-1]);
+            }
+        }
+        print(")");
+        break;
+      case VM_JMPREL:
+      case VM_BRNCHREL:
+      case VM_BRGTREL:
+      case VM_BRGTEREL:
+      case VM_BRLTREL:
+      case VM_BRLTEREL:
+      case VM_BREQLREL:
+      case VM_BRNEQLREL:
+      case VM_BRZREL:
+        _printhexbyte(memory[pc++]);
+        print("      ");
+        print(bytecodenames[memory[pc-2]]);
+        printchar(' ');
+        /* Show the destination address */
+        printhex(pc + (signed char) memory[pc-1]);
+        break;
+      case VM_FILE:
+      case VM_MEM:
+      case VM_STR:
+      case VM_VEC:
+      case VM_SORT:
+      case VM_HASH:
+        _printhexbyte(memory[pc++]);
+        print("      ");
+        print(bytecodenames[memory[pc-2]]);
+        printchar(' ');
+        if (memory[pc-1] < numfns[memory[pc-2] - VM_FILE]) {
+            print(fnnames[memory[pc-2] - VM_FILE][memory[pc-1]]);
+        } else {
+            printhexbyte(memory[pc-1]);
+        }
+        break;
       case VM_PRMSG:
         print("...00   ");
         print(bytecodenames[memory[pc-1]]);
@@ -201,7 +396,7 @@ void disassemble_instruction()
         break;
       default:
         print("        ");
-        if (memory[pc-1] <= VM_KBDLN) {
+        if (memory[pc-1] < NUMBYTECODES) {
             print(bytecodenames[memory[pc-1]]);
         } else {
             print("**ILLEGAL**");
@@ -230,7 +425,9 @@ void disassemble()
 void load()
 {
     FILE *fp;
-    char ch;
+    int ch;
+    unsigned int len;
+    unsigned int nrelocs;
     char *p = (char*)&memory[RTPCSTART];
 
     pc = RTPCSTART;
@@ -250,16 +447,34 @@ void load()
         print("'\n");
         fp = fopen(p, "r");
     } while (!fp);
-    while (!feof(fp)) {
-        ch = fgetc(fp);
-        memory[pc++] = ch;
-        /* Print dot for each page */
-        if (pc%0xff == 0) {
-            printchar('.');
+    ch = fgetc(fp);
+    if (ch == BCMAGIC) {
+        /* Skip the header.  Code is disassembled as linked, at RTPCSTART */
+        fgetc(fp);
+        len = fgetc(fp);
+        len |= fgetc(fp) << 8;
+        nrelocs = fgetc(fp);
+        nrelocs |= fgetc(fp) << 8;
+        print("Code ");
+        printhex(len);
+        print(" bytes, ");
+        printhex(nrelocs);
+        print(" relocations\n");
+        while (len--) {
+            memory[pc++] = fgetc(fp);
+        }
+    } else {
+        while (!feof(fp)) {
+            memory[pc++] = ch;
+            /* Print dot for each page */
+            if (pc%0xff == 0) {
+                printchar('.');
+            }
+            ch = fgetc(fp);
         }
     }
     fclose(fp);
-    lastpc = pc - 1;
+    lastpc = pc;
     pc = RTPCSTART;
 #ifdef A2E
     printchar(7);
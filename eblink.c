@@ -0,0 +1,321 @@
+/**************************************************************************/
+/* EightBall Linker                                                       */
+/*                                                                        */
+/* The Eight Bit Algorithmic Language                                     */
+/*                                                                        */
+/* Builds with gcc for Linux only.  Links object files written by the     */
+/* EightBall compiler (comp "module.obj") into a bytecode file which can  */
+/* be run by the EightBall VM.                                            */
+/*                                                                        */
+/* Copyright Bobbi Webber-Manners 2018                                    */
+/*                                                                        */
+/* Formatted with indent -kr -nut                                         */
+/**************************************************************************/
+
+/**************************************************************************/
+/*  GNU PUBLIC LICENCE v3 OR LATER                                        */
+/*                                                                        */
+/*  This program is free software: you can redistribute it and/or modify  */
+/*  it under the terms of the GNU General Public License as published by  */
+/*  the Free Software Foundation, either version 3 of the License, or     */
+/*  (at your option) any later version.                                   */
+/*                                                                        */
+/*  This program is distributed in the hope that it will be useful,       */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*  GNU General Public License for more details.                          */
+/*                                                                        */
+/*  You should have received a copy of the GNU General Public License     */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                        */
+/**************************************************************************/
+
+/*
+ * Usage: eblink [-o out.bin] main.obj [module.obj ...]
+ *
+ * The code of each module is placed after the one before, starting with
+ * the first at RTPCSTART, so the main program must come first.  Only the
+ * first module may have globals or statements outside subs.  Every sub
+ * defined in a module is exported.  Calls to subs in other modules are
+ * looked up in a hash table of all the exported subs and filled in.  The
+ * output is a bytecode file (default name 'bytecode') with a relocation
+ * table, in the format described in eightballvm.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eightballvm.h"
+
+#define HASHSZ 256              /* Must be a power of 2 */
+
+/*
+ * A subroutine exported by a module.
+ */
+struct symbol {
+    char name[OBJNAMELEN + 1];
+    unsigned int addr;          /* Address in the linked program */
+    char *file;                 /* Module which defines it       */
+    struct symbol *next;        /* Next symbol in hash bucket    */
+};
+
+/*
+ * A module read from an object file.
+ */
+struct module {
+    char *file;
+    unsigned int base;          /* Address of code in linked program */
+    unsigned int len;
+    unsigned int nrelocs;
+    unsigned int nsyms;
+    unsigned int nrefs;
+    unsigned int hasmain;       /* Globals or statements outside subs */
+    unsigned char *code;
+    unsigned char *tables;      /* Relocations, symbols and refs */
+};
+
+struct symbol *symtab[HASHSZ];
+
+unsigned char image[RTCALLSTACKLIM - RTPCSTART];
+
+/*
+ * Returns the hash bucket for name.
+ */
+unsigned int hash(char *name)
+{
+    unsigned int h = 0;
+
+    while (*name) {
+        h = h * 31 + (unsigned char) *name++;
+    }
+    return h & (HASHSZ - 1);
+}
+
+/*
+ * Find symbol name, or NULL if not defined.
+ */
+struct symbol *lookup(char *name)
+{
+    struct symbol *s;
+
+    for (s = symtab[hash(name)]; s; s = s->next) {
+        if (!strcmp(s->name, name)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Read a little endian word from p.
+ */
+unsigned int getword(unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/*
+ * Copy the name from a symbol or reference table entry at p to name.
+ */
+void getname(unsigned char *p, char *name)
+{
+    memcpy(name, p, OBJNAMELEN);
+    name[OBJNAMELEN] = '\0';
+}
+
+/*
+ * Read an object file into m.  Returns 0 on success, 1 on error.
+ */
+int readobject(char *file, struct module *m)
+{
+    FILE *fp;
+    unsigned char hdr[OBJHDRLEN];
+    size_t tablen;
+
+    fp = fopen(file, "rb");
+    if (!fp) {
+        perror(file);
+        return 1;
+    }
+    if ((fread(hdr, 1, OBJHDRLEN, fp) != OBJHDRLEN) ||
+        (hdr[0] != OBJMAGIC) || (hdr[1] != OBJVERSION)) {
+        fprintf(stderr, "%s: not an object file\n", file);
+        fclose(fp);
+        return 1;
+    }
+    m->file = file;
+    m->len = getword(hdr + 2);
+    m->nrelocs = getword(hdr + 4);
+    m->nsyms = getword(hdr + 6);
+    m->nrefs = getword(hdr + 8);
+    m->hasmain = getword(hdr + 10);
+    tablen = m->nrelocs * 2 + (m->nsyms + m->nrefs) * (OBJNAMELEN + 2);
+    m->code = malloc(m->len + tablen);
+    if (!m->code) {
+        fprintf(stderr, "%s: out of memory\n", file);
+        fclose(fp);
+        return 1;
+    }
+    m->tables = m->code + m->len;
+    if (fread(m->code, 1, m->len + tablen, fp) != m->len + tablen) {
+        fprintf(stderr, "%s: truncated\n", file);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Add the subs defined by module m to the symbol table.
+ * Returns 0 on success, 1 on error.
+ */
+int addsymbols(struct module *m)
+{
+    unsigned char *p = m->tables + m->nrelocs * 2;
+    struct symbol *s;
+    struct symbol *dup;
+    unsigned int i;
+    unsigned int h;
+
+    for (i = 0; i < m->nsyms; ++i, p += OBJNAMELEN + 2) {
+        s = malloc(sizeof(struct symbol));
+        if (!s) {
+            fprintf(stderr, "%s: out of memory\n", m->file);
+            return 1;
+        }
+        getname(p, s->name);
+        s->addr = m->base + getword(p + OBJNAMELEN);
+        s->file = m->file;
+        dup = lookup(s->name);
+        if (dup) {
+            fprintf(stderr, "%s: sub %s already defined in %s\n",
+                    m->file, s->name, dup->file);
+            return 1;
+        }
+        h = hash(s->name);
+        s->next = symtab[h];
+        symtab[h] = s;
+    }
+    return 0;
+}
+
+/*
+ * Set the word at addr in the linked program.
+ */
+void setword(unsigned int addr, unsigned int w)
+{
+    image[addr - RTPCSTART] = w & 0xff;
+    image[addr - RTPCSTART + 1] = w >> 8;
+}
+
+/*
+ * Write a little endian word to fp.
+ */
+void putword(unsigned int w, FILE *fp)
+{
+    fputc(w & 0xff, fp);
+    fputc(w >> 8, fp);
+}
+
+int main(int argc, char *argv[])
+{
+    struct module *mods;
+    struct module *m;
+    struct symbol *s;
+    char *out = "bytecode";
+    char name[OBJNAMELEN + 1];
+    unsigned char *p;
+    unsigned int nmods = 0;
+    unsigned int addr = RTPCSTART;
+    unsigned int nrelocs = 0;
+    unsigned int i;
+    unsigned int j;
+    int err = 0;
+    FILE *fp;
+
+    mods = calloc(argc, sizeof(struct module));
+    if (!mods) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 1; i < (unsigned int) argc; ++i) {
+        if (!strcmp(argv[i], "-o") && (i + 1 < (unsigned int) argc)) {
+            out = argv[++i];
+            continue;
+        }
+        m = &mods[nmods++];
+        if (readobject(argv[i], m)) {
+            return 1;
+        }
+        if ((nmods > 1) && m->hasmain) {
+            fprintf(stderr, "%s: globals or statements outside subs (only allowed in the first module)\n", m->file);
+            return 1;
+        }
+        m->base = addr;
+        if (m->len > RTCALLSTACKLIM - addr) {
+            fprintf(stderr, "%s: program too big\n", m->file);
+            return 1;
+        }
+        addr += m->len;
+        nrelocs += m->nrelocs + m->nrefs;
+        if (addsymbols(m)) {
+            return 1;
+        }
+    }
+    if (!nmods) {
+        fprintf(stderr, "usage: %s [-o out.bin] main.obj [module.obj ...]\n", argv[0]);
+        return 1;
+    }
+
+    /* Relocate each module and fill in calls to other modules */
+    for (m = mods; m < mods + nmods; ++m) {
+        memcpy(image + m->base - RTPCSTART, m->code, m->len);
+        p = m->tables;
+        for (i = 0; i < m->nrelocs; ++i, p += 2) {
+            j = m->base + getword(p);
+            setword(j, getword(image + j - RTPCSTART) + m->base - RTPCSTART);
+        }
+        p += m->nsyms * (OBJNAMELEN + 2);
+        for (i = 0; i < m->nrefs; ++i, p += OBJNAMELEN + 2) {
+            getname(p, name);
+            s = lookup(name);
+            if (!s) {
+                fprintf(stderr, "%s: sub %s not defined\n", m->file, name);
+                err = 1;
+                continue;
+            }
+            setword(m->base + getword(p + OBJNAMELEN), s->addr);
+        }
+    }
+    if (err) {
+        return 1;
+    }
+
+    fp = fopen(out, "wb");
+    if (!fp) {
+        perror(out);
+        return 1;
+    }
+    fputc(BCMAGIC, fp);
+    fputc(BCVERSION, fp);
+    putword(addr - RTPCSTART, fp);
+    putword(nrelocs, fp);
+    fwrite(image, 1, addr - RTPCSTART, fp);
+    for (m = mods; m < mods + nmods; ++m) {
+        p = m->tables;
+        for (i = 0; i < m->nrelocs; ++i, p += 2) {
+            putword(m->base - RTPCSTART + getword(p), fp);
+        }
+        p += m->nsyms * (OBJNAMELEN + 2);
+        for (i = 0; i < m->nrefs; ++i, p += OBJNAMELEN + 2) {
+            putword(m->base - RTPCSTART + getword(p + OBJNAMELEN), fp);
+        }
+    }
+    if (fclose(fp)) {
+        perror(out);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+/**************************************************************************/
+/* EightBall Library Test                                                 */
+/*                                                                        */
+/* The Eight Bit Algorithmic Language                                     */
+/*                                                                        */
+/* Builds with gcc -m32 for Linux only.  Runs some programs through the   */
+/* library interface in eightball.h and checks that the host program      */
+/* gets control back, whatever the program does.                          */
+/*                                                                        */
+/* Copyright Bobbi Webber-Manners 2018                                    */
+/*                                                                        */
+/* Formatted with indent -kr -nut                                         */
+/**************************************************************************/
+
+/**************************************************************************/
+/*  GNU PUBLIC LICENCE v3 OR LATER                                        */
+/*                                                                        */
+/*  This program is free software: you can redistribute it and/or modify  */
+/*  it under the terms of the GNU General Public License as published by  */
+/*  the Free Software Foundation, either version 3 of the License, or     */
+/*  (at your option) any later version.                                   */
+/*                                                                        */
+/*  This program is distributed in the hope that it will be useful,       */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*  GNU General Public License for more details.                          */
+/*                                                                        */
+/*  You should have received a copy of the GNU General Public License     */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                        */
+/**************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "eightball.h"
+
+static unsigned int tests = 1;
+static unsigned int failed = 0;
+
+static void expect(int b)
+{
+    printf("%u: %s\n", tests++, b ? "  Pass" : "  FAIL");
+    if (!b) {
+        ++failed;
+    }
+}
+
+int main()
+{
+    ebctx_t *ctx = eb_new();
+    unsigned char *image;
+    unsigned int len;
+    int n = 0;
+
+    eb_output(ctx, -1);
+
+    /* quit stops the program, not the host */
+    expect(eb_load(ctx, "word n=1\nquit\nn=2\nend\n") == EB_OK);
+    expect(eb_run(ctx, 0) == EB_OK);
+    expect((eb_getvar(ctx, "n", &n) == EB_OK) && (n == 1));
+
+    /* Also from inside a sub */
+    expect(eb_load(ctx, "word n=1\ncall q()\nn=2\nend\nsub q()\n n=3\n quit\nendsub\n") == EB_OK);
+    expect(eb_run(ctx, 0) == EB_OK);
+    expect((eb_getvar(ctx, "n", &n) == EB_OK) && (n == 3));
+
+    /* The library still works afterwards */
+    expect(eb_load(ctx, "word n=0\nwhile n<10\n n=n+1\nendwhile\nend\n") == EB_OK);
+    expect(eb_run(ctx, 0) == EB_OK);
+    expect((eb_getvar(ctx, "n", &n) == EB_OK) && (n == 10));
+    expect(eb_compile(ctx, &image, &len) == EB_OK);
+    free(image);
+
+    /* Errors are returned too */
+    expect(eb_load(ctx, "word n=\nend\n") == EB_OK);
+    expect(eb_run(ctx, 0) == EB_ERROR);
+    expect(eb_getvar(ctx, "nosuchvar", &n) == EB_ERROR);
+
+    eb_free(ctx);
+    if (failed == 0) {
+        printf("*** ALL %u TESTS PASSED ***\n", tests - 1);
+    } else {
+        printf("*** %u/%u TESTS FAILED ***\n", failed, tests - 1);
+    }
+    return failed != 0;
+}
@@ -45,9 +45,15 @@
 #include <string.h>
 #include <setjmp.h>
 #include <unistd.h>
+#ifdef __GNUC__
+#include <errno.h>
+#endif
 
 #include "eightballutils.h"
 #include "eightballvm.h"
+#ifdef EBLIB
+#include "eightball.h"
+#endif
 
 /* Define EXTMEM to enable extended memory support for source code.
  * Define EXTMEMCODE to enable extended memory support for object code.
@@ -69,6 +75,17 @@
 #define CBM
 #endif
 
+/* Define SUBTHREADS to let the batch compiler compile subs on threads.
+ * The compiler state marked THREADLOCAL is then per thread.
+ * Linux only, and not in the library, which has its own contexts.
+ */
+#if defined(__GNUC__) && !defined(EBLIB)
+#define SUBTHREADS
+#define THREADLOCAL __thread
+#else
+#define THREADLOCAL
+#endif
+
 #ifdef CC65
 #ifdef CBM
 /* Commodore headers */
@@ -90,12 +107,20 @@
 #ifdef __GNUC__
 #include <stdio.h>              /* For FILE */
 #endif
+#ifdef SUBTHREADS
+#include <pthread.h>
+#endif
 
 //#define TEST
 //#define DEBUG_READFILE
 
 //#define EXIT(arg) {printf("%d\n",__LINE__); exit(arg);}
+#ifdef EBLIB
+/* The library must not exit the host program.  Return to the entry point */
+#define EXIT(arg) longjmp(jumpbuf, (arg) ? 1 : 2)
+#else
 #define EXIT(arg) exit(arg)
+#endif
 
 #define VARNUMCHARS 4           /* First 4 chars of variable name are significant */
 #define SUBRNUMCHARS 8          /* First 8 chars of variable name are significant */
@@ -147,15 +172,47 @@ unsigned char openfile(unsigned char);
 unsigned char readfile(void);
 unsigned char writefile(void);
 void list(unsigned int, unsigned int);
-void run(unsigned char);
+unsigned char run(unsigned char);
+unsigned char compileprogram(void);
 void new(void);
 unsigned char parseline(void);
 unsigned char docall(void);
 unsigned char doreturn(int retvalue);
 void emit(enum bytecode code);
 void emit_imm(enum bytecode code, int word);
+#ifdef __GNUC__
+void emit_fn(enum bytecode code, unsigned char fn);
+#endif
+unsigned int emit_brfalse(void);
+void unemit(unsigned char len);
+void pushhist(enum bytecode code, int word);
+unsigned char canfold(int token);
 void emitprmsg(void);
-void linksubs(void);
+void linksubs(unsigned char partial);
+void compact(void);
+unsigned char getcodebyte(unsigned int address);
+unsigned int codelen(unsigned int address);
+unsigned char hasaddr(unsigned char op);
+unsigned char subhashfn(char *name);
+#ifdef __GNUC__
+unsigned char cachefetch(void);
+void cachestore(void);
+void writeobject(void);
+void writecsource(void);
+void writenative(void);
+unsigned char loopscan(char *name);
+void loopbegin(void);
+void looppush(unsigned int pc, unsigned char kind);
+void loopload(char *name, unsigned int pc, int idx);
+void loopop(int token);
+void loopfinish(void);
+void loopstep(void);
+void loopend(unsigned int head);
+#endif
+#ifdef SUBTHREADS
+unsigned char queuesub(void);
+void compilesubs(void);
+#endif
 void copyfromaux(char *auxptr, unsigned char len);
 
 #define emitldi(x) emit_imm(VM_LDIMM, x)
@@ -166,45 +223,133 @@ void copyfromaux(char *auxptr, unsigned char len);
  ***************************************************************************
  */
 
-char compile = 0;               /* 0 means interpret, 1 means compile          */
-char compilingsub = 0;          /* 1 when compiling subroutine, 0 otherwise    */
-char onlyconstants = 0;         /* 0 is normal, 1 means only allow const exprs */
-char compiletimelookup = 0;     /* When set to 1, getintvar() will do lookup   */
-                                /* rather than code generation                 */
+THREADLOCAL char compile = 0;               /* 0 means interpret, 1 means compile          */
+THREADLOCAL char compilingsub = 0;          /* 1 when compiling subroutine, 0 otherwise    */
+THREADLOCAL char onlyconstants = 0;         /* 0 is normal, 1 means only allow const exprs */
+THREADLOCAL char compiletimelookup = 0;     /* When set to 1, getintvar() will do lookup   */
+                                            /* rather than code generation                 */
+THREADLOCAL unsigned int errors = 0;        /* Number of errors reported                   */
+#ifdef __GNUC__
+char objfile = 0;               /* 1 when compiling to an object file          */
+char objmain = 0;               /* 1 if there are statements outside subs      */
+char *batchfile = NULL;         /* Source file, when compiling in batch mode   */
+#endif
+#ifdef SUBTHREADS
+int compjobs = 1;               /* Threads to compile subs on (batch -j)       */
+#endif
 
+#ifdef __GNUC__
+#define FILENAMELEN 127
+#else
 #define FILENAMELEN 15
+#endif
 
-char readbuf[255];              /* Buffer for reading from file                */
+THREADLOCAL char readbuf[255];              /* Buffer for reading from file                */
 char lnbuf[255];                /* Input text line buffer                      */
 char filename[FILENAMELEN+1];   /* Name of bytecode file                       */
-char *txtPtr;                   /* Pointer to next character to read in lnbuf  */
+THREADLOCAL char *txtPtr;                   /* Pointer to next character to read in lnbuf  */
 
 #define STACKSZ 16              /* Size of expression stacks   */
 #define RETSTACKSZ 64           /* Size of return stack        */
 
-int operand_stack[STACKSZ];     /* Operand stack - grows down  */
-unsigned char operator_stack[STACKSZ];  /* Operator stack - grows down */
-int return_stack[RETSTACKSZ];   /* Return stack - grows down   */
+THREADLOCAL int operand_stack[STACKSZ];     /* Operand stack - grows down  */
+THREADLOCAL unsigned char operator_stack[STACKSZ];  /* Operator stack - grows down */
+THREADLOCAL int return_stack[RETSTACKSZ];   /* Return stack - grows down   */
 
-unsigned char operatorSP;       /* Operator stack pointer      */
-unsigned char operandSP;        /* Operand stack pointer       */
-unsigned char returnSP;         /* Return stack pointer        */
+THREADLOCAL unsigned char operatorSP;       /* Operator stack pointer      */
+THREADLOCAL unsigned char operandSP;        /* Operand stack pointer       */
+THREADLOCAL unsigned char returnSP;         /* Return stack pointer        */
 
-jmp_buf jumpbuf;                /* For setjmp()/longjmp()      */
+THREADLOCAL jmp_buf jumpbuf;                /* For setjmp()/longjmp()      */
 
 #ifndef CBM
 FILE *fd;                       /* File descriptor             */
 #endif
 
+#ifdef EBLIB
+char memout = 0;                /* 1 to write output to memimage       */
+char *memimage;                 /* Output written by eb_compile()      */
+size_t memimagelen;             /* Length of memimage                  */
+char stepbudget = 0;            /* 1 if number of statements is capped */
+unsigned long stepsleft;        /* Statements left to run              */
+#endif
+
 /*
  * Definitions for the EightBall VM - compilation target
  */
 
-unsigned int rtPC;              /* Program counter when compiling      */
-unsigned int rtSP;              /* Stack pointer when compiling        */
-unsigned int rtFP;              /* Frame pointer when compiling        */
-unsigned int rtPCBeforeEval;    /* Stashed copy of program counter     */
-unsigned char *codeptr;         /* Pointer to write VM code to memory  */
+THREADLOCAL unsigned int rtPC;              /* Program counter when compiling      */
+THREADLOCAL unsigned int rtSP;              /* Stack pointer when compiling        */
+THREADLOCAL unsigned int rtFP;              /* Frame pointer when compiling        */
+THREADLOCAL unsigned int rtPCBeforeEval;    /* Stashed copy of program counter     */
+THREADLOCAL unsigned char *codeptr;         /* Pointer to write VM code to memory  */
+
+/*
+ * The last few instructions emitted, most recent first.
+ * Used by the optimizer to look back at the code it has generated.
+ */
+#define HISTSZ 3
+THREADLOCAL unsigned char histop[HISTSZ];   /* Opcode                              */
+THREADLOCAL unsigned int histpc[HISTSZ];    /* Runtime PC of instruction           */
+THREADLOCAL int histimm[HISTSZ];            /* Immediate operand, if any           */
+
+#define lastop   histop[0]
+#define lastoppc histpc[0]
+#define lastimm  histimm[0]
+#define prevop   histop[1]
+#define prevoppc histpc[1]
+#define previmm  histimm[1]
+
+#ifdef __GNUC__
+/*
+ * Loop optimizer state, for the FOR loop whose body is being compiled.
+ * Only innermost loops are optimized, so there is at most one of these.
+ *
+ * While compiling the body, loopstk[] shadows the operands of the
+ * expression being compiled, recording where the code for each starts and
+ * whether it depends on the loop.  Invariant expressions are moved to a
+ * preheader which runs once on entry to the loop and pushes their values
+ * to the call stack, where the body loads them from.  Products of the loop
+ * variable and an invariant are strength reduced the same way, and then
+ * stepped along with the loop variable rather than multiplied out.
+ */
+#define LOOPMAXMOD 16           /* Max vars assigned in the loop body  */
+#define LOOPMAXTMP 8            /* Max values kept on the call stack   */
+#define LOOPPRESZ  256          /* Max size of preheader code          */
+
+#define LV_VARIANT 0            /* Depends on the loop                 */
+#define LV_CONST   1            /* LDI                                 */
+#define LV_LEAF    2            /* Load of invariant scalar            */
+#define LV_EXPR    3            /* Invariant expression                */
+#define LV_INDUCT  4            /* Load of the loop variable           */
+#define LV_LINEAR  5            /* Loop var * invariant (+/- invariant) */
+
+#define LOOPINV(k) ((k >= LV_CONST) && (k <= LV_EXPR))
+
+struct loopval {
+    unsigned int pc;            /* Runtime PC where its code starts    */
+    unsigned char kind;         /* LV_xxx                              */
+    unsigned char step[3];      /* LV_LINEAR: loads amount to step by  */
+};
+
+struct looptmp {
+    unsigned int addr;          /* Address on call stack               */
+    unsigned char linear;       /* 1 if stepped with the loop variable */
+    unsigned char step[3];      /* Loads amount to step by             */
+};
+
+THREADLOCAL char loopopt = 0;               /* 1 when compiling an optimized loop  */
+THREADLOCAL char loopvar[VARNUMCHARS];      /* Name of the loop variable           */
+THREADLOCAL char loopmods[LOOPMAXMOD][VARNUMCHARS]; /* Vars assigned in the body   */
+THREADLOCAL unsigned char nloopmods;
+THREADLOCAL unsigned int loopjmp;           /* Operand of JMP to the preheader     */
+THREADLOCAL struct looptmp looptmps[LOOPMAXTMP];
+THREADLOCAL unsigned char nlooptmps = 0;
+THREADLOCAL unsigned char looppre[LOOPPRESZ];       /* Preheader code              */
+THREADLOCAL unsigned int looppresz;
+THREADLOCAL struct loopval loopstk[2 * STACKSZ];
+THREADLOCAL unsigned char loopsp = 0;
+#endif
 
 #ifdef EXTMEMCODE
 unsigned char *codestart;       /* Start address of VM code in ext mem */
@@ -226,12 +371,12 @@ struct lineofcode {
 /*
  * Pointer to current line
  */
-struct lineofcode *current = NULL;
+THREADLOCAL struct lineofcode *current = NULL;
 
 /*
  * Used as a line number counter
  */
-int counter;
+THREADLOCAL int counter;
 
 /*
  * Holds the return value from a subroutine / function
@@ -360,6 +505,8 @@ const char unaryops[] = "-+!~*^";
 #define ERR_STCONST 124         /* Const value reqd   */
 #define ERR_TOOLONG 125         /* Initializer too lng */
 #define ERR_LINK    126         /* Linkage error      */
+#define ERR_XLATE   127         /* Can't translate    */
+#define ERR_UNSUPP  128         /* Not on this system */
 
 char *errmsgs[] = {
     "no if",                    /* ERR_NOIF    */
@@ -387,9 +534,26 @@ char *errmsgs[] = {
     "not const",                /* ERR_CONST   */
     "const",                    /* ERR_STCONST */
     "too long",                 /* ERR_TOOLONG */
-    "link"                      /* ERR_LINK    */
+    "link",                     /* ERR_LINK    */
+    "xlate",                    /* ERR_XLATE   */
+    "unsupported"               /* ERR_UNSUPP  */
 };
 
+#ifdef __GNUC__
+/*
+ * Batch mode error reporting.  Prints msg to stderr, with the file name
+ * and the line number if a line is being compiled.
+ */
+void diag(char *msg)
+{
+    if (current) {
+        fprintf(stderr, "%s:%d: %s\n", batchfile, counter + 1, msg);
+    } else {
+        fprintf(stderr, "%s: %s\n", batchfile, msg);
+    }
+}
+#endif
+
 /*
  * Error reporting
  */
@@ -398,6 +562,13 @@ char *errmsgs[] = {
 #endif
 void error(unsigned char errcode)
 {
+    ++errors;
+#ifdef __GNUC__
+    if (batchfile) {
+        diag(errmsgs[errcode - ERR_FIRST]);
+        return;
+    }
+#endif
     printchar('?');
     print(errmsgs[errcode - ERR_FIRST]);
 }
@@ -491,6 +662,11 @@ unsigned char pop_operator_stack()
 void push_operand_stack(int operand)
 {
     if (compile) {
+#ifdef __GNUC__
+        if (loopopt) {
+            looppush(rtPC, LV_CONST);
+        }
+#endif
         emitldi(operand);
         return;
     }
@@ -606,8 +782,35 @@ unsigned char pop_operator()
 {
     int operand2;
     int result;
+    int operand1;
     int token = pop_operator_stack();
-    int operand1 = pop_operand_stack();
+    unsigned char folding = 0;
+
+    /*
+     * If compiling and the operands are constants, evaluate the operator
+     * now rather than at runtime.  The LDI instructions which pushed the
+     * operands are taken back, the operands placed on the operand stack and
+     * the operation is interpreted.  The result is emitted as a single LDI.
+     */
+    if (compile && canfold(token)) {
+        folding = 1;
+        compile = 0;
+        if (!ISUNARY(token)) {
+            push_operand_stack(previmm & 0xffff);
+        }
+        push_operand_stack(lastimm & 0xffff);
+        unemit(ISUNARY(token) ? 3 : 6);
+#ifdef __GNUC__
+        if (loopopt) {
+            /* The result is pushed as a new constant below */
+            loopsp -= (ISUNARY(token) ? 1 : 2);
+        }
+    } else if (compile && loopopt) {
+        loopop(token);
+#endif
+    }
+
+    operand1 = pop_operand_stack();
 
     if (!ISUNARY(token)) {
 
@@ -816,6 +1019,9 @@ unsigned char pop_operator()
             EXIT(99);
         }
     }
+    if (folding) {
+        compile = 1;
+    }
     push_operand_stack(result);
     return 0;
 }
@@ -971,6 +1177,9 @@ unsigned char P()
     unsigned char addressmode;  /* Set to 1 if there is '&' */
     int arg = 0;
     unsigned char type;
+#ifdef __GNUC__
+    unsigned int pc;            /* Where the code for operand starts */
+#endif
 
     eatspace();
 
@@ -982,6 +1191,9 @@ unsigned char P()
     if ((*txtPtr == '&') || (isalphach(*txtPtr))) {
 
         addressmode = 0;
+#ifdef __GNUC__
+        pc = rtPC;
+#endif
 
         /*
          * Handle address-of operator
@@ -1118,6 +1330,11 @@ unsigned char P()
         if (getintvar(key, idx, &arg, &type, addressmode)) {
             return 1;
         }
+#ifdef __GNUC__
+        if (compile && loopopt) {
+            loopload(key, pc, idx);
+        }
+#endif
 
         /* If onlyconstants is set then only allow const variables */
         if (onlyconstants && !(type & 0x20)) {
@@ -1225,6 +1442,11 @@ unsigned char eval(unsigned char checkNoMore, int *val)
     if (E()) {
         return 1;
     }
+#ifdef __GNUC__
+    if (compile && loopopt) {
+        loopfinish();
+    }
+#endif
     if (checkNoMore == 1) {
         if (*txtPtr == ';') {
             goto doret;
@@ -1248,7 +1470,7 @@ unsigned char eval(unsigned char checkNoMore, int *val)
  * Everything below is the rest of the language implementation.
  */
 
-unsigned char *heap1Ptr;        /* Arena 1: top-down stack */
+THREADLOCAL unsigned char *heap1Ptr;        /* Arena 1: top-down stack */
 unsigned char *heap2PtrTop;     /* Arena 2: top-down stack */
 unsigned char *heap2PtrBttm;    /* Arena 2: bottom-up heap */
 
@@ -1344,7 +1566,11 @@ unsigned char *auxmemPtrBttm;   /* Auxiliary memory: bottom up heap */
 #ifdef __GNUC__
 
 #define HEAP1SZ 1024*16
-unsigned char heap1[HEAP1SZ];
+#ifdef EBLIB
+unsigned char *heap1;           /* Heap of the active context (see eb_use()) */
+#else
+THREADLOCAL unsigned char heap1[HEAP1SZ];
+#endif
 #define HEAP1TOP (heap1 + HEAP1SZ - 1)
 #define HEAP1LIM heap1
 
@@ -1363,9 +1589,12 @@ unsigned char heap1[HEAP1SZ];
 
 /*
  * Clears heap 2 top-down stack.  Must call this before using alloc2top().
+ * On Linux the blocks are malloc()ed, and this frees them.
  */
 #ifdef CC65
 #define CLEARHEAP2TOP() heap2PtrTop = HEAP2TOP
+#else
+#define CLEARHEAP2TOP() free2top()
 #endif
 
 /*
@@ -1389,9 +1618,9 @@ unsigned char heap1[HEAP1SZ];
  * Called before compilation begins.
  */
 #ifdef EXTMEMCODE
-#define CLEARRTCALLSTACK() rtSP = RTCALLSTACKTOP; rtFP = rtSP; rtPC = RTPCSTART; codeptr = auxmemPtrBttm; codestart = codeptr;
+#define CLEARRTCALLSTACK() rtSP = RTCALLSTACKTOP; rtFP = rtSP; rtPC = RTPCSTART; codeptr = auxmemPtrBttm; codestart = codeptr; lastop = VM_END;
 #else
-#define CLEARRTCALLSTACK() rtSP = RTCALLSTACKTOP; rtFP = rtSP; rtPC = RTPCSTART; codeptr = CODESTART;
+#define CLEARRTCALLSTACK() rtSP = RTCALLSTACKTOP; rtFP = rtSP; rtPC = RTPCSTART; codeptr = CODESTART; lastop = VM_END;
 #endif
 
 /*
@@ -1449,18 +1678,46 @@ void rt_pop_callstack(unsigned int bytes)
     rtSP += bytes;
 }
 
+#ifdef __GNUC__
+/*
+ * Blocks from alloc2top() are chained together through a header, newest
+ * first, so that free2top() can free them all.
+ */
+struct heap2blk {
+    struct heap2blk *next;
+};
+
+THREADLOCAL struct heap2blk *heap2top = NULL;
+
+/*
+ * Free everything allocated with alloc2top().
+ */
+void free2top()
+{
+    struct heap2blk *b;
+
+    while (heap2top) {
+        b = heap2top->next;
+        free(heap2top);
+        heap2top = b;
+    }
+}
+#endif
+
 /*
  * Allocate bytes on the stack at the top of heap 2.
  */
 void *alloc2top(unsigned int bytes)
 {
 #ifdef __GNUC__
-    void *p = malloc(bytes);
-    if (!p) {
+    struct heap2blk *b = malloc(sizeof(struct heap2blk) + bytes);
+    if (!b) {
         print("No mem (2)!\n");
         longjmp(jumpbuf, 1);
     }
-    return p;
+    b->next = heap2top;
+    heap2top = b;
+    return b + 1;
 #else
     if ((heap2PtrTop - bytes) < heap2PtrBttm) {
         print("No mem (2)!\n");
@@ -1669,6 +1926,28 @@ void copyfromaux2(char *auxptr, unsigned char len) {
 }
 #endif
 
+/*
+ * Compiler: Record instruction about to be emitted at rtPC in histop[] etc.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void pushhist(enum bytecode code, int word)
+{
+    unsigned char i;
+    for (i = HISTSZ - 1; i > 0; --i) {
+        histop[i] = histop[i - 1];
+        histpc[i] = histpc[i - 1];
+        histimm[i] = histimm[i - 1];
+    }
+    lastop = code;
+    lastoppc = rtPC;
+    lastimm = word;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
 /*
  * Compiler: Emit simple one byte code
  * Used for everything except immediate mode opcodes
@@ -1697,6 +1976,7 @@ void emit(enum bytecode code)
     print(bytecodenames[c]);
     printchar('\n');
 */
+    pushhist(code, 0);
     ++rtPC;
 }
 #ifdef A2E
@@ -1723,12 +2003,145 @@ void emit_imm(enum bytecode code, int word)
     *codeptr++ = *p++;
     *codeptr++ = *p;
 #endif
+    pushhist(code, word);
     rtPC += 3;
 }
 #ifdef A2E
 #pragma code-name (pop)
 #endif
 
+#ifdef __GNUC__
+/*
+ * Compiler: Emit two byte instruction, with function code fn following the
+ * opcode.  These are only used by the statements which are Linux only.
+ */
+void emit_fn(enum bytecode code, unsigned char fn)
+{
+    *codeptr++ = code;
+    *codeptr++ = fn;
+    pushhist(code, fn);
+    rtPC += 2;
+}
+#endif
+
+/*
+ * Compiler: Emit a branch which is taken if the value of the expression just
+ * compiled is false.  If the expression ended in a comparison or a logical
+ * NOT then it is folded into the branch instruction, saving a trip through
+ * the eval stack.
+ * Returns the address of the branch destination operand, to be fixed up later.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned int emit_brfalse(void)
+{
+    /* Inverse of VM_GT .. VM_NEQL */
+    static const unsigned char invbranch[] = {
+        VM_BRLTEIMM, VM_BRLTIMM, VM_BRGTEIMM, VM_BRGTIMM, VM_BRNEQLIMM, VM_BREQLIMM
+    };
+    unsigned char op = VM_BRZIMM;
+
+    if (lastoppc == rtPC - 1) {
+        if ((lastop >= VM_GT) && (lastop <= VM_NEQL)) {
+            op = invbranch[lastop - VM_GT];
+            if (((op == VM_BRNEQLIMM) || (op == VM_BREQLIMM)) &&
+                (prevop == VM_LDIMM) && (prevoppc == rtPC - 4) && (previmm == 0)) {
+                /* Comparing with zero - just test X */
+                op = (op == VM_BRNEQLIMM) ? VM_BRNCHIMM : VM_BRZIMM;
+                unemit(4);
+            } else {
+                unemit(1);
+            }
+        } else if (lastop == VM_NOT) {
+            op = VM_BRNCHIMM;
+            unemit(1);
+        }
+    }
+    emit_imm(op, 0xffff);       /* To be filled in later */
+    return rtPC - 2;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Compiler: Discard the last len bytes of code emitted, so the optimizer
+ * can replace them with something better.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void unemit(unsigned char len)
+{
+    unsigned char i;
+
+    codeptr -= len;
+    rtPC -= len;
+
+    /* Forget the instructions which were taken back */
+    while ((lastop != VM_END) && (lastoppc >= rtPC)) {
+        for (i = 0; i < HISTSZ - 1; ++i) {
+            histop[i] = histop[i + 1];
+            histpc[i] = histpc[i + 1];
+            histimm[i] = histimm[i + 1];
+        }
+        histop[HISTSZ - 1] = VM_END;
+    }
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Compiler: Constant folding.
+ * Returns 1 if the operand(s) of operator token were just pushed using LDI
+ * and the operation can be evaluated at compile time giving the same result
+ * as the VM would.  The VM does unsigned 16 bit arithmetic, so operations
+ * which care about sign are only folded if both operands are < $8000.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char canfold(int token)
+{
+    unsigned int op1 = lastimm & 0xffff;
+    unsigned int op2 = previmm & 0xffff;
+
+    if ((lastop != VM_LDIMM) || (lastoppc != rtPC - 3)) {
+        return 0;
+    }
+    if (ISUNARY(token)) {
+        return ((token == TOK_UNM) || (token == TOK_NOT) || (token == TOK_BITNOT));
+    }
+    if ((prevop != VM_LDIMM) || (prevoppc != rtPC - 6)) {
+        return 0;
+    }
+    switch (token) {
+    case TOK_DIV:
+    case TOK_MOD:
+        if (!op1) {
+            /* Leave division by zero for runtime */
+            return 0;
+        }
+        /* Fall through */
+    case TOK_POW:
+    case TOK_MUL:
+    case TOK_GT:
+    case TOK_GTE:
+    case TOK_LT:
+    case TOK_LTE:
+        return ((op1 < 0x8000) && (op2 < 0x8000));
+    case TOK_LSH:
+    case TOK_RSH:
+        return ((op1 < 16) && (op2 < 0x8000));
+    }
+    return 1;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
 /*
  * Compiler: Emit PRMSG and string argument.
  * String is in readbuf
@@ -1797,177 +2210,529 @@ void emit_fixup(int address, int word)
 #pragma code-name (pop)
 #endif
 
+#ifdef __GNUC__
+
+#define LS_MORE 0               /* Keep scanning                       */
+#define LS_END  1               /* Found the endfor                    */
+#define LS_NO   2               /* Found something we can't optimize   */
+
 /*
- * Write code to file.
- * Call this after compilation is done.
+ * Loop optimizer: returns 1 if name is assigned in the loop body.
  */
-#ifdef A2E
-#pragma code-name (push, "LC")
-#endif
-void writebytecode()
+unsigned char loopmodified(char *name)
 {
-    unsigned char *end = codeptr;
-    unsigned char *p;
-    unsigned char *q;
-#ifdef EXTMEMCODE
-    p = (unsigned char *) codestart;
-#else
-    p = (unsigned char *) CODESTART;
-#endif
-    strcpy(readbuf, filename);
-    printchar('\n');
-    openfile(1);
-    print("...\n");
-    while (p < end) {
-#ifdef EXTMEMCODE
-        copybytefromaux(p);
-        q = embuf;
-#else
-        q = p;
-#endif
-#ifdef CBM
-        cbm_write(1, q, 1);
-#else
-        fwrite(q, 1, 1, fd);
-#endif
-        ++p;
+    unsigned char i;
+    for (i = 0; i < nloopmods; ++i) {
+        if (!strncmp(loopmods[i], name, VARNUMCHARS)) {
+            return 1;
+        }
     }
-#ifdef CBM
-    cbm_close(1);
-#else
-    fclose(fd);
-#endif
+    return 0;
 }
-#ifdef A2E
-#pragma code-name (pop)
-#endif
 
 /*
- * Values:
- *  0 not editing program
- *  1 editing program
- *  2 editing program - insert first line
- */
-unsigned char editmode = 0;
+ * Loop optimizer: scan the statements in the text at p, which is part of
+ * the body of the loop being entered.
+ * On pass 1, collect the names of the variables assigned in loopmods[].
+ * On pass 2, count in hits the places which look worth optimizing: an
+ * operator applied to two invariant operands, at least one of which is a
+ * variable, or the loop variable multiplied by an invariant.
+ * Only assignments, if/else/endif, return, end and pr.xxx are allowed in
+ * the body, so that the only variables which change are the ones assigned
+ * by name, and nothing in the body depends on the call stack pointer.
+ * Returns LS_MORE, LS_END or LS_NO.
+ */
+unsigned char loopscanline(char *p, unsigned char pass, unsigned int *hits)
+{
+    char word[12];
+    char name[VARNUMCHARS];
+    char *q;
+    unsigned char i;
+    unsigned char kind;         /* Of the operand just seen     */
+    unsigned char prev;         /* Of the operand before it     */
+    char op;                    /* Operator between them, if any */
 
-/*
- * Pointer to first line of code.
- */
-struct lineofcode *program = NULL;
+    for (;;) {
+        while ((*p == ' ') || (*p == ';')) {
+            ++p;
+        }
+        if (!(*p) || (*p == '\'')) {
+            /* End of line or comment */
+            return LS_MORE;
+        }
 
-/*
- * skipFlag is set to one when we enter a body of code which we are not
- * executing (for example because a while loop condition was false.)  When
- * skipFlag is one, the parser will only process certain loop control tokens
- * - all others are ignored.
- */
-unsigned char skipFlag;
+        i = 0;
+        while (isalphach(*p) || isdigitch(*p) || (*p == '.')) {
+            if (i < sizeof(word) - 1) {
+                word[i++] = *p;
+            }
+            ++p;
+        }
+        word[i] = '\0';
 
-/*
- * Append a line to the program
- * The new line will be appended after current
- * and current will be moved forward to point to the newly added line.
- */
-#ifdef A2E
-#pragma code-name (push, "LC")
-#endif
-void appendline(char *line)
-{
-    struct lineofcode *loc = alloc2bttm(sizeof(struct lineofcode));
+        if (!strcmp(word, "endfor")) {
+            return LS_END;
+        }
+        if (strncmp(word, "pr.", 3) && strcmp(word, "if") && strcmp(word, "else") &&
+            strcmp(word, "endif") && strcmp(word, "return") && strcmp(word, "end")) {
 
-#ifdef EXTMEM
-    loc->line = allocauxmem(sizeof(char) * strlen(line) + 1);
-    copytoaux(loc->line, line);
-    loc->len = strlen(line);
-#else
-    loc->line = alloc2bttm(sizeof(char) * (strlen(line) + 1));
-    strcpy(loc->line, line);
-#endif
-    loc->next = current->next;
-    current->next = loc;
-    current = loc;
+            /*
+             * Anything else has to be an assignment to a variable.
+             * Pokes, library calls, declarations, calls and other loops
+             * all end up here and are rejected.
+             */
+            if (!i || !isalphach(word[0]) || strchr(word, '.')) {
+                return LS_NO;
+            }
+            q = p;
+            while (*q == ' ') {
+                ++q;
+            }
+            if (*q == '[') {
+                i = 0;
+                do {
+                    if (*q == '[') {
+                        ++i;
+                    } else if (*q == ']') {
+                        --i;
+                    }
+                    ++q;
+                } while (*q && i);
+                while (*q == ' ') {
+                    ++q;
+                }
+            }
+            if ((*q != '=') || (*(q + 1) == '=')) {
+                return LS_NO;
+            }
+            if ((pass == 1) && !loopmodified(word)) {
+                if (nloopmods == LOOPMAXMOD) {
+                    return LS_NO;
+                }
+                strncpy(loopmods[nloopmods++], word, VARNUMCHARS);
+            }
+        }
+
+        /*
+         * Look at the operands in the rest of the statement
+         */
+        prev = LV_VARIANT;
+        op = 0;
+        while (*p && (*p != ';')) {
+            if (*p == '"') {
+                ++p;
+                while (*p && (*p != '"')) {
+                    ++p;
+                }
+                if (*p) {
+                    ++p;
+                }
+                prev = LV_VARIANT;
+                op = 0;
+                continue;
+            }
+            if ((*p == '\'') && *(p + 1) && (*(p + 2) == '\'')) {
+                p += 3;
+                kind = LV_CONST;
+            } else if (isdigitch(*p) || (*p == '$')) {
+                ++p;
+                while (isalphach(*p) || isdigitch(*p)) {
+                    ++p;
+                }
+                kind = LV_CONST;
+            } else if (isalphach(*p)) {
+                q = p;
+                while (isalphach(*p) || isdigitch(*p)) {
+                    ++p;
+                }
+                for (i = 0; i < VARNUMCHARS; ++i) {
+                    name[i] = (q + i < p) ? *(q + i) : '\0';
+                }
+                while (*p == ' ') {
+                    ++p;
+                }
+                if (*p == '(') {
+                    /* Function call */
+                    return LS_NO;
+                }
+                if ((*p == '[') || loopmodified(name)) {
+                    kind = LV_VARIANT;
+                } else if (!strncmp(name, loopvar, VARNUMCHARS)) {
+                    kind = LV_INDUCT;
+                } else {
+                    kind = LV_LEAF;
+                }
+            } else {
+                if (strchr("+-*/%&|^<>=!", *p)) {
+                    if (!op) {
+                        op = *p;
+                    }
+                } else if (*p != ' ') {
+                    prev = LV_VARIANT;
+                    op = 0;
+                }
+                ++p;
+                continue;
+            }
+            if ((pass == 2) && op) {
+                if ((LOOPINV(prev) && LOOPINV(kind) && ((prev == LV_LEAF) || (kind == LV_LEAF))) ||
+                    ((op == '*') && (((prev == LV_INDUCT) && LOOPINV(kind)) ||
+                                     (LOOPINV(prev) && (kind == LV_INDUCT))))) {
+                    ++(*hits);
+                }
+            }
+            prev = kind;
+            op = 0;
+        }
+    }
+}
+
+/*
+ * Loop optimizer: called on entry to a FOR loop, with txtPtr just after
+ * the FOR statement.  Look ahead through the body to the endfor to see if
+ * the loop can and should be optimized.  name is the loop variable.
+ * Returns 1 if so.
+ */
+unsigned char loopscan(char *name)
+{
+    struct lineofcode *l;
+    unsigned char pass;
+    unsigned char r;
+    unsigned int hits = 0;
+
+    strncpy(loopvar, name, VARNUMCHARS);
+    nloopmods = 0;
+    for (pass = 1; pass <= 2; ++pass) {
+        r = loopscanline(txtPtr, pass, &hits);
+        l = current->next;
+        while ((r == LS_MORE) && l) {
+            r = loopscanline(l->line, pass, &hits);
+            l = l->next;
+        }
+        if (r != LS_END) {
+            return 0;
+        }
+    }
+    return (hits != 0);
+}
+
+/*
+ * Loop optimizer: start of the body of an optimized loop.  Jump to the
+ * preheader, which is emitted by loopend().
+ */
+void loopbegin(void)
+{
+    loopopt = 1;
+    nlooptmps = 0;
+    looppresz = 0;
+    loopsp = 0;
+    emit_imm(VM_JMPIMM, 0xffff);        /* Fixed up by loopend() */
+    loopjmp = rtPC - 2;
+}
+
+/*
+ * Loop optimizer: record that the code for an operand starts at pc.
+ */
+void looppush(unsigned int pc, unsigned char kind)
+{
+    if (loopsp == sizeof(loopstk) / sizeof(loopstk[0])) {
+        error(ERR_COMPLEX);
+        longjmp(jumpbuf, 1);
+    }
+    loopstk[loopsp].pc = pc;
+    loopstk[loopsp].kind = kind;
+    ++loopsp;
+}
+
+/*
+ * Loop optimizer: code to load variable name has been emitted from pc.
+ * If idx is not -1 it consumed a subscript.
+ */
+void loopload(char *name, unsigned int pc, int idx)
+{
+    unsigned char op = *(CODESTART + pc - RTPCSTART);
+    unsigned char kind = LV_VARIANT;
+
+    if ((idx != -1) && loopsp) {
+        --loopsp;
+    }
+    if ((rtPC - pc == 3) &&
+        ((op == VM_LDAWORDIMM) || (op == VM_LDABYTEIMM) ||
+         (op == VM_LDRWORDIMM) || (op == VM_LDRBYTEIMM)) && !loopmodified(name)) {
+        kind = strncmp(name, loopvar, VARNUMCHARS) ? LV_LEAF : LV_INDUCT;
+    }
+    looppush(pc, kind);
+}
+
+/*
+ * Loop optimizer: move the code for loopstk[i] to the preheader, which
+ * pushes its value to the call stack, and load it from there instead.
+ * The code for the operands after it moves down to close the gap.  That
+ * is all expression code with no calls, so does not mind where it is.
+ */
+void loophoist(unsigned char i)
+{
+    struct loopval *v = &loopstk[i];
+    struct looptmp *t = &looptmps[nlooptmps];
+    unsigned char *p = CODESTART + v->pc - RTPCSTART;
+    unsigned int end = ((i + 1) < loopsp) ? loopstk[i + 1].pc : rtPC;
+    unsigned int len = end - v->pc;
+    int delta = 3 - len;
+    unsigned char j;
+
+    if ((nlooptmps == LOOPMAXTMP) || (looppresz + len >= LOOPPRESZ)) {
+        /* No room, so leave it be */
+        v->kind = LV_VARIANT;
+        return;
+    }
+    memcpy(looppre + looppresz, p, len);
+    looppresz += len;
+    looppre[looppresz++] = VM_PSHWORD;
+
+    rt_push_callstack(2);
+    t->addr = (compilingsub ? (rtSP - rtFP) : (rtSP + 1));
+    t->linear = (v->kind == LV_LINEAR);
+    memcpy(t->step, v->step, 3);
+    ++nlooptmps;
+
+    memmove(p + 3, p + len, rtPC - end);
+    *p = (compilingsub ? VM_LDRWORDIMM : VM_LDAWORDIMM);
+    *(p + 1) = t->addr & 0xff;
+    *(p + 2) = (t->addr >> 8) & 0xff;
+    rtPC += delta;
+    codeptr += delta;
+    for (j = i + 1; j < loopsp; ++j) {
+        loopstk[j].pc += delta;
+    }
+    v->kind = LV_LEAF;
+
+    /* Don't let the optimizer look back at code which has moved */
+    for (j = 0; j < HISTSZ; ++j) {
+        histop[j] = VM_END;
+    }
+}
+
+/*
+ * Loop optimizer: loopstk[i] is not going to get any bigger, so hoist it
+ * if it is worth it.
+ */
+void loopdone(unsigned char i)
+{
+    if ((loopstk[i].kind == LV_EXPR) || (loopstk[i].kind == LV_LINEAR)) {
+        loophoist(i);
+    }
+}
+
+/*
+ * Loop optimizer: end of an expression.
+ */
+void loopfinish(void)
+{
+    if (loopsp) {
+        loopdone(loopsp - 1);
+    }
+}
+
+/*
+ * Loop optimizer: about to emit code for operator token, whose operand(s)
+ * are on top of loopstk[].  Work out what the result depends on, hoisting
+ * any invariant operand which is being combined with something that is not.
+ */
+void loopop(int token)
+{
+    struct loopval *a;
+    struct loopval *b;
+    unsigned char *p;
+    unsigned char kind = LV_VARIANT;
+
+    if (ISUNARY(token)) {
+        if (!loopsp || (token == TOK_UNP)) {
+            return;
+        }
+        a = &loopstk[loopsp - 1];
+        if (LOOPINV(a->kind) && (token != TOK_STAR) && (token != TOK_CARET)) {
+            a->kind = LV_EXPR;
+        } else {
+            loopdone(loopsp - 1);
+            a->kind = LV_VARIANT;
+        }
+        return;
+    }
+
+    if (loopsp < 2) {
+        return;
+    }
+    a = &loopstk[loopsp - 2];
+    b = &loopstk[loopsp - 1];
+
+    if (LOOPINV(a->kind) && LOOPINV(b->kind)) {
+        /* Don't hoist a division which might not have been done */
+        p = CODESTART + b->pc - RTPCSTART;
+        if (((token != TOK_DIV) && (token != TOK_MOD)) ||
+            ((b->kind == LV_CONST) && (*(p + 1) || *(p + 2)))) {
+            kind = LV_EXPR;
+        }
+    } else if ((token == TOK_MUL) && (a->kind == LV_INDUCT) && LOOPINV(b->kind)) {
+        /* Strength reduce i * n, stepping by n */
+        loopdone(loopsp - 1);
+        if (LOOPINV(b->kind)) {
+            memcpy(a->step, CODESTART + b->pc - RTPCSTART, 3);
+            kind = LV_LINEAR;
+        }
+    } else if ((token == TOK_MUL) && LOOPINV(a->kind) && (b->kind == LV_INDUCT)) {
+        /* n * i likewise */
+        loopdone(loopsp - 2);
+        if (LOOPINV(a->kind)) {
+            memcpy(a->step, CODESTART + a->pc - RTPCSTART, 3);
+            kind = LV_LINEAR;
+        }
+    } else if (((token == TOK_ADD) || (token == TOK_SUB)) &&
+               (a->kind == LV_LINEAR) && LOOPINV(b->kind)) {
+        /* Adding an invariant doesn't change the step */
+        kind = LV_LINEAR;
+    } else if ((token == TOK_ADD) && LOOPINV(a->kind) && (b->kind == LV_LINEAR)) {
+        memcpy(a->step, b->step, 3);
+        kind = LV_LINEAR;
+    }
+
+    if (kind == LV_VARIANT) {
+        loopdone(loopsp - 2);
+        loopdone(loopsp - 1);
+    }
+    --loopsp;
+    a->kind = kind;
+}
+
+/*
+ * Loop optimizer: emit code to step the strength reduced values along with
+ * the loop variable, at the end of the loop body.
+ */
+void loopstep(void)
+{
+    unsigned char i;
+    struct looptmp *t;
+
+    for (i = 0; i < nlooptmps; ++i) {
+        t = &looptmps[i];
+        if (t->linear) {
+            emit_imm(compilingsub ? VM_LDRWORDIMM : VM_LDAWORDIMM, t->addr);
+            emit_imm((enum bytecode) t->step[0], t->step[1] | (t->step[2] << 8));
+            emit(VM_ADD);
+            emit_imm(compilingsub ? VM_STRWORDIMM : VM_STAWORDIMM, t->addr);
+        }
+    }
+}
+
+/*
+ * Loop optimizer: end of an optimized loop, head being the top of the
+ * loop body.  Emit the preheader, jumping round it on the way out.  If
+ * nothing was hoisted, the jump to it just goes to the top of the loop.
+ */
+void loopend(unsigned int head)
+{
+    unsigned int skip;
+
+    if (!loopopt) {
+        return;
+    }
+    loopopt = 0;
+    if (!nlooptmps) {
+        emit_fixup(loopjmp, head);
+        return;
+    }
+    emit_imm(VM_JMPIMM, 0xffff);
+    skip = rtPC - 2;
+    emit_fixup(loopjmp, rtPC);
+    memcpy(codeptr, looppre, looppresz);
+    codeptr += looppresz;
+    rtPC += looppresz;
+    emit_imm(VM_JMPIMM, head);
+    emit_fixup(skip, rtPC);
+    nlooptmps = 0;
 }
-#ifdef A2E
-#pragma code-name (pop)
 #endif
 
 /*
- * Insert new first line (special case)
+ * Output to the file opened by openfile() is collected in wrbuf and
+ * written a block at a time, as each call to write to disk is slow on the
+ * 8 bit machines.  On the Apple II embuf2 is used, as it is not otherwise
+ * in use while a file is being written.
+ */
+#ifdef EXTMEM
+#define wrbuf embuf2
+#define WRBUFSZ 255
+#elif defined(__GNUC__)
+#define WRBUFSZ 4096
+char wrbuf[WRBUFSZ];
+#else
+#define WRBUFSZ 128
+char wrbuf[WRBUFSZ];
+#endif
+unsigned int wrlen = 0;         /* Number of bytes in wrbuf */
+unsigned char wrerr = 0;        /* Set if a write failed    */
+
+/*
+ * Write the contents of wrbuf to the file.
  */
 #ifdef A2E
 #pragma code-name (push, "LC")
 #endif
-void insertfirstline(char *line)
+void flushwrite()
 {
-    struct lineofcode *loc = alloc2bttm(sizeof(struct lineofcode));
-
-#ifdef EXTMEM
-    loc->line = allocauxmem(sizeof(char) * strlen(line) + 1);
-    copytoaux(loc->line, line);
-    loc->len = strlen(line);
+    if (wrlen) {
+#ifdef CBM
+        if (cbm_write(1, wrbuf, wrlen) != wrlen) {
 #else
-    loc->line = alloc2bttm(sizeof(char) * (strlen(line) + 1));
-    strcpy(loc->line, line);
+        if (fwrite(wrbuf, 1, wrlen, fd) != wrlen) {
 #endif
-    loc->next = program;
-    program = loc;
+            wrerr = 1;
+        }
+        wrlen = 0;
+    }
 }
 #ifdef A2E
 #pragma code-name (pop)
 #endif
 
 /*
- * Make current point to the line with number linenum
- * (or NULL if not found).
- * Line numbers start from one in this routine.
+ * Write len bytes at p to the file opened by openfile().
  */
-void findline(int linenum)
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void writebytes(char *p, unsigned int len)
 {
-    counter = 1;
-    current = program;
-    while (current) {
-        if (counter == linenum) {
-            return;
+    unsigned int n;
+
+    while (len) {
+        n = WRBUFSZ - wrlen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(wrbuf + wrlen, p, n);
+        wrlen += n;
+        p += n;
+        len -= n;
+        if (wrlen == WRBUFSZ) {
+            flushwrite();
         }
-        current = current->next;
-        ++counter;
     }
 }
+#ifdef A2E
+#pragma code-name (pop)
+#endif
 
 /*
- * Delete line(s)
+ * Write one byte to the file opened by openfile().
  */
 #ifdef A2E
 #pragma code-name (push, "LC")
 #endif
-void deleteline(int startline, int endline)
+void writebyte(unsigned char b)
 {
-    int linesToDel = endline - startline + 1;
-    struct lineofcode *prev = NULL;
-
-    counter = 1;
-    if (endline < startline) {
-        return;
-    }
-    current = program;
-    while (current && linesToDel) {
-        if (counter == startline) {
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                program = current->next;
-            }
-#ifdef __GNUC__
-            free(current->line);
-            free(current);
-#endif
-            current = current->next;    /* ILLEGAL BUT WORKS FOR NOW */
-            --linesToDel;
-            continue;
-        }
-        prev = current;
-        current = current->next;
-        ++counter;
+    wrbuf[wrlen++] = b;
+    if (wrlen == WRBUFSZ) {
+        flushwrite();
     }
 }
 #ifdef A2E
@@ -1975,71 +2740,298 @@ void deleteline(int startline, int endline)
 #endif
 
 /*
- * Replace line pointed to by current
+ * Flush and close the file opened by openfile().
+ * Returns 0 if OK, 1 if any write failed.
  */
 #ifdef A2E
 #pragma code-name (push, "LC")
 #endif
-void changeline(char *line)
+unsigned char closewrite()
 {
-#ifdef __GNUC__
-    free(current->line);
-#endif
-
-#ifdef EXTMEM
-    current->line = allocauxmem(sizeof(char) * (strlen(line) + 1));
-    copytoaux(current->line, line);
+    flushwrite();
+#ifdef CBM
+    cbm_close(1);
 #else
-    current->line = alloc2bttm(sizeof(char) * (strlen(line) + 1));
-    strcpy(current->line, line);
+    if (fclose(fd)) {
+        wrerr = 1;
+    }
 #endif
+    if (wrerr) {
+        wrerr = 0;
+        error(ERR_FILE);
+        return 1;
+    }
+    return 0;
 }
 #ifdef A2E
 #pragma code-name (pop)
 #endif
 
 /*
- * Delete program, free memory.
+ * Write a little endian word to the file opened by openfile().
  */
 #ifdef A2E
 #pragma code-name (push, "LC")
 #endif
-void new()
+void writeword(unsigned int w)
 {
-#ifdef __GNUC__
-    struct lineofcode *l = program;
-    struct lineofcode *l2;
-
-    while (l) {
-        l2 = l->next;
-        free(l->line);
-        free(l);
-        l = l2;
-    }
-#else
-    /* No need to iterate and free them all, just dump the heap */
-    CLEARHEAP2TOP();
-    CLEARHEAP2BTTM();
-#ifdef EXTMEM
-    CLEARAUXMEM();
-#endif
-#endif
-    program = NULL;
-    current = NULL;
+    writebyte(w & 0xff);
+    writebyte(w >> 8);
 }
 #ifdef A2E
 #pragma code-name (pop)
 #endif
 
-/* 0 is the top level, 1 is first level sub call etc. */
-int calllevel;
-
 /*
- * Entry in the variable table
- * name: first VARNUMCHARS characters as key
- * type: encodes the type in the least significant 4 bits (bits 3:0) encode
- *       the data type (TYPE_WORD or TYPE_BYTE).  The next least significant
- *       bit (bit 4) is 0 for a scalar value and 1 for an array.  Bit 5 is
+ * Write code to file, with the header and relocation table described in
+ * eightballvm.h.
+ * Call this after compilation is done.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void writebytecode()
+{
+    unsigned int a;
+    unsigned int nrelocs = 0;
+#ifdef EXTMEMCODE
+    unsigned int n;
+#endif
+
+    for (a = RTPCSTART; a < rtPC; a += codelen(a)) {
+        if (hasaddr(getcodebyte(a))) {
+            ++nrelocs;
+        }
+    }
+    strcpy(readbuf, filename);
+    printchar('\n');
+    if (openfile(1)) {
+        return;
+    }
+    print("...\n");
+    writebyte(BCMAGIC);
+    writebyte(BCVERSION);
+    writeword(rtPC - RTPCSTART);
+    writeword(nrelocs);
+#ifdef EXTMEMCODE
+    /* Copy the code from aux memory in blocks */
+    for (a = RTPCSTART; a < rtPC; a += n) {
+        n = ((rtPC - a > 255) ? 255 : rtPC - a);
+        copyfromaux((char *) (codestart + a - RTPCSTART), n - 1);
+        writebytes(embuf, n);
+    }
+#else
+    writebytes((char *) CODESTART, rtPC - RTPCSTART);
+#endif
+    for (a = RTPCSTART; a < rtPC; a += codelen(a)) {
+        if (hasaddr(getcodebyte(a))) {
+            writeword(a + 1 - RTPCSTART);
+        }
+    }
+    closewrite();
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Values:
+ *  0 not editing program
+ *  1 editing program
+ *  2 editing program - insert first line
+ */
+unsigned char editmode = 0;
+
+/*
+ * Pointer to first line of code.
+ */
+struct lineofcode *program = NULL;
+
+/*
+ * skipFlag is set to one when we enter a body of code which we are not
+ * executing (for example because a while loop condition was false.)  When
+ * skipFlag is one, the parser will only process certain loop control tokens
+ * - all others are ignored.
+ */
+THREADLOCAL unsigned char skipFlag;
+
+/*
+ * Append a line to the program
+ * The new line will be appended after current
+ * and current will be moved forward to point to the newly added line.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void appendline(char *line)
+{
+    struct lineofcode *loc = alloc2bttm(sizeof(struct lineofcode));
+
+#ifdef EXTMEM
+    loc->line = allocauxmem(sizeof(char) * strlen(line) + 1);
+    copytoaux(loc->line, line);
+    loc->len = strlen(line);
+#else
+    loc->line = alloc2bttm(sizeof(char) * (strlen(line) + 1));
+    strcpy(loc->line, line);
+#endif
+    loc->next = current->next;
+    current->next = loc;
+    current = loc;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Insert new first line (special case)
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void insertfirstline(char *line)
+{
+    struct lineofcode *loc = alloc2bttm(sizeof(struct lineofcode));
+
+#ifdef EXTMEM
+    loc->line = allocauxmem(sizeof(char) * strlen(line) + 1);
+    copytoaux(loc->line, line);
+    loc->len = strlen(line);
+#else
+    loc->line = alloc2bttm(sizeof(char) * (strlen(line) + 1));
+    strcpy(loc->line, line);
+#endif
+    loc->next = program;
+    program = loc;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Make current point to the line with number linenum
+ * (or NULL if not found).
+ * Line numbers start from one in this routine.
+ */
+void findline(int linenum)
+{
+    counter = 1;
+    current = program;
+    while (current) {
+        if (counter == linenum) {
+            return;
+        }
+        current = current->next;
+        ++counter;
+    }
+}
+
+/*
+ * Delete line(s)
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void deleteline(int startline, int endline)
+{
+    int linesToDel = endline - startline + 1;
+    struct lineofcode *prev = NULL;
+
+    counter = 1;
+    if (endline < startline) {
+        return;
+    }
+    current = program;
+    while (current && linesToDel) {
+        if (counter == startline) {
+            if (prev) {
+                prev->next = current->next;
+            } else {
+                program = current->next;
+            }
+#ifdef __GNUC__
+            free(current->line);
+            free(current);
+#endif
+            current = current->next;    /* ILLEGAL BUT WORKS FOR NOW */
+            --linesToDel;
+            continue;
+        }
+        prev = current;
+        current = current->next;
+        ++counter;
+    }
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Replace line pointed to by current
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void changeline(char *line)
+{
+#ifdef __GNUC__
+    free(current->line);
+#endif
+
+#ifdef EXTMEM
+    current->line = allocauxmem(sizeof(char) * (strlen(line) + 1));
+    copytoaux(current->line, line);
+#else
+    current->line = alloc2bttm(sizeof(char) * (strlen(line) + 1));
+    strcpy(current->line, line);
+#endif
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Delete program, free memory.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void new()
+{
+#ifdef __GNUC__
+    struct lineofcode *l = program;
+    struct lineofcode *l2;
+
+    while (l) {
+        l2 = l->next;
+        free(l->line);
+        free(l);
+        l = l2;
+    }
+#else
+    /* No need to iterate and free them all, just dump the heap */
+    CLEARHEAP2TOP();
+    CLEARHEAP2BTTM();
+#ifdef EXTMEM
+    CLEARAUXMEM();
+#endif
+#endif
+    program = NULL;
+    current = NULL;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/* 0 is the top level, 1 is first level sub call etc. */
+THREADLOCAL int calllevel;
+
+/*
+ * Entry in the variable table
+ * name: first VARNUMCHARS characters as key
+ * type: encodes the type in the least significant 4 bits (bits 3:0) encode
+ *       the data type (TYPE_WORD or TYPE_BYTE).  The next least significant
+ *       bit (bit 4) is 0 for a scalar value and 1 for an array.  Bit 5 is
  *       0 for a normal variable and 1 for a constant.
  * next: pointer to next vartabent.
  */
@@ -2051,9 +3043,9 @@ struct vartabent {
 
 typedef struct vartabent var_t;
 
-var_t *varsbegin;               /* First table entry */
-var_t *varsend;                 /* Last table entry  */
-var_t *varslocal;               /* Local stack frame */
+THREADLOCAL var_t *varsbegin;               /* First table entry */
+THREADLOCAL var_t *varsend;                 /* Last table entry  */
+THREADLOCAL var_t *varslocal;               /* Local stack frame */
 
 /*
  * Entry in the subroutine table.  This is used by the compiler only.
@@ -2064,14 +3056,84 @@ struct subtabent {
     char name[SUBRNUMCHARS];
     unsigned int addr;
     struct subtabent *next;
+    struct subtabent *hnext;    /* Next entry point in same hash bucket */
 };
 
 typedef struct subtabent sub_t;
 
-sub_t *subsbegin;               /* Entry points of compiled subroutines - first */
-sub_t *subsend;                 /* Entry points of compiled subroutines - last  */
-sub_t *callsbegin;              /* Subroutine calls - first */
-sub_t *callsend;                /* Subroutine calls - end */
+THREADLOCAL sub_t *subsbegin;               /* Entry points of compiled subroutines - first */
+THREADLOCAL sub_t *subsend;                 /* Entry points of compiled subroutines - last  */
+THREADLOCAL sub_t *callsbegin;              /* Subroutine calls - first */
+THREADLOCAL sub_t *callsend;                /* Subroutine calls - end */
+
+/*
+ * Entry points are also kept in a hash table, so linksubs() does not have
+ * to search the whole list for each call.
+ */
+#define SUBHASHSZ 16            /* Must be a power of 2 */
+THREADLOCAL sub_t *subhash[SUBHASHSZ];
+
+/*
+ * Tail calls.  A call which is the whole of the expression in a RETURN
+ * statement, to a sub taking the same number of bytes of arguments as the
+ * sub being compiled, reuses the current stack frame.  The arguments are
+ * evaluated onto the eval stack, stored over the current arguments and
+ * then we jump to the sub rather than calling it.
+ */
+#define TAILCALLMAXARGS 8       /* Max args - they are held on eval stack */
+THREADLOCAL unsigned char subargbytes;      /* Bytes of args of sub being compiled */
+THREADLOCAL char *tailcallpos;              /* Start of expression in RETURN stmt  */
+THREADLOCAL unsigned char tailcalled;       /* Set if RETURN compiled as tail call */
+
+/*
+ * Inlining.  A call to a sub which consists only of a RETURN statement
+ * with a short expression which calls no subs, and which takes no array
+ * arguments, is expanded inline.  The arguments are pushed to the call
+ * stack as usual, but become temporaries in the caller's frame rather than
+ * the callee's, and the expression is compiled in place of the call.
+ * Add 'noinline' after the argument list of the sub to prevent this.
+ */
+#define INLINEMAXLEN 32         /* Max length of expression to inline  */
+
+#ifdef SUBTHREADS
+/*
+ * Compiling subs on threads.  Once the compiler has found a sub, its body
+ * depends only on the globals and consts declared before it, and on the
+ * text of the program.  With compjobs > 1, the batch compiler queues a job
+ * for each sub and skips to its endsub instead of compiling it.  The job
+ * holds a copy of the part of heap 1 with the variable table in it.  When
+ * the main program has been compiled, compilesubs() has worker threads
+ * compile the queued subs, each into its own heap 1 with its own compiler
+ * state, then appends the code of each in turn and adds its entry points
+ * and calls to the tables, for linksubs() to link as usual.
+ */
+struct subjob {
+    struct lineofcode *first;   /* Line with 'sub'                     */
+    struct lineofcode *last;    /* Line with 'endsub'                  */
+    int counter;                /* Line number of first                */
+    unsigned int rtsp;          /* rtSP at the sub                     */
+    int calllevel;
+    unsigned char *heap1;       /* Heap 1 the copy was made from       */
+    unsigned int varsoff;       /* Offset of heap1Ptr in it            */
+    unsigned char *vars;        /* Copy of heap 1 above that           */
+    var_t *varsbegin;           /* Variable table, in heap1            */
+    var_t *varsend;
+    var_t *varslocal;
+    unsigned char *code;        /* Compiled code, from RTPCSTART       */
+    unsigned int len;           /* Length of code                      */
+    sub_t *subs;                /* Entry points, addresses in code     */
+    sub_t *calls;               /* Calls, addresses in code            */
+    struct heap2blk *heap2;     /* Blocks from alloc2top() for these   */
+    unsigned int errors;        /* Number of errors reported           */
+    struct subjob *next;
+};
+
+struct subjob *subjobs;         /* Queued jobs, in order of the subs   */
+struct subjob *subjobsend;
+struct subjob *subjobnext;      /* Next job for a worker to take       */
+pthread_mutex_t subjobmutex = PTHREAD_MUTEX_INITIALIZER;
+THREADLOCAL char subthread = 0; /* 1 on a worker thread                */
+#endif
 
 #define getptrtoscalarword(v) (int*)((char*)v + sizeof(var_t))
 #define getptrtoscalarbyte(v) (unsigned char*)((char*)v + sizeof(var_t))
@@ -2524,18 +3586,11 @@ void vars_deletecallframe()
 
 /* Factored out to save a few bytes
  * Used by setintvar() only.
+ * op is the word variant of the indexed store.  Byte variant follows it.
  */
-void siv_st_abs(unsigned char type)
-{
-    ((type == TYPE_WORD) ? emit(VM_STAWORD) : emit(VM_STABYTE));
-}
-
-/* Factored out to save a few bytes
- * Used by setintvar() only.
- */
-void siv_st_rel(unsigned char type)
+void siv_st_idx(unsigned char op, unsigned int addr, unsigned char type)
 {
-    ((type == TYPE_WORD) ? emit(VM_STRWORD) : emit(VM_STRBYTE));
+    emit_imm(((type & 0x0f) == TYPE_WORD) ? op : op + 1, addr);
 }
 
 /* Factored out to save a few bytes
@@ -2627,30 +3682,18 @@ unsigned char setintvar(char *name, int idx, int value)
         bodyptr = (void *) *(int *) ((unsigned char *) ptr + sizeof(var_t));
 
         if (compile) {
-            /* *** Index is on the stack (X) */
-            emit(VM_SWAP);
-            if (type == TYPE_WORD) {
-                emitldi(1);
-                emit(VM_LSH);
-            }
-            emitldi((int) ((int *) bodyptr));
+            /* *** Index is on the stack (Y), value to store is X */
             /*
              * If the array size field is -1, this means the bodyptr is a
              * pointer to a pointer to the body (rather than pointer to
              * the body), so it needs to be dereferenced one more time.
              */
             if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
-                emit(VM_LDRWORD);
-            }
-            emit(VM_ADD);
-            if (local && compilingsub) {
-                if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
-                    siv_st_abs(type);
-                } else {
-                    siv_st_rel(type);
-                }
+                siv_st_idx(VM_STPWORDIDX, (int) ((int *) bodyptr), type);
+            } else if (local && compilingsub) {
+                siv_st_idx(VM_STRWORDIDX, (int) ((int *) bodyptr), type);
             } else {
-                siv_st_abs(type);
+                siv_st_idx(VM_STAWORDIDX, (int) ((int *) bodyptr), type);
             }
         } else {
             if ((idx < 0) || (idx >= *(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)))) {
@@ -2670,26 +3713,19 @@ unsigned char setintvar(char *name, int idx, int value)
 
 /* Factored out to save a few bytes
  * Used by getintvar() only.
+ * op is the word variant of the indexed load.  Byte variant follows it.
  */
-void giv_ld_abs(unsigned char type)
+void giv_ld_idx(unsigned char op, unsigned int addr, unsigned char type)
 {
-    (((type & 0x0f) == TYPE_WORD) ? emit(VM_LDAWORD) : emit(VM_LDABYTE));
+    emit_imm(((type & 0x0f) == TYPE_WORD) ? op : op + 1, addr);
 }
 
 /* Factored out to save a few bytes
  * Used by getintvar() only.
  */
-void giv_ld_rel(unsigned char type)
+void giv_ld_abs_imm(unsigned int addr, unsigned char type)
 {
-    (((type & 0x0f) == TYPE_WORD) ? emit(VM_LDRWORD) : emit(VM_LDRBYTE));
-}
-
-/* Factored out to save a few bytes
- * Used by getintvar() only.
- */
-void giv_ld_abs_imm(unsigned int addr, unsigned char type)
-{
-    emit_imm(((type & 0x0f) == TYPE_WORD) ? VM_LDAWORDIMM : VM_LDABYTEIMM, addr);
+    emit_imm(((type & 0x0f) == TYPE_WORD) ? VM_LDAWORDIMM : VM_LDABYTEIMM, addr);
 }
 
 /* Factored out to save a few bytes
@@ -2806,31 +3842,29 @@ unsigned char getintvar(char *name,
 
         if (compile) {
             /* *** Index is on the stack (X) *** */
-            if ((*type & 0x0f) == TYPE_WORD) {
-                emitldi(1);
-                emit(VM_LSH);
-            }
-            emitldi((int) ((int *) bodyptr));
             /*
              * If the array size field is -1, this means the bodyptr is a
              * pointer to a pointer to the body (rather than pointer to
              * the body), so it needs to be dereferenced one more time.
              */
-            if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
-                emit(VM_LDRWORD);
-            }
-            emit(VM_ADD);
             if (!address) {
-                if (local && compilingsub) {
-                    if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
-                        giv_ld_abs(*type);
-                    } else {
-                        giv_ld_rel(*type);
-                    }
+                if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
+                    giv_ld_idx(VM_LDPWORDIDX, (int) ((int *) bodyptr), *type);
+                } else if (local && compilingsub) {
+                    giv_ld_idx(VM_LDRWORDIDX, (int) ((int *) bodyptr), *type);
                 } else {
-                    giv_ld_abs(*type);
+                    giv_ld_idx(VM_LDAWORDIDX, (int) ((int *) bodyptr), *type);
                 }
             } else {
+                if ((*type & 0x0f) == TYPE_WORD) {
+                    emitldi(1);
+                    emit(VM_LSH);
+                }
+                emitldi((int) ((int *) bodyptr));
+                if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
+                    emit(VM_LDRWORD);
+                }
+                emit(VM_ADD);
                 if (local && compilingsub) {
                     if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) != -1) {
                         /* Convert to absolute address */
@@ -2902,9 +3936,7 @@ void doif(unsigned char arg)
 
     if (compile) {
         /* **** Value of IF expression is on the eval stack **** */
-        emit(VM_NOT);
-        push_return(rtPC + 1);
-        emit_imm(VM_BRNCHIMM, 0xffff);        /* To be filled in later */
+        push_return(emit_brfalse());
         push_return(0);
     } else {
         if (skipFlag) {
@@ -3167,10 +4199,12 @@ unsigned char assignorcreate(unsigned char mode)
      * When compiling:
      *
      * - Magic value FORFRAME_B or FORFRAME_W.
-     * - 0 if absolute addressing, 1 if relative addressing
+     * - Flags: bit 0 set if relative addressing, clear if absolute.
+     *          bit 1 set if the loop limit is a constant.
      * - Runtime PC
      * - Pointer to loop control variable.
-     * - Dummy word
+     * - Loop limit if it is a constant, otherwise where it is kept on
+     *   the call stack.
      */
 
     /* Get the address of the variable */
@@ -3186,14 +4220,33 @@ unsigned char assignorcreate(unsigned char mode)
     if (compile) {
         /* Find out if it is a local or a global */
         findintvar(name, &local);
-        push_return(local && compilingsub);     /* 0: absolute, 1: relative addr */
 
-        /* Loop limit k should be on the runtime eval stack, move it to call stack */
-        emit(VM_PSHWORD);
+        if ((lastop == VM_LDIMM) && (lastoppc == rtPC - 3)) {
+            /*
+             * Loop limit is a constant.  Take back the LDI and compare
+             * against an immediate value in the loop instead, which saves
+             * shuffling the limit on and off the call stack each time.
+             */
+            k = lastimm;
+            unemit(3);
+            push_return((local && compilingsub) | 2);
+        } else {
+            /* Loop limit k should be on the runtime eval stack, move it to call stack */
+            emit(VM_PSHWORD);
+            rt_push_callstack(2);
+            push_return(local && compilingsub);
+            k = compilingsub ? (rtSP - rtFP) : (rtSP + 1);
+        }
+
+#ifdef __GNUC__
+        if (!isarray && loopscan(name)) {
+            loopbegin();
+        }
+#endif
 
         push_return(rtPC);      /* Store PC so we know where to come back to */
         push_return(j);
-        push_return(0);         /* Dummy */
+        push_return(k);
     } else {
         push_return(counter);
         push_return((int) txtPtr);
@@ -3269,13 +4322,13 @@ unsigned char doendfor()
     }
 
     if (compile) {
-        /* **** Loop limit is on the call stack **** */
-        emit(VM_POPWORD);
-        emit(VM_DUP);
-        emit(VM_PSHWORD);
+        if (!(return_stack[returnSP + 4] & 2)) {
+            /* **** Loop limit is on the call stack **** */
+            emit_imm(compilingsub ? VM_LDRWORDIMM : VM_LDAWORDIMM, return_stack[returnSP + 1]);
+        }
 
         //emitldi(return_stack[returnSP + 2]); /* Pointer to loop variable */
-        if (return_stack[returnSP + 4]) {    /* Rel or abs */
+        if (return_stack[returnSP + 4] & 1) {    /* Rel or abs */
             /* Pointer to loop var */
             emit_imm((type == TYPE_WORD) ? VM_LDRWORDIMM : VM_LDRBYTEIMM, return_stack[returnSP + 2]);
         } else {
@@ -3286,19 +4339,41 @@ unsigned char doendfor()
         /* Increment and store loop variable */
         emit(VM_INC);
         emit(VM_DUP);
-        if (return_stack[returnSP + 4]) {
+        if (return_stack[returnSP + 4] & 1) {
             emit_imm((type == TYPE_WORD) ? VM_STRWORDIMM : VM_STRBYTEIMM, return_stack[returnSP + 2]);
         } else {
             emit_imm((type == TYPE_WORD) ? VM_STAWORDIMM : VM_STABYTEIMM, return_stack[returnSP + 2]);
         }
+#ifdef __GNUC__
+        loopstep();
+#endif
 
-        /* Compare with loop limit already on eval stack */
-        emit(VM_GTE);
-        emit_imm(VM_BRNCHIMM, return_stack[returnSP + 3]); /* Branch destination */
+        if (return_stack[returnSP + 4] & 2) {
+            /* Compare with constant loop limit */
+            emitldi(return_stack[returnSP + 1]);
+            emit_imm(VM_BRLTEIMM, return_stack[returnSP + 3]); /* Branch destination */
+            val = 0;
+        } else {
+            /* Compare with loop limit already on eval stack */
+            emit_imm(VM_BRGTEIMM, return_stack[returnSP + 3]); /* Branch destination */
+            val = 2;
+        }
 
-        /* Drop loop limit from call stack */
-        emit(VM_POPWORD);
-        emit(VM_DROP);
+        /* Drop loop limit and any hoisted values from call stack */
+#ifdef __GNUC__
+        val += 2 * nlooptmps;
+#endif
+        if (val == 2) {
+            emit(VM_POPWORD);
+            emit(VM_DROP);
+        } else if (val) {
+            emitldi(val);
+            emit(VM_DISCARD);
+        }
+        rt_pop_callstack(val);
+#ifdef __GNUC__
+        loopend(return_stack[returnSP + 3]);
+#endif
         goto unwind;
     }
 
@@ -3366,9 +4441,7 @@ void dowhile(char *startTxtPtr, unsigned char arg)
     if (compile) {
         push_return(rtPCBeforeEval);
         /* **** Value of WHILE expression is on the eval stack **** */
-        emit(VM_NOT);
-        push_return(rtPC + 1);  /* Address of dummy 0xffff */
-        emit_imm(VM_BRNCHIMM, 0xffff);
+        push_return(emit_brfalse());  /* Address of dummy 0xffff */
         push_return(0);         /* Dummy */
     } else {
         if (skipFlag) {
@@ -3454,7 +4527,7 @@ unsigned char doendwhile()
 
         default:
             /* Should never get here! */
-            exit(99);
+            EXIT(99);
         }
     }
 
@@ -3504,6 +4577,13 @@ unsigned char dosubr()
 
     if (compile) {
 
+#ifdef SUBTHREADS
+        /* Leave it for a worker thread (see compilesubs()) */
+        if ((compjobs > 1) && !subthread && !compilingsub && queuesub()) {
+            return RET_SUCCESS;
+        }
+#endif
+
         compilingsub = 1;
 
         print("\n[");
@@ -3527,12 +4607,16 @@ unsigned char dosubr()
         if (!subsbegin) {
             subsbegin = s;
         }
+        j = subhashfn(s->name);
+        s->hnext = subhash[j];
+        subhash[j] = s;
 
         vars_markcallframe();
 
         /* Update frame pointer */
         emit(VM_SPTOFP);
         rtFP = rtSP;
+        subargbytes = 0;
 
         if (expect('(')) {
             return RET_ERROR;
@@ -3602,6 +4686,8 @@ unsigned char dosubr()
                 v = v->next;
             }
 
+            subargbytes += ((arraymode || (type == TYPE_WORD)) ? 2 : 1);
+
             if (arraymode) {
                 v = alloc1(sizeof(var_t) + 2 * sizeof(int));
             } else {
@@ -3647,6 +4733,10 @@ unsigned char dosubr()
         if (expect(')')) {
             return RET_ERROR;
         }
+        eatspace();
+        if (!strncmp(txtPtr, "noinline", 8)) {
+            txtPtr += 8;
+        }
 
     } else {
         /* Error if we just run into this line! */
@@ -3671,6 +4761,225 @@ unsigned char doendsubr()
     return RET_SUCCESS;
 }
 
+/*
+ * Compiler: Returns the number of bytes of arguments taken by the sub with
+ * the formal parameter list at p, or 0xff if it has too many arguments to
+ * be the target of a tail call.
+ */
+unsigned char tailcallbytes(char *p)
+{
+    unsigned char bytes = 0;
+    unsigned char n = 0;
+    unsigned char sz;
+
+    for (;;) {
+        while (*p == ' ') {
+            ++p;
+        }
+        if (!*p || (*p == ')')) {
+            break;
+        }
+        sz = (strncmp(p, "byte ", 5) ? 2 : 1);
+        p += 5;
+        while (*p && (*p != ',') && (*p != ')') && (*p != '[')) {
+            ++p;
+        }
+        if (*p == '[') {
+            /* Array pass-by-reference */
+            sz = 2;
+            p += 2;
+        }
+        bytes += sz;
+        if (++n > TAILCALLMAXARGS) {
+            return 0xff;
+        }
+        while (*p == ' ') {
+            ++p;
+        }
+        if (*p == ',') {
+            ++p;
+        }
+    }
+    return bytes;
+}
+
+/*
+ * Compiler: Returns 1 if the text at p is a parenthesized argument list
+ * followed by the end of the statement, 0 otherwise.
+ */
+unsigned char endsafterargs(char *p)
+{
+    unsigned char depth = 0;
+
+    do {
+        if (*p == '\'') {
+            /* Character literal */
+            if (!*(p + 1)) {
+                return 0;
+            }
+            p += 2;
+        } else if (*p == '(') {
+            ++depth;
+        } else if (*p == ')') {
+            --depth;
+        }
+        if (!*p) {
+            return 0;
+        }
+        ++p;
+    } while (depth);
+
+    while (*p == ' ') {
+        ++p;
+    }
+    return (!*p || (*p == ';'));
+}
+
+/*
+ * Compiler: Returns 1 if the argument list at p refers to anything in the
+ * current stack frame by address: a local array, or the address of a
+ * local or parameter.  A tail call reuses the frame, so the callee would
+ * overwrite what these point to.  Errs on the safe side, treating the
+ * operand of any '&' as an address.
+ */
+unsigned char framerefs(char *p)
+{
+    char name[VARNUMCHARS];
+    unsigned char j;
+    unsigned char local;
+    unsigned char address = 0;
+    var_t *v;
+
+    while (*p && (*p != ';')) {
+        if (*p == '\'') {
+            /* Character literal */
+            p += (*(p + 1) ? 3 : 1);
+            continue;
+        }
+        if ((*p == '$') || isdigitch(*p)) {
+            /* Numeric literal */
+            ++p;
+            while (isalphach(*p) || isdigitch(*p)) {
+                ++p;
+            }
+            address = 0;
+            continue;
+        }
+        if (!isalphach(*p)) {
+            if (*p != ' ') {
+                address = (*p == '&');
+            }
+            ++p;
+            continue;
+        }
+        for (j = 0; j < VARNUMCHARS; ++j) {
+            name[j] = 0;
+        }
+        j = 0;
+        while (isalphach(*p) || isdigitch(*p)) {
+            if (j < VARNUMCHARS) {
+                name[j++] = *p;
+            }
+            ++p;
+        }
+        while (*p == ' ') {
+            ++p;
+        }
+        local = 0;
+        v = findintvar(name, &local);
+        if (v && local) {
+            if (v->type & 0xf0) {
+                /* Arrays passed by reference have size -1 */
+                if ((*(int *) ((unsigned char *) v + sizeof(var_t) + sizeof(int)) != -1) &&
+                    (address || (*p != '['))) {
+                    return 1;
+                }
+            } else if (address) {
+                return 1;
+            }
+        }
+        address = 0;
+    }
+    return 0;
+}
+
+/*
+ * Compiler: Decide whether to inline a call to the sub declared on line l.
+ * formals points to the formal parameter list of the sub.
+ * If the sub can be inlined, copies the expression it returns to buf, which
+ * holds INLINEMAXLEN + 1 chars, and returns 1.  Otherwise returns 0.
+ */
+unsigned char inlinable(struct lineofcode *l, char *formals, char *buf)
+{
+    char *p;
+    unsigned char n = 0;
+
+    /* No arrays, not too many args and no 'noinline' */
+    while (*formals != ')') {
+        if (!*formals || (*formals == '[')) {
+            return 0;
+        }
+        if (*formals == ',') {
+            ++n;
+        }
+        ++formals;
+    }
+    if (n >= TAILCALLMAXARGS) {
+        return 0;
+    }
+    ++formals;
+    while (*formals == ' ') {
+        ++formals;
+    }
+    if (!strncmp(formals, "noinline", 8)) {
+        return 0;
+    }
+
+    /* Body must be just 'return expr' */
+    l = l->next;
+    if (!l || !l->next) {
+        return 0;
+    }
+#ifdef EXTMEM
+    copyfromaux2(l->line, l->len);
+    p = embuf2;
+#else
+    p = l->line;
+#endif
+    while (*p == ' ') {
+        ++p;
+    }
+    if (strncmp(p, "return ", 7)) {
+        return 0;
+    }
+    p += 7;
+    n = 0;
+    while (*p) {
+        /* No calls and no further statements */
+        if ((*p == ';') || ((*p == '(') && n && (isalphach(*(p - 1)) || isdigitch(*(p - 1))))) {
+            return 0;
+        }
+        if (n == INLINEMAXLEN) {
+            return 0;
+        }
+        buf[n++] = *p++;
+    }
+    buf[n] = '\0';
+
+    /* Followed by endsub */
+    l = l->next;
+#ifdef EXTMEM
+    copyfromaux2(l->line, l->len);
+    p = embuf2;
+#else
+    p = l->line;
+#endif
+    while (*p == ' ') {
+        ++p;
+    }
+    return !strncmp(p, "endsub", 6);
+}
+
 /*
  * Perform call instruction
  * Expects sub name to call in readbuf
@@ -3693,6 +5002,15 @@ unsigned char docall()
     struct lineofcode *l = program;
     int origcounter = counter;
     unsigned char local = 0;
+    unsigned char tailcall = 0;
+    unsigned char inlining = 0;
+    unsigned char external;
+    unsigned char nargs = 0;
+    unsigned char argtypes[TAILCALLMAXARGS];
+    int argaddrs[TAILCALLMAXARGS];
+    char *formals;
+    /* Per call, as the args may contain calls which are inlined too */
+    char inlinebuf[INLINEMAXLEN + 1];
 
     /*
      * Do this before evaluating arguments, which overwrites readbuf
@@ -3705,6 +5023,11 @@ unsigned char docall()
          */
         s = alloc2top(sizeof(sub_t));
         strncpy(s->name, readbuf, SUBRNUMCHARS);
+
+        /*
+         * Is this call the whole of the expression in a RETURN statement?
+         */
+        tailcall = (compilingsub && (txtPtr - strlen(readbuf) == tailcallpos) && endsafterargs(txtPtr));
     }
 
     if (!compile) {
@@ -3726,8 +5049,10 @@ unsigned char docall()
         while (p && (*p == ' ')) {
             ++p;
         }
-        if (!strncmp(p, "sub ", 4)) {
-            p += 4;
+        /* When compiling, 'extern' declares a sub from another module */
+        external = (compile && !strncmp(p, "extern ", 7));
+        if (external || !strncmp(p, "sub ", 4)) {
+            p += (external ? 7 : 4);
             while (p && (*p == ' ')) {
                 ++p;
             }
@@ -3750,6 +5075,25 @@ unsigned char docall()
                     return RET_ERROR;
                 }
                 ++p;            /* Eat the '(' */
+                formals = p;
+
+                if (compile && !external) {
+                    inlining = inlinable(l, p, inlinebuf);
+#ifdef EXTMEM
+                    // Recover embuf2, which has been trashed by inlinable() above
+                    copyfromaux2(l->line, l->len);
+#endif
+                }
+
+                if (inlining) {
+                    tailcall = 0;
+                } else if (tailcall) {
+                    /*
+                     * Can only reuse the frame if the args are the same size
+                     * and none of them point into it
+                     */
+                    tailcall = ((tailcallbytes(p) == subargbytes) && !framerefs(txtPtr));
+                }
 
                 /*
                  * Set up txtPtr to start passing the argument
@@ -3889,13 +5233,23 @@ unsigned char docall()
                         // Recover embuf2, which has been trashed by eval() above
                         copyfromaux2(l->line, l->len);
 #endif
-                        if (compile) {
+                        if (tailcall) {
+                            /* Leave arg on eval stack */
+                            argtypes[nargs++] = type;
+                        } else if (compile) {
                             if (type == TYPE_WORD) {
                                 emit(VM_PSHWORD);
                                 argbytes += 2;
+                                rt_push_callstack(2);
                             } else {
                                 emit(VM_PSHBYTE);
                                 ++argbytes;
+                                rt_push_callstack(1);
+                            }
+                            if (inlining) {
+                                /* Relative if compiling sub, absolute otherwise */
+                                argtypes[nargs] = type;
+                                argaddrs[nargs++] = (compilingsub ? (rtSP - rtFP) : (rtSP + 1));
                             }
                         } else {
                             /* Back to new frame to create var */
@@ -3948,8 +5302,14 @@ unsigned char docall()
                                 error(ERR_ARG);
                                 return RET_ERROR;
                             }
-                            emit(VM_PSHWORD);
-                            argbytes += 2;
+                            if (tailcall) {
+                                /* Leave pointer on eval stack */
+                                argtypes[nargs++] = TYPE_WORD;
+                            } else {
+                                emit(VM_PSHWORD);
+                                argbytes += 2;
+                                rt_push_callstack(2);
+                            }
                         }
                     }
                     eatspace();
@@ -3978,22 +5338,96 @@ unsigned char docall()
                     return RET_ERROR;
                 }
 
+                if (tailcall) {
+                    /*
+                     * Store the args over our own, last one first.  The
+                     * args start above the return address and frame
+                     * pointer.
+                     */
+                    arg = 4;
+                    while (nargs) {
+                        if (argtypes[--nargs] == TYPE_WORD) {
+                            emit_imm(VM_STRWORDIMM, arg);
+                            arg += 2;
+                        } else {
+                            emit_imm(VM_STRBYTEIMM, arg);
+                            ++arg;
+                        }
+                    }
+
+                    /* Release locals then jump to the sub */
+                    emit(VM_FPTOSP);
+                    emit_imm(VM_JMPIMM, 0xffff);
+                    tailcalled = 1;
+                }
+
+                if (inlining) {
+                    /*
+                     * Args are on the call stack.  Make a new scope with
+                     * the formal parameters naming them and compile the
+                     * expression.
+                     */
+                    vars_markcallframe();
+                    for (j = 0; j < nargs; ++j) {
+                        while (*formals == ' ') {
+                            ++formals;
+                        }
+                        formals += 5;   /* Type */
+                        while (*formals == ' ') {
+                            ++formals;
+                        }
+                        array = alloc1(sizeof(var_t) + sizeof(int));
+                        for (arraymode = 0; arraymode < VARNUMCHARS; ++arraymode) {
+                            array->name[arraymode] = 0;
+                        }
+                        arraymode = 0;
+                        while (isalphach(*formals) || isdigitch(*formals)) {
+                            if (arraymode < VARNUMCHARS) {
+                                array->name[arraymode++] = *formals;
+                            }
+                            ++formals;
+                        }
+                        while (*formals && (*formals != ',')) {
+                            ++formals;
+                        }
+                        ++formals;
+                        *getptrtoscalarword(array) = argaddrs[j];
+                        array->type = argtypes[j];
+                        array->next = NULL;
+                        varsend->next = array;
+                        varsend = array;
+                    }
+                    p = txtPtr;
+                    txtPtr = inlinebuf;
+                    j = eval(1, &arg);
+                    txtPtr = p;
+                    vars_deletecallframe();
+                    if (j) {
+                        counter = origcounter;
+                        return RET_ERROR;
+                    }
+                }
+
                 if (compile) {
 
-                    emit_imm(VM_JSRIMM, 0xffff);
+                    if (!tailcall && !inlining) {
+                        emit_imm(VM_JSRIMM, 0xffff);
+                    }
 
                     /*
                      * Create entry in call table
                      */
-                    s->addr = rtPC - 2;
-                    s->next = NULL;
+                    if (!inlining) {
+                        s->addr = rtPC - 2;
+                        s->next = NULL;
 
-                    if (callsend) {
-                        callsend->next = s;
-                    }
-                    callsend = s;
-                    if (!callsbegin) {
-                        callsbegin = s;
+                        if (callsend) {
+                            callsend->next = s;
+                        }
+                        callsend = s;
+                        if (!callsbegin) {
+                            callsbegin = s;
+                        }
                     }
 
                     /* Caller must drop the arguments
@@ -4001,6 +5435,7 @@ unsigned char docall()
                     if (argbytes) {
                         emitldi(argbytes);
                         emit(VM_DISCARD);
+                        rt_pop_callstack(argbytes);
                     }
                 } else {
                     /* Stash pointer to just after the call stmt */
@@ -4038,6 +5473,12 @@ unsigned char doreturn(int retvalue)
 {
     if (compile) {
 
+        if (tailcalled) {
+            /* Already jumped to the sub, which will return for us */
+            tailcalled = 0;
+            return RET_SUCCESS;
+        }
+
         /*
          * Return value is already on evaluation stack
          */
@@ -4175,22 +5616,56 @@ unsigned char parsehexint(int *val)
 #define TOK_ENDW     180        /* endwhile      */
 #define TOK_END      181        /* end           */
 #define TOK_MODE     182        /* mode          */
+#define TOK_EXTERN   183        /* extern        */
+#define TOK_FOPEN    184        /* f.open        */
+#define TOK_FCLOSE   185        /* f.close       */
+#define TOK_FREAD    186        /* f.read        */
+#define TOK_FWRITE   187        /* f.write       */
+#define TOK_FSEEK    188        /* f.seek        */
+#define TOK_FMAP     189        /* f.map         */
+#define TOK_FUNMAP   190        /* f.unmap       */
+#define TOK_MCOPY    191        /* mem.copy      */
+#define TOK_MFILL    192        /* mem.fill      */
+#define TOK_MCMP     193        /* mem.cmp       */
+#define TOK_SLEN     194        /* str.len       */
+#define TOK_SCPY     195        /* str.cpy       */
+#define TOK_SCAT     196        /* str.cat       */
+#define TOK_SCMP     197        /* str.cmp       */
+#define TOK_SCHR     198        /* str.chr       */
+#define TOK_SFIND    199        /* str.find      */
+#define TOK_VECW     200        /* vec.w         */
+#define TOK_VECB     201        /* vec.b         */
+#define TOK_VECWK    202        /* vec.wk        */
+#define TOK_VECBK    203        /* vec.bk        */
+#define TOK_VECRW    204        /* vec.rw        */
+#define TOK_VECRB    205        /* vec.rb        */
+#define TOK_SORTW    206        /* sort.w        */
+#define TOK_SORTB    207        /* sort.b        */
+#define TOK_SRCHW    208        /* bsearch.w     */
+#define TOK_SRCHB    209        /* bsearch.b     */
+#define TOK_HNEW     210        /* hash.new      */
+#define TOK_HPUT     211        /* hash.put      */
+#define TOK_HGET     212        /* hash.get      */
+#define TOK_HDEL     213        /* hash.del      */
+#define TOK_HNEXT    214        /* hash.next     */
+#define TOK_MALLOC   215        /* mem.alloc     */
+#define TOK_MFREE    216        /* mem.free      */
 
 /*
  * All the following tokens do not require trailing whitespace
  * Careful - the ordering matters!
  */
-#define TOK_POKEWORD 183        /* poke word (*) */
-#define TOK_POKEBYTE 184        /* poke byte (^) */
+#define TOK_POKEWORD 217        /* poke word (*) */
+#define TOK_POKEBYTE 218        /* poke byte (^) */
 
 /* Line editor commands */
-#define TOK_LOAD    185         /* Editor: load        */
-#define TOK_SAVE    186         /* Editor: save        */
-#define TOK_LIST    187         /* Editor: list        */
-#define TOK_CHANGE  188         /* Editor: modify line */
-#define TOK_APP     189         /* Editor: append line */
-#define TOK_INS     190         /* Editor: insert line */
-#define TOK_DEL     191         /* Editor: delete line */
+#define TOK_LOAD    219         /* Editor: load        */
+#define TOK_SAVE    220         /* Editor: save        */
+#define TOK_LIST    221         /* Editor: list        */
+#define TOK_CHANGE  222         /* Editor: modify line */
+#define TOK_APP     223         /* Editor: append line */
+#define TOK_INS     224         /* Editor: insert line */
+#define TOK_DEL     225         /* Editor: delete line */
 
 /*
  * Used for the stmnttabent type field.  Code in parseline() uses this
@@ -4202,6 +5677,8 @@ unsigned char parsehexint(int *val)
  *  ONEARG: one expression is expected and evaluated.  No further arguments
  *          permitted.
  *  TWOARGS: two expressions are expected, separated by a comma
+ *  THREEARGS, FOURARGS, FIVEARGS: as TWOARGS, with three to five
+ *  expressions
  *  INITIALARG: one expression is evaluated.  Any subsequent arguments may be
  *              evaluated by custom code for each statement.
  *  ONESTRARG: a string constant in quotes is expected
@@ -4215,6 +5692,9 @@ enum stmnttype {
     NOARGS,
     ONEARG,
     TWOARGS,
+    THREEARGS,
+    FOURARGS,
+    FIVEARGS,
     INITIALARG,
     ONESTRARG,
     INITIALNAMEARG,
@@ -4233,7 +5713,7 @@ struct stmnttabent {
 /*
  * Number of statements - must be updated to match the table
  */
-#define NUMSTMNTS 42
+#define NUMSTMNTS 76
 
 /*
  * Statement table
@@ -4279,17 +5759,51 @@ struct stmnttabent stmnttab[] = {
     {"endwhile", TOK_ENDW, NOARGS},     /* 31 */
     {"end", TOK_END, NOARGS},           /* 32 */
     {"mode", TOK_MODE, ONEARG},         /* 33 */
-    {"*", TOK_POKEWORD, INITIALARG},    /* 34 */
-    {"^", TOK_POKEBYTE, INITIALARG},    /* 35 */
+    {"extern", TOK_EXTERN, FULLLINE},   /* 34 */
+    {"f.open", TOK_FOPEN, THREEARGS},   /* 35 */
+    {"f.close", TOK_FCLOSE, ONEARG},    /* 36 */
+    {"f.read", TOK_FREAD, FOURARGS},    /* 37 */
+    {"f.write", TOK_FWRITE, FOURARGS},  /* 38 */
+    {"f.seek", TOK_FSEEK, FOURARGS},    /* 39 */
+    {"f.map", TOK_FMAP, FIVEARGS},      /* 40 */
+    {"f.unmap", TOK_FUNMAP, TWOARGS},   /* 41 */
+    {"mem.copy", TOK_MCOPY, THREEARGS}, /* 42 */
+    {"mem.fill", TOK_MFILL, THREEARGS}, /* 43 */
+    {"mem.cmp", TOK_MCMP, FOURARGS},    /* 44 */
+    {"str.len", TOK_SLEN, TWOARGS},     /* 45 */
+    {"str.cpy", TOK_SCPY, TWOARGS},     /* 46 */
+    {"str.cat", TOK_SCAT, TWOARGS},     /* 47 */
+    {"str.cmp", TOK_SCMP, THREEARGS},   /* 48 */
+    {"str.chr", TOK_SCHR, THREEARGS},   /* 49 */
+    {"str.find", TOK_SFIND, THREEARGS}, /* 50 */
+    {"vec.w", TOK_VECW, FOURARGS},      /* 51 */
+    {"vec.b", TOK_VECB, FOURARGS},      /* 52 */
+    {"vec.wk", TOK_VECWK, FOURARGS},    /* 53 */
+    {"vec.bk", TOK_VECBK, FOURARGS},    /* 54 */
+    {"vec.rw", TOK_VECRW, FOURARGS},    /* 55 */
+    {"vec.rb", TOK_VECRB, FOURARGS},    /* 56 */
+    {"sort.w", TOK_SORTW, FOURARGS},    /* 57 */
+    {"sort.b", TOK_SORTB, FOURARGS},    /* 58 */
+    {"bsearch.w", TOK_SRCHW, FIVEARGS}, /* 59 */
+    {"bsearch.b", TOK_SRCHB, FIVEARGS}, /* 60 */
+    {"hash.new", TOK_HNEW, THREEARGS},  /* 61 */
+    {"hash.put", TOK_HPUT, FOURARGS},   /* 62 */
+    {"hash.get", TOK_HGET, FOURARGS},   /* 63 */
+    {"hash.del", TOK_HDEL, THREEARGS},  /* 64 */
+    {"hash.next", TOK_HNEXT, FOURARGS}, /* 65 */
+    {"mem.alloc", TOK_MALLOC, TWOARGS}, /* 66 */
+    {"mem.free", TOK_MFREE, ONEARG},    /* 67 */
+    {"*", TOK_POKEWORD, INITIALARG},    /* 68 */
+    {"^", TOK_POKEBYTE, INITIALARG},    /* 69 */
 
     /* Editor commands */
-    {":r", TOK_LOAD, ONESTRARG},        /* 36 */
-    {":w", TOK_SAVE, ONESTRARG},        /* 37 */
-    {":l", TOK_LIST, CUSTOM},           /* 38 */
-    {":c", TOK_CHANGE, INITIALARG},     /* 39 */
-    {":a", TOK_APP, ONEARG},            /* 40 */
-    {":i", TOK_INS, ONEARG},            /* 41 */
-    {":d", TOK_DEL, INITIALARG}         /* 42 - set NUMSTMNTS to this value */
+    {":r", TOK_LOAD, ONESTRARG},        /* 70 */
+    {":w", TOK_SAVE, ONESTRARG},        /* 71 */
+    {":l", TOK_LIST, CUSTOM},           /* 72 */
+    {":c", TOK_CHANGE, INITIALARG},     /* 73 */
+    {":a", TOK_APP, ONEARG},            /* 74 */
+    {":i", TOK_INS, ONEARG},            /* 75 */
+    {":d", TOK_DEL, INITIALARG}         /* 76 - set NUMSTMNTS to this value */
 };
 
 /*
@@ -4411,6 +5925,9 @@ unsigned char parseline()
     int token;
     int arg;
     int arg2;
+    int arg3;
+    int arg4;
+    int arg5;
     char *p;
     char *startTxtPtr;
     struct stmnttabent *s;
@@ -4421,6 +5938,12 @@ unsigned char parseline()
         if (checkInterrupted()) {
             return 3;
         }
+#ifdef EBLIB
+        /* Or the step budget passed to eb_run() is used up */
+        if (stepbudget && !stepsleft--) {
+            return 3;
+        }
+#endif
 
         eatspace();
 
@@ -4438,6 +5961,17 @@ unsigned char parseline()
 
         startTxtPtr = txtPtr;
 
+        /*
+         * Don't let the optimizer look back at code from the previous
+         * statement, which may be the destination of a branch.
+         */
+        lastop = VM_END;
+        tailcallpos = NULL;
+        tailcalled = 0;
+#ifdef __GNUC__
+        loopsp = 0;
+#endif
+
         token = matchstatement();
 
         /*
@@ -4523,12 +6057,20 @@ unsigned char parseline()
             }
             break;
         case ONEARG:
+            if (token == TOK_RET) {
+                /* So docall() can spot tail calls */
+                eatspace();
+                tailcallpos = txtPtr;
+            }
             /* Evaluate one arg and check end of input */
             if (eval(1, &arg)) {
                 return 2;
             }
             break;
         case TWOARGS:
+        case THREEARGS:
+        case FOURARGS:
+        case FIVEARGS:
             /* Evaluate one arg don't check end of input */
             if (eval(0, &arg)) {
                 return 2;
@@ -4541,6 +6083,27 @@ unsigned char parseline()
             if (eval(0, &arg2)) {
                 return 2;
             }
+            if (s->type == TWOARGS) {
+                break;
+            }
+            eatspace();
+            if (expect(',') || eval(0, &arg3)) {
+                return 2;
+            }
+            if (s->type == THREEARGS) {
+                break;
+            }
+            eatspace();
+            if (expect(',') || eval(0, &arg4)) {
+                return 2;
+            }
+            if (s->type == FOURARGS) {
+                break;
+            }
+            eatspace();
+            if (expect(',') || eval(0, &arg5)) {
+                return 2;
+            }
             break;
         case INITIALARG:
             /* Evaluate one arg, don't check end of input */
@@ -4594,11 +6157,21 @@ unsigned char parseline()
 #endif
         }
 
+#ifdef __GNUC__
+        /* Only the first module linked may have a main program */
+        if (compile && !compilingsub && (token != TOK_COMM) && (token != TOK_EXTERN) &&
+            (token != TOK_CONST) && (token != TOK_SUBR)) {
+            objmain = 1;
+        }
+#endif
+
         /*
          * Code for individual statements.
          */
         switch (token) {
         case TOK_COMM:
+        case TOK_EXTERN:
+            /* extern declarations are used by docall() */
             break;
         case TOK_QUIT:
 #ifdef C64
@@ -4609,7 +6182,9 @@ unsigned char parseline()
             POKE(808, 112);
 #endif
 
+#ifndef EBLIB
             print("Bye!\n");
+#endif
             EXIT(0);
         case TOK_PRDEC:
             if (compile) {
@@ -4624,7 +6199,7 @@ unsigned char parseline()
                 emitldi(0x8000);
                 emit(VM_BITAND);
                 emit(VM_NOT);
-                emit_imm(VM_BRNCHIMM, rtPC + 9);      /* Jump over printing of '-' */
+                emit_imm(VM_BRNCHIMM, rtPC + 8);      /* Jump over printing of '-' */
                 emitldi('-');
                 emit(VM_PRCH);
                 emit(VM_NEG);
@@ -4692,7 +6267,7 @@ unsigned char parseline()
                 /* Loop until we get a keypress */
                 while (!(*(char *) arg = cbm_k_getin()));
 #else
-                print("kbd.ch unimplemented on Linux\n");
+                *(char *) arg = getkey();
 #endif
             }
             break;
@@ -4704,47 +6279,282 @@ unsigned char parseline()
                 getln((char *) arg, arg2);
             }
             break;
-        case TOK_CLEAR:
-            clearvars();
-            break;
-        case TOK_VARS:
-            printvars();
+#ifdef __GNUC__
+        case TOK_FOPEN:
+            if (compile) {
+                emit_fn(VM_FILE, FILE_OPEN);
+            } else {
+                *(int *) arg3 = fileopen((char *) arg, arg2);
+            }
             break;
-        case TOK_WORD:
-            if (assignorcreate(WORD_MODE)) {
-                return 2;
+        case TOK_FCLOSE:
+            if (compile) {
+                emit_fn(VM_FILE, FILE_CLOSE);
+            } else {
+                fileclose(arg);
             }
             break;
-        case TOK_BYTE:
-            if (assignorcreate(BYTE_MODE)) {
-                return 2;
+        case TOK_FREAD:
+            if (compile) {
+                emit_fn(VM_FILE, FILE_READ);
+            } else {
+                *(int *) arg4 = fileread(arg, (char *) arg2, arg3);
             }
             break;
-        case TOK_CONST:
-            if (assignorcreate(CONST_MODE)) {
-                return 2;
+        case TOK_FWRITE:
+            if (compile) {
+                emit_fn(VM_FILE, FILE_WRITE);
+            } else {
+                *(int *) arg4 = filewrite(arg, (char *) arg2, arg3);
             }
             break;
-        case TOK_RUN:
-            run(0);             /* Start from beginning */
+        case TOK_FSEEK:
+            if (compile) {
+                emit_fn(VM_FILE, FILE_SEEK);
+            } else {
+                fileseek(arg, (long) (short) arg3 * 65536L + (unsigned short) arg2, arg4);
+            }
             break;
-        case TOK_COMPILE:
-            strncpy(filename, readbuf, FILENAMELEN);
-            filename[FILENAMELEN] = 0; /* Just in case not terminated */
-            compile = 1;
-            subsbegin = subsend = NULL;
-            callsbegin = callsend = NULL;
-            CLEARRTCALLSTACK();
-            run(0);
+        case TOK_FMAP:
             if (compile) {
-                emit(VM_END);
-                linksubs();
-                writebytecode();
-                compile = 0;
+                emit_fn(VM_FILE, FILE_MAP);
+            } else {
+                /*
+                 * Windows are in the VM address space, which the
+                 * interpreter does not have, so always fails here.
+                 */
+                *(int *) arg5 = 0;
+            }
+            break;
+        case TOK_FUNMAP:
+            if (compile) {
+                emit_fn(VM_FILE, FILE_UNMAP);
+            }
+            break;
+        case TOK_MCOPY:
+            if (compile) {
+                emit_fn(VM_MEM, MEM_COPY);
+            } else {
+                memmove((char *) arg, (char *) arg2, arg3);
+            }
+            break;
+        case TOK_MFILL:
+            if (compile) {
+                emit_fn(VM_MEM, MEM_FILL);
+            } else {
+                memset((char *) arg, arg2, arg3);
+            }
+            break;
+        case TOK_MCMP:
+            if (compile) {
+                emit_fn(VM_MEM, MEM_CMP);
+            } else {
+                arg = memcmp((char *) arg, (char *) arg2, arg3);
+                *(int *) arg4 = (arg > 0 ? 1 : (arg ? -1 : 0));
+            }
+            break;
+        case TOK_MALLOC:
+            if (compile) {
+                emit_fn(VM_MEM, MEM_ALLOC);
+            } else {
+                *(int *) arg2 = (int) malloc(arg);
+            }
+            break;
+        case TOK_MFREE:
+            if (compile) {
+                emit_fn(VM_MEM, MEM_FREE);
+            } else {
+                free((void *) arg);
+            }
+            break;
+        case TOK_SLEN:
+            if (compile) {
+                emit_fn(VM_STR, STR_LEN);
+            } else {
+                *(int *) arg2 = strlen((char *) arg);
+            }
+            break;
+        case TOK_SCPY:
+            if (compile) {
+                emit_fn(VM_STR, STR_CPY);
+            } else {
+                memmove((char *) arg, (char *) arg2, strlen((char *) arg2) + 1);
+            }
+            break;
+        case TOK_SCAT:
+            if (compile) {
+                emit_fn(VM_STR, STR_CAT);
+            } else {
+                arg += strlen((char *) arg);
+                memmove((char *) arg, (char *) arg2, strlen((char *) arg2) + 1);
+            }
+            break;
+        case TOK_SCMP:
+            if (compile) {
+                emit_fn(VM_STR, STR_CMP);
+            } else {
+                arg = strcmp((char *) arg, (char *) arg2);
+                *(int *) arg3 = (arg > 0 ? 1 : (arg ? -1 : 0));
+            }
+            break;
+        case TOK_SCHR:
+        case TOK_SFIND:
+            if (compile) {
+                emit_fn(VM_STR, (token == TOK_SCHR ? STR_CHR : STR_FIND));
+            } else {
+                p = (token == TOK_SCHR ? strchr((char *) arg, arg2) :
+                     strstr((char *) arg, (char *) arg2));
+                *(int *) arg3 = (p ? p - (char *) arg : -1);
+            }
+            break;
+        case TOK_VECW:
+        case TOK_VECB:
+            if (compile) {
+                emit_fn(VM_VEC, (token == TOK_VECW ? VEC_W : VEC_B));
+            } else {
+                vecop(arg, (void *) arg2, (void *) arg3, 0, arg4,
+                      (token == TOK_VECW ? sizeof(int) : 1));
+            }
+            break;
+        case TOK_VECWK:
+        case TOK_VECBK:
+            if (compile) {
+                emit_fn(VM_VEC, (token == TOK_VECWK ? VEC_WK : VEC_BK));
+            } else {
+                vecop(arg, (void *) arg2, NULL, arg3, arg4,
+                      (token == TOK_VECWK ? sizeof(int) : 1));
+            }
+            break;
+        case TOK_VECRW:
+        case TOK_VECRB:
+            if (compile) {
+                emit_fn(VM_VEC, (token == TOK_VECRW ? VEC_RW : VEC_RB));
+            } else {
+                *(int *) arg4 = vecreduce(arg, (void *) arg2, arg3,
+                                          (token == TOK_VECRW ? sizeof(int) : 1));
+            }
+            break;
+        case TOK_SORTW:
+        case TOK_SORTB:
+            if (compile) {
+                emit_fn(VM_SORT, (token == TOK_SORTW ? SORT_W : SORT_B));
+            } else {
+                vecsort((void *) arg, arg2, (token == TOK_SORTW ? sizeof(int) : 1),
+                        arg3, (void *) arg4, sizeof(int));
+            }
+            break;
+        case TOK_SRCHW:
+        case TOK_SRCHB:
+            if (compile) {
+                emit_fn(VM_SORT, (token == TOK_SRCHW ? SORT_SEARCHW : SORT_SEARCHB));
+            } else {
+                *(int *) arg5 = vecsearch((void *) arg, arg2,
+                                          (token == TOK_SRCHW ? sizeof(int) : 1), arg3,
+                                          (arg3 & SORT_SIGNED ? (unsigned long) (long) arg4 :
+                                           (unsigned int) arg4));
+            }
+            break;
+        case TOK_HNEW:
+            if (compile) {
+                emit_fn(VM_HASH, HASH_NEW);
+            } else {
+                hashnew((void *) arg, arg2, arg3, sizeof(int));
+            }
+            break;
+        case TOK_HPUT:
+            if (compile) {
+                emit_fn(VM_HASH, HASH_PUT);
+            } else {
+                *(int *) arg4 = hashput((void *) arg, arg2, arg3, NULL, sizeof(int));
+            }
+            break;
+        case TOK_HGET:
+            if (compile) {
+                emit_fn(VM_HASH, HASH_GET);
+            } else {
+                *(int *) arg4 = hashget((void *) arg, arg2, (unsigned int *) arg3, NULL,
+                                        sizeof(int));
+            }
+            break;
+        case TOK_HDEL:
+            if (compile) {
+                emit_fn(VM_HASH, HASH_DEL);
+            } else {
+                *(int *) arg3 = hashdel((void *) arg, arg2, NULL, sizeof(int));
+            }
+            break;
+        case TOK_HNEXT:
+            if (compile) {
+                emit_fn(VM_HASH, HASH_NEXT);
+            } else {
+                *(int *) arg2 = hashnext((void *) arg, *(int *) arg2, (unsigned int *) arg3,
+                                         (unsigned int *) arg4, sizeof(int));
             }
-#ifndef __GNUC__
-            CLEARHEAP2TOP();    /* Clear the linkage table */
+            break;
+#else
+        case TOK_FOPEN:
+        case TOK_FCLOSE:
+        case TOK_FREAD:
+        case TOK_FWRITE:
+        case TOK_FSEEK:
+        case TOK_FMAP:
+        case TOK_FUNMAP:
+        case TOK_MCOPY:
+        case TOK_MFILL:
+        case TOK_MCMP:
+        case TOK_MALLOC:
+        case TOK_MFREE:
+        case TOK_SLEN:
+        case TOK_SCPY:
+        case TOK_SCAT:
+        case TOK_SCMP:
+        case TOK_SCHR:
+        case TOK_SFIND:
+        case TOK_VECW:
+        case TOK_VECB:
+        case TOK_VECWK:
+        case TOK_VECBK:
+        case TOK_VECRW:
+        case TOK_VECRB:
+        case TOK_SORTW:
+        case TOK_SORTB:
+        case TOK_SRCHW:
+        case TOK_SRCHB:
+        case TOK_HNEW:
+        case TOK_HPUT:
+        case TOK_HGET:
+        case TOK_HDEL:
+        case TOK_HNEXT:
+            /* Linux only */
+            error(ERR_UNSUPP);
+            return 2;
 #endif
+        case TOK_CLEAR:
+            clearvars();
+            break;
+        case TOK_VARS:
+            printvars();
+            break;
+        case TOK_WORD:
+            if (assignorcreate(WORD_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_BYTE:
+            if (assignorcreate(BYTE_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_CONST:
+            if (assignorcreate(CONST_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_RUN:
+            run(0);             /* Start from beginning */
+            break;
+        case TOK_COMPILE:
+            compileprogram();
             break;
         case TOK_NEW:
             new();
@@ -4974,6 +6784,18 @@ unsigned char openfile(unsigned char writemode)
 {
     char *readPtr = readbuf;
 
+#ifdef EBLIB
+    /* eb_compile() collects the output in memory */
+    if (writemode && memout) {
+        fd = open_memstream(&memimage, &memimagelen);
+        if (fd == NULL) {
+            error(ERR_FILE);
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
     if (writemode) {
         print("Writing ");
     } else {
@@ -5008,6 +6830,14 @@ unsigned char openfile(unsigned char writemode)
     /* POSIX */
     fd = fopen(readPtr, (writemode ? "w" : "r"));
     if (fd == NULL) {
+#ifdef __GNUC__
+        if (batchfile) {
+            /* Say which file, as it may be the output, and why */
+            ++errors;
+            fprintf(stderr, "%s: %s\n", readPtr, strerror(errno));
+            return 1;
+        }
+#endif
         error(ERR_FILE);
         return 1;
     }
@@ -5165,82 +6995,44 @@ unsigned char readfile()
 #endif
 unsigned char writefile()
 {
-    unsigned int bytes;
-    unsigned int index;
-
     if (openfile(1)) {
         return 1;
     }
 
     current = program;
     while (current) {
-        index = 0;
-
 #ifdef EXTMEM
         copyfromaux(current->line, current->len);
-        for (index = 0; index < strlen(embuf); ++index) {
-#else
-        for (index = 0; index < strlen(current->line); ++index) {
-#endif
-
-#ifdef CBM
-            /* Commodore */
-            bytes = cbm_write(1, current->line + index, 1);
-
-#elif defined(EXTMEM)
-            /* Apple II, using extended memory driver */
-            bytes = fwrite(embuf + index, 1, 1, fd);
+        writebytes(embuf, strlen(embuf));
 #else
-            /* POSIX and Apple II without extended memory */
-            bytes = fwrite(current->line + index, 1, 1, fd);
+        writebytes(current->line, strlen(current->line));
 #endif
-            if (!bytes) {
-                goto error;
-            }
-        }
-#ifdef CBM
-        /* Commodore */
-        bytes += cbm_write(1, "\n", 1);
-#elif defined(A2E)
+#ifdef A2E
         /* Apple II */
-        bytes += fwrite("\r", 1, 1, fd);
+        writebyte('\r');
 #else
-        /* POSIX */
-        bytes += fwrite("\n", 1, 1, fd);
+        /* POSIX and Commodore */
+        writebyte('\n');
 #endif
-        if (!bytes) {
-            goto error;
-        }
         current = current->next;
     }
 
-#ifdef CBM
-    /* Commodore */
-    cbm_close(1);
-#else
-    /* POSIX */
-    fclose(fd);
-#endif
+    if (closewrite()) {
+        return 1;
+    }
     print("OK\n");
     return 0;
-
-  error:
-#ifdef CBM
-    /* Commodore */
-    cbm_close(1);
-#else
-    /* POSIX */
-    fclose(fd);
-#endif
-    error(ERR_FILE);
-    return 1;
 }
 #ifdef A2E
 #pragma code-name (pop)
 #endif
 
 
-void run(unsigned char cont)
+/*
+ * Run the program, from the start if cont is 0.
+ * Returns the status from parseline(), 0 or 1 if it ran to the end.
+ */
+unsigned char run(unsigned char cont)
 {
     int status = 0;
 
@@ -5289,37 +7081,2898 @@ void run(unsigned char cont)
         compile = 0;
         break;
     }
+    return status;
+}
+
+/*
+ * Compile the program to the file named in readbuf.
+ * Returns 0 if OK, 1 if there were errors.
+ */
+unsigned char compileprogram()
+{
+    unsigned int olderrors = errors;
+#ifdef __GNUC__
+    int len;
+#endif
+
+    strncpy(filename, readbuf, FILENAMELEN);
+    filename[FILENAMELEN] = 0;  /* Just in case not terminated */
+#ifdef __GNUC__
+    if (cachefetch()) {
+        return 0;
+    }
+#endif
+#ifdef SUBTHREADS
+    compilesubs();              /* Frees any jobs left if the last gave up */
+#endif
+    compile = 1;
+#ifdef __GNUC__
+    objmain = 0;
+    loopopt = 0;
+    nlooptmps = 0;
+#endif
+    CLEARHEAP2TOP();            /* In case the last compile gave up */
+    subsbegin = subsend = NULL;
+    callsbegin = callsend = NULL;
+    memset(subhash, 0, sizeof(subhash));
+    CLEARRTCALLSTACK();
+    run(0);
+#ifdef SUBTHREADS
+    compilesubs();
+#endif
+    if (!compile) {
+#ifdef __GNUC__
+        /* Not every syntax error is reported using error() */
+        if (batchfile && (errors == olderrors)) {
+            /* run() has moved on to the next line */
+            fprintf(stderr, "%s:%d: syntax\n", batchfile, counter);
+        }
+#endif
+        ++errors;
+    } else {
+        emit(VM_END);
+#ifdef __GNUC__
+        len = strlen(filename);
+        objfile = ((len > 4) && !strcmp(filename + len - 4, ".obj"));
+        linksubs(objfile);
+        if (objfile) {
+            compact();
+            writeobject();
+        } else if ((len > 2) && !strcmp(filename + len - 2, ".c")) {
+            writecsource();
+        } else if ((len > 4) && !strcmp(filename + len - 4, ".prg")) {
+            writenative();
+        } else {
+            compact();
+            writebytecode();
+        }
+        cachestore();
+#else
+        linksubs(0);
+        compact();
+        writebytecode();
+#endif
+        compile = 0;
+    }
+    CLEARHEAP2TOP();            /* Clear the linkage table */
+    return (errors != olderrors);
+}
+
+/*
+ * Returns the hash bucket for subroutine name.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char subhashfn(char *name)
+{
+    unsigned char h = 0;
+    unsigned char i;
+
+    for (i = 0; (i < SUBRNUMCHARS) && name[i]; ++i) {
+        h = (h << 1) + name[i];
+    }
+    return h & (SUBHASHSZ - 1);
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Find the entry point of the subroutine name, or NULL if it is not
+ * defined in this module.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+sub_t *findsub(char *name)
+{
+    sub_t *sub = subhash[subhashfn(name)];
+
+    while (sub && strncmp(sub->name, name, SUBRNUMCHARS)) {
+        sub = sub->hnext;
+    }
+    return sub;
 }
+#ifdef A2E
+#pragma code-name (pop)
+#endif
 
 /*
  * Perform linkage.
  * The subroutine definitions are in the list that starts with subsbegin.
  * The subroutine calls are in the list that starts with callsbegin.
+ * If partial is set (when writing an object file), calls to subs which
+ * are not defined are left for the linker, otherwise they are an error.
  */
 #ifdef A2E
 #pragma code-name (push, "LC")
 #endif
-void linksubs()
+void linksubs(unsigned char partial)
 {
     sub_t *call;
     sub_t *sub;
     call = callsbegin;
     while (call) {
-        sub = subsbegin;
-
-        while (strncmp(sub->name, call->name, SUBRNUMCHARS)) {
-            sub = sub->next;
-            if (!sub) {
-                error(ERR_LINK);
-                return;
-            }
+        sub = findsub(call->name);
+        if (sub) {
+            emit_fixup(call->addr, sub->addr);
+        } else if (!partial) {
+            error(ERR_LINK);
+            return;
         }
-        emit_fixup(call->addr, sub->addr);
         call = call->next;
     }
 }
-#ifdef A2E
-#pragma code-name (pop)
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Compiler: Read and write a byte of the compiled code.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char getcodebyte(unsigned int address)
+{
+#ifdef EXTMEMCODE
+    copybytefromaux((char *) (codestart + address - RTPCSTART));
+    return embuf[0];
+#else
+    return *(unsigned char *) (CODESTART + address - RTPCSTART);
+#endif
+}
+
+void setcodebyte(unsigned int address, unsigned char b)
+{
+#ifdef EXTMEMCODE
+    copybytetoaux((char *) (codestart + address - RTPCSTART), b);
+#else
+    *(unsigned char *) (CODESTART + address - RTPCSTART) = b;
+#endif
+}
+
+unsigned int getcodeword(unsigned int address)
+{
+    return getcodebyte(address) | (getcodebyte(address + 1) << 8);
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Compaction.
+ * Once the code has been linked, immediate mode instructions whose operand
+ * fits in a byte are rewritten in the two byte short forms (VM_LDIMMB etc.)
+ * and jumps and branches whose destination is close enough are rewritten
+ * as PC relative (VM_JMPREL etc.)  Each instruction which is shortened
+ * saves one byte, so the new address of any instruction is its old
+ * address less the number of shortened instructions before it.  The old
+ * addresses of the shortened instructions are kept in order in shrunk[].
+ * Shortening a branch can bring other branches within range, so we keep
+ * going until nothing changes.  Only ever shortening means a branch which
+ * fits stays fitting.
+ */
+unsigned int *shrunk;           /* Old addresses of shortened instructions */
+unsigned int nshrunk;           /* Number of entries in shrunk[]           */
+
+/*
+ * Returns the short form of opcode op, or 0 if it does not have one.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char shortform(unsigned char op)
+{
+    switch (op) {
+    case VM_LDIMM:
+        return VM_LDIMMB;
+    case VM_LDRWORDIMM:
+        return VM_LDRWORDIMMB;
+    case VM_LDRBYTEIMM:
+        return VM_LDRBYTEIMMB;
+    case VM_STRWORDIMM:
+        return VM_STRWORDIMMB;
+    case VM_STRBYTEIMM:
+        return VM_STRBYTEIMMB;
+    case VM_JMPIMM:
+        return VM_JMPREL;
+    case VM_BRNCHIMM:
+        return VM_BRNCHREL;
+    }
+    if ((op >= VM_BRGTIMM) && (op <= VM_BRZIMM)) {
+        return op - VM_BRGTIMM + VM_BRGTREL;
+    }
+    return 0;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Returns the length of the instruction at address.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned int codelen(unsigned int address)
+{
+    unsigned char op = getcodebyte(address);
+    unsigned int len = 1;
+
+    if (op == VM_PRMSG) {
+        while (getcodebyte(address + len)) {
+            ++len;
+        }
+        return len + 1;
+    }
+    if ((op >= VM_LDIMMB) && (op <= VM_HASH)) {
+        return 2;
+    }
+    if (shortform(op) ||
+        (op == VM_LDAWORDIMM) ||
+        (op == VM_LDABYTEIMM) ||
+        (op == VM_STAWORDIMM) ||
+        (op == VM_STABYTEIMM) ||
+        ((op >= VM_LDAWORDIDX) && (op <= VM_STPBYTEIDX)) || (op == VM_JSRIMM)) {
+        return 3;
+    }
+    return len;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Returns 1 if the operand of op is an absolute code address.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char hasaddr(unsigned char op)
+{
+    return ((op == VM_JMPIMM) || (op == VM_BRNCHIMM) || (op == VM_JSRIMM) ||
+            ((op >= VM_BRGTIMM) && (op <= VM_BRZIMM)));
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Returns the number of entries in shrunk[] less than address, which is
+ * also the index where address is, or would be inserted.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned int shrunkbefore(unsigned int address)
+{
+    unsigned int lo = 0;
+    unsigned int hi = nshrunk;
+    unsigned int mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (shrunk[mid] < address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Compact the code.  Call after linksubs(), before writebytecode().
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void compact()
+{
+    unsigned int a;
+    unsigned int len;
+    unsigned int w;
+    unsigned int i;
+    unsigned char op;
+    unsigned char changed;
+    int disp;
+    sub_t *s;
+
+    /* Count instructions which could be shortened */
+    nshrunk = 0;
+    for (a = RTPCSTART; a < rtPC; a += codelen(a)) {
+        if (shortform(getcodebyte(a))) {
+            ++nshrunk;
+        }
+    }
+    if (!nshrunk) {
+        return;
+    }
+    shrunk = alloc2top(nshrunk * sizeof(unsigned int));
+
+    /* Immediate operands.  Frame relative addresses are signed */
+    nshrunk = 0;
+    for (a = RTPCSTART; a < rtPC; a += codelen(a)) {
+        op = getcodebyte(a);
+        w = getcodeword(a + 1);
+        if (((op == VM_LDIMM) && (w < 0x100)) ||
+            (((op == VM_LDRWORDIMM) || (op == VM_LDRBYTEIMM) ||
+              (op == VM_STRWORDIMM) || (op == VM_STRBYTEIMM)) &&
+             ((w < 0x80) || (w >= 0xff80)))) {
+            shrunk[nshrunk++] = a;
+        }
+    }
+
+    /* Jumps and branches */
+    do {
+        changed = 0;
+        for (a = RTPCSTART; a < rtPC; a += codelen(a)) {
+            op = getcodebyte(a);
+            if ((op != VM_JMPIMM) && (op != VM_BRNCHIMM) &&
+                ((op < VM_BRGTIMM) || (op > VM_BRZIMM))) {
+                continue;
+            }
+            i = shrunkbefore(a);
+            if ((i < nshrunk) && (shrunk[i] == a)) {
+                continue;
+            }
+            /* Offset once this instruction is shortened */
+            w = getcodeword(a + 1);
+            disp = (w - shrunkbefore(w) - (w > a)) - (a - i + 2);
+            if ((disp >= -128) && (disp <= 127)) {
+                memmove(&shrunk[i + 1], &shrunk[i], (nshrunk - i) * sizeof(unsigned int));
+                shrunk[i] = a;
+                ++nshrunk;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    /*
+     * Rewrite the code.  New addresses are never higher than old ones, so
+     * this can be done in place working upwards.
+     */
+    i = 0;
+    for (a = RTPCSTART; a < rtPC; a += len) {
+        op = getcodebyte(a);
+        len = codelen(a);
+        w = getcodeword(a + 1);
+        if ((i < nshrunk) && (shrunk[i] == a)) {
+            setcodebyte(a - i, shortform(op));
+            if ((op == VM_JMPIMM) || (op == VM_BRNCHIMM) ||
+                ((op >= VM_BRGTIMM) && (op <= VM_BRZIMM))) {
+                w = (w - shrunkbefore(w)) - (a - i + 2);
+            }
+            setcodebyte(a - i + 1, w & 0xff);
+            ++i;
+        } else if (hasaddr(op)) {
+            w -= shrunkbefore(w);
+            setcodebyte(a - i, op);
+            setcodebyte(a - i + 1, w & 0xff);
+            setcodebyte(a - i + 2, w >> 8);
+        } else if (i) {
+            for (w = 0; w < len; ++w) {
+                setcodebyte(a - i + w, getcodebyte(a + w));
+            }
+        }
+    }
+
+    /*
+     * Subroutine entry points are used by the native code generators, and
+     * they and the calls are used to write object files.
+     */
+    for (s = subsbegin; s; s = s->next) {
+        s->addr -= shrunkbefore(s->addr);
+    }
+    for (s = callsbegin; s; s = s->next) {
+        s->addr -= shrunkbefore(s->addr);
+    }
+    rtPC -= nshrunk;
+    codeptr -= nshrunk;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+#ifdef __GNUC__
+
+/*
+ * Compile cache (Linux only.)
+ *
+ * If the environment variable EIGHTBALLCACHE names a directory, each file
+ * written by 'comp' is also saved there, named by a hash of the program
+ * text, the compiler version and the kind of file written (bytecode, object
+ * file, C or 6502 code for each machine.)  If the same program is compiled
+ * again to the same kind of file, the saved copy is used and the program
+ * is not compiled at all.  The compiler is identified by its version, the
+ * file format versions and CACHEGEN, so cached files are kept across
+ * rebuilds of the same compiler and dropped when the code it writes
+ * changes.
+ */
+#define CACHEENV "EIGHTBALLCACHE"
+
+/*
+ * Code generator version.  Must be bumped whenever a change to the compiler,
+ * optimizer, C translator or native code generator changes the files
+ * written for the same program.
+ */
+#define CACHEGEN "1"
+#define CACHEBUILD VERSIONSTR " " CACHEGEN
+
+char cachepath[FILENAME_MAX];   /* Cache file for the current 'comp'   */
+unsigned int cacheerrors;       /* Value of errors at start of 'comp'  */
+
+/*
+ * Hashes (64 bit FNV-1a) len bytes at p into h.
+ */
+unsigned long long cachehash(unsigned long long h, char *p, unsigned int len)
+{
+    while (len--) {
+        h ^= (unsigned char) *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Works out the name of the cache file for the program being compiled to
+ * filename, and puts it in cachepath.  Returns 0 if the cache is not being
+ * used.
+ */
+unsigned char cachekey()
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    struct lineofcode *l;
+    char *dir = getenv(CACHEENV);
+    char *ext = strrchr(filename, '.');
+    unsigned char vers[2] = {BCVERSION, OBJVERSION};
+
+#ifdef EBLIB
+    if (memout) {
+        return 0;
+    }
+#endif
+    if (!dir || !*dir) {
+        return 0;
+    }
+    if (!ext || (strcmp(ext, ".obj") && strcmp(ext, ".c") && strcmp(ext, ".prg"))) {
+        ext = "";
+    } else if (!strcmp(ext, ".prg") && (ext - filename >= 2) &&
+               (!strncmp(ext - 2, "64", 2) || !strncmp(ext - 2, "20", 2))) {
+        /* Native code for the C64 or VIC-20 (see nstub()) */
+        ext -= 2;
+    }
+    h = cachehash(h, CACHEBUILD, sizeof(CACHEBUILD));
+    h = cachehash(h, (char *) vers, sizeof(vers));
+    h = cachehash(h, ext, strlen(ext) + 1);
+    for (l = program; l; l = l->next) {
+        h = cachehash(h, l->line, strlen(l->line) + 1);
+    }
+    snprintf(cachepath, FILENAME_MAX, "%s/%016llx", dir, h);
+    return 1;
+}
+
+/*
+ * Copies file from to file to.  Returns 0 on success.
+ */
+unsigned char copyfile(char *from, char *to)
+{
+    FILE *in;
+    FILE *out;
+    char buf[512];
+    size_t n;
+    unsigned char err = 0;
+
+    in = fopen(from, "rb");
+    if (!in) {
+        return 1;
+    }
+    out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return 1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            err = 1;
+            break;
+        }
+    }
+    fclose(in);
+    return (fclose(out) || err);
+}
+
+/*
+ * Called at the start of 'comp'.  If the program has been compiled to
+ * this kind of file before, copies the cached file to filename and
+ * returns 1.  Otherwise returns 0 and the program must be compiled.
+ */
+unsigned char cachefetch()
+{
+    cacheerrors = errors;
+    if (!cachekey() || copyfile(cachepath, filename)) {
+        return 0;
+    }
+    print("\nWriting ");
+    print(filename);
+    print(": (cached)\n");
+    return 1;
+}
+
+/*
+ * Called after the file has been written by 'comp'.  Saves a copy in the
+ * cache, unless there were errors.  The copy is written under a temporary
+ * name first, so other compilers using the same cache never see part of
+ * a file.
+ */
+void cachestore()
+{
+    char tmp[FILENAME_MAX + 16];
+
+    if (!cachekey() || (errors != cacheerrors)) {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d", cachepath, (int) getpid());
+    if (copyfile(filename, tmp) || rename(tmp, cachepath)) {
+        remove(tmp);
+    }
+}
+
+/*
+ * Returns the next call after call (or the first, if call is NULL) to a
+ * sub which is not defined in this module, or NULL if there are no more.
+ */
+sub_t *nextextern(sub_t *call)
+{
+    call = (call ? call->next : callsbegin);
+    while (call && findsub(call->name)) {
+        call = call->next;
+    }
+    return call;
+}
+
+/*
+ * Write object file, in the format described in eightballvm.h.
+ * Call this after compilation is done, instead of writebytecode().
+ */
+void writeobject()
+{
+    unsigned int a;
+    unsigned int nrelocs = 0;
+    unsigned int nsyms = 0;
+    unsigned int nrefs = 0;
+    unsigned char i;
+    sub_t *s;
+    sub_t *ext;
+
+    /* Calls to other modules are not relocations */
+    ext = nextextern(NULL);
+    for (a = RTPCSTART; a < rtPC; a += codelen(a)) {
+        if (ext && (ext->addr == a + 1)) {
+            ext = nextextern(ext);
+        } else if (hasaddr(getcodebyte(a))) {
+            ++nrelocs;
+        }
+    }
+    for (s = subsbegin; s; s = s->next) {
+        ++nsyms;
+    }
+    for (s = nextextern(NULL); s; s = nextextern(s)) {
+        ++nrefs;
+    }
+
+    strcpy(readbuf, filename);
+    printchar('\n');
+    if (openfile(1)) {
+        return;
+    }
+    print("...\n");
+    writebyte(OBJMAGIC);
+    writebyte(OBJVERSION);
+    writeword(rtPC - RTPCSTART);
+    writeword(nrelocs);
+    writeword(nsyms);
+    writeword(nrefs);
+    writeword(objmain || (rtSP != RTCALLSTACKTOP));
+    for (a = RTPCSTART; a < rtPC; ++a) {
+        writebyte(getcodebyte(a));
+    }
+    ext = nextextern(NULL);
+    for (a = RTPCSTART; a < rtPC; a += codelen(a)) {
+        if (ext && (ext->addr == a + 1)) {
+            ext = nextextern(ext);
+        } else if (hasaddr(getcodebyte(a))) {
+            writeword(a + 1 - RTPCSTART);
+        }
+    }
+    for (s = subsbegin; s; s = s->next) {
+        for (i = 0; i < OBJNAMELEN; ++i) {
+            writebyte(s->name[i]);
+        }
+        writeword(s->addr - RTPCSTART);
+    }
+    for (s = nextextern(NULL); s; s = nextextern(s)) {
+        for (i = 0; i < OBJNAMELEN; ++i) {
+            writebyte(s->name[i]);
+        }
+        writeword(s->addr - RTPCSTART);
+    }
+    closewrite();
+}
+
+#endif
+
+#ifdef __GNUC__
+
+/*
+ * Native backend (Linux only.)
+ *
+ * If the filename given to 'comp' ends in '.c' then, instead of writing
+ * the bytecode, it is translated to C which can be built with gcc -O2
+ * along with eightballutils.c.  Each subroutine becomes a C function and
+ * the main program becomes ebmain().  The call stack lives in a 64K
+ * memory[] array laid out exactly as in the VM.  The depth of the
+ * evaluation stack is worked out for each instruction at translation
+ * time, so the evaluation stack becomes local variables s0, s1 ...
+ */
+#define CBYTE(addr) (*(unsigned char *) (CODESTART + (addr) - RTPCSTART))
+#define CWORD(addr) (CBYTE(addr) | (CBYTE((addr) + 1) << 8))
+
+#define XLATE_FN    1           /* Instruction is a function entry point */
+#define XLATE_LBL   2           /* Instruction is a branch target        */
+#define XLATE_BAD   127         /* Instruction can't be translated       */
+
+/*
+ * Returns the length in bytes of the instruction at addr.
+ */
+unsigned int xlatelen(unsigned int addr)
+{
+    unsigned char op = CBYTE(addr);
+    unsigned int len = 1;
+
+    if (op == VM_PRMSG) {
+        while (CBYTE(addr + len)) {
+            ++len;
+        }
+        return len + 1;
+    }
+    if ((op >= VM_LDIMMB) && (op <= VM_HASH)) {
+        return 2;
+    }
+    if ((op == VM_LDIMM) ||
+        (op == VM_LDAWORDIMM) ||
+        (op == VM_LDABYTEIMM) ||
+        (op == VM_LDRWORDIMM) ||
+        (op == VM_LDRBYTEIMM) ||
+        (op == VM_STAWORDIMM) ||
+        (op == VM_STABYTEIMM) ||
+        (op == VM_STRWORDIMM) ||
+        (op == VM_STRBYTEIMM) ||
+        ((op >= VM_LDAWORDIDX) && (op <= VM_STPBYTEIDX)) ||
+        (op == VM_JMPIMM) ||
+        (op == VM_BRNCHIMM) ||
+        (op == VM_JSRIMM) || ((op >= VM_BRGTIMM) && (op <= VM_BRZIMM))) {
+        return 3;
+    }
+    return len;
+}
+
+/*
+ * Number of arguments taken by each library function, for each opcode from
+ * VM_FILE on.
+ */
+unsigned char xlatefileargs[] = { 3, 1, 4, 4, 4, 5, 2 };
+unsigned char xlatememargs[] = { 3, 3, 4, 2, 1 };
+unsigned char xlatestrargs[] = { 2, 2, 2, 3, 3, 3 };
+unsigned char xlatevecargs[] = { 4, 4, 4, 4, 4, 4 };
+unsigned char xlatesortargs[] = { 4, 4, 5, 5 };
+unsigned char xlatehashargs[] = { 3, 4, 4, 3, 4 };
+
+/*
+ * Returns the change in depth of the evaluation stack caused by the
+ * instruction at addr.  The depth required before the instruction is
+ * returned in *needs.  Returns XLATE_BAD for instructions whose effect
+ * is not known at translation time.
+ */
+signed char xlateeffect(unsigned int addr, unsigned char *needs)
+{
+    unsigned char op = CBYTE(addr);
+
+    switch (op) {
+    case VM_END:
+    case VM_JMPIMM:
+    case VM_SPTOFP:
+    case VM_FPTOSP:
+    case VM_PRMSG:
+        *needs = 0;
+        return 0;
+    case VM_LDIMM:
+    case VM_LDAWORDIMM:
+    case VM_LDABYTEIMM:
+    case VM_LDRWORDIMM:
+    case VM_LDRBYTEIMM:
+    case VM_POPWORD:
+    case VM_POPBYTE:
+    case VM_KBDCH:
+    case VM_JSRIMM:
+        *needs = 0;
+        return 1;
+    case VM_LDAWORD:
+    case VM_LDABYTE:
+    case VM_LDRWORD:
+    case VM_LDRBYTE:
+    case VM_LDAWORDIDX:
+    case VM_LDABYTEIDX:
+    case VM_LDRWORDIDX:
+    case VM_LDRBYTEIDX:
+    case VM_LDPWORDIDX:
+    case VM_LDPBYTEIDX:
+    case VM_ATOR:
+    case VM_RTOA:
+    case VM_INC:
+    case VM_DEC:
+    case VM_NEG:
+    case VM_NOT:
+    case VM_BITNOT:
+    case VM_RTS:
+        *needs = 1;
+        return 0;
+    case VM_STAWORDIMM:
+    case VM_STABYTEIMM:
+    case VM_STRWORDIMM:
+    case VM_STRBYTEIMM:
+    case VM_DROP:
+    case VM_PSHWORD:
+    case VM_PSHBYTE:
+    case VM_DISCARD:
+    case VM_PRDEC:
+    case VM_PRHEX:
+    case VM_PRCH:
+    case VM_PRSTR:
+    case VM_BRNCHIMM:
+    case VM_BRZIMM:
+        *needs = 1;
+        return -1;
+    case VM_DUP:
+        *needs = 1;
+        return 1;
+    case VM_SWAP:
+        *needs = 2;
+        return 0;
+    case VM_OVER:
+        *needs = 2;
+        return 1;
+    case VM_DUP2:
+        *needs = 2;
+        return 2;
+    case VM_STAWORD:
+    case VM_STABYTE:
+    case VM_STRWORD:
+    case VM_STRBYTE:
+    case VM_STAWORDIDX:
+    case VM_STABYTEIDX:
+    case VM_STRWORDIDX:
+    case VM_STRBYTEIDX:
+    case VM_STPWORDIDX:
+    case VM_STPBYTEIDX:
+    case VM_KBDLN:
+    case VM_BRGTIMM:
+    case VM_BRGTEIMM:
+    case VM_BRLTIMM:
+    case VM_BRLTEIMM:
+    case VM_BREQLIMM:
+    case VM_BRNEQLIMM:
+        *needs = 2;
+        return -2;
+    case VM_ADD:
+    case VM_SUB:
+    case VM_MUL:
+    case VM_DIV:
+    case VM_MOD:
+    case VM_GT:
+    case VM_GTE:
+    case VM_LT:
+    case VM_LTE:
+    case VM_EQL:
+    case VM_NEQL:
+    case VM_AND:
+    case VM_OR:
+    case VM_BITAND:
+    case VM_BITOR:
+    case VM_BITXOR:
+    case VM_LSH:
+    case VM_RSH:
+        *needs = 2;
+        return -1;
+    case VM_FILE:
+        if (CBYTE(addr + 1) > FILE_UNMAP) {
+            break;
+        }
+        *needs = xlatefileargs[CBYTE(addr + 1)];
+        return -*needs;
+    case VM_MEM:
+        if (CBYTE(addr + 1) > MEM_FREE) {
+            break;
+        }
+        *needs = xlatememargs[CBYTE(addr + 1)];
+        return -*needs;
+    case VM_STR:
+        if (CBYTE(addr + 1) > STR_FIND) {
+            break;
+        }
+        *needs = xlatestrargs[CBYTE(addr + 1)];
+        return -*needs;
+    case VM_VEC:
+        if (CBYTE(addr + 1) > VEC_RB) {
+            break;
+        }
+        *needs = xlatevecargs[CBYTE(addr + 1)];
+        return -*needs;
+    case VM_SORT:
+        if (CBYTE(addr + 1) > SORT_SEARCHB) {
+            break;
+        }
+        *needs = xlatesortargs[CBYTE(addr + 1)];
+        return -*needs;
+    case VM_HASH:
+        if (CBYTE(addr + 1) > HASH_NEXT) {
+            break;
+        }
+        *needs = xlatehashargs[CBYTE(addr + 1)];
+        return -*needs;
+    }
+    /* VM_PICK, VM_JMP, VM_BRNCH and VM_JSR have run time effects */
+    return XLATE_BAD;
+}
+
+/*
+ * Write the name of the C function for the entry point at addr.
+ */
+void xlatename(unsigned int addr)
+{
+    sub_t *s = subsbegin;
+
+    if (addr == RTPCSTART) {
+        fprintf(fd, "ebmain");
+        return;
+    }
+    while (s) {
+        if (s->addr == addr) {
+            fprintf(fd, "sub_%.*s", SUBRNUMCHARS, s->name);
+            return;
+        }
+        s = s->next;
+    }
+    fprintf(fd, "fn_%04x", addr);
+}
+
+/*
+ * Work out the depth of the evaluation stack before each instruction and
+ * mark function entry points and branch targets.  depth[] is -1 for
+ * unreachable instructions.
+ * Returns 0 on success, or the address of the offending instruction.
+ */
+unsigned int xlateanalyse(signed char *depth, unsigned char *flags, unsigned int len)
+{
+    unsigned int a;
+    unsigned int t;
+    unsigned char op;
+    unsigned char needs;
+    signed char eff;
+    signed char d;
+    unsigned char changed;
+
+    flags[0] = XLATE_FN;
+    for (a = 0; a < len; a += xlatelen(a + RTPCSTART)) {
+        op = CBYTE(a + RTPCSTART);
+        t = CWORD(a + RTPCSTART + 1) - RTPCSTART;
+        if (op == VM_JSRIMM) {
+            if (t >= len) {
+                return a + RTPCSTART;
+            }
+            flags[t] |= XLATE_FN;
+        } else if ((op == VM_JMPIMM) && (t < len) && (CBYTE(t + RTPCSTART) == VM_SPTOFP)) {
+            /* Tail call */
+            flags[t] |= XLATE_FN;
+        } else if ((op == VM_JMPIMM) ||
+                   (op == VM_BRNCHIMM) || ((op >= VM_BRGTIMM) && (op <= VM_BRZIMM))) {
+            if (t >= len) {
+                return a + RTPCSTART;
+            }
+            flags[t] |= XLATE_LBL;
+        }
+    }
+
+    for (a = 0; a < len; ++a) {
+        depth[a] = (flags[a] & XLATE_FN ? 0 : -1);
+    }
+
+    /* Repeat until backward branches have been accounted for */
+    do {
+        changed = 0;
+        d = -1;
+        for (a = 0; a < len; a += xlatelen(a + RTPCSTART)) {
+            if (flags[a] & XLATE_FN) {
+                d = 0;
+            } else if (depth[a] >= 0) {
+                if ((d >= 0) && (d != depth[a])) {
+                    return a + RTPCSTART;
+                }
+                d = depth[a];
+            } else if (d >= 0) {
+                depth[a] = d;
+            }
+            if (d < 0) {
+                continue;       /* Not reachable (yet) */
+            }
+            op = CBYTE(a + RTPCSTART);
+            eff = xlateeffect(a + RTPCSTART, &needs);
+            if ((eff == XLATE_BAD) || (d < needs) || (d + eff > 16)) {
+                return a + RTPCSTART;
+            }
+            d += eff;
+            t = CWORD(a + RTPCSTART + 1) - RTPCSTART;
+            if ((op == VM_BRNCHIMM) || ((op >= VM_BRGTIMM) && (op <= VM_BRZIMM))
+                || ((op == VM_JMPIMM) && !(flags[t] & XLATE_FN))) {
+                if (flags[t] & XLATE_FN) {
+                    return a + RTPCSTART;
+                }
+                if (depth[t] < 0) {
+                    depth[t] = d;
+                    changed |= (t < a);
+                } else if (depth[t] != d) {
+                    return a + RTPCSTART;
+                }
+            } else if ((op == VM_JMPIMM) && d) {
+                /* Tail call must leave the evaluation stack empty */
+                return a + RTPCSTART;
+            }
+            if ((op == VM_JMPIMM) || (op == VM_RTS) || (op == VM_END)) {
+                d = -1;
+            }
+        }
+    } while (changed);
+
+    return 0;
+}
+
+/*
+ * Write C for the instruction at address a, with the evaluation stack d
+ * deep.  entry is the address of the function being written.
+ */
+void xlateinsn(unsigned int a, signed char d, unsigned int entry)
+{
+    unsigned char op = CBYTE(a);
+    unsigned int w = CWORD(a + 1);
+    signed char x = d - 1;
+    signed char y = d - 2;
+    signed char z = d - 3;
+    unsigned char fn;
+    unsigned char size;
+    static char *relops[] = { ">", ">=", "<", "<=", "==", "!=" };
+    static char *binops[] = { "+", "-", "*", "/", "%" };
+
+    switch (op) {
+    case VM_END:
+        if (d) {
+            fprintf(fd, "    print(\"WARNING: evalptr \");\n");
+            fprintf(fd, "    printdec(%d);\n", d);
+            fprintf(fd, "    printchar('\\n');\n");
+        }
+        fprintf(fd, "    exit(0);\n");
+        break;
+    case VM_LDIMM:
+        fprintf(fd, "    s%d = 0x%04x;\n", d, w);
+        break;
+    case VM_LDAWORD:
+        fprintf(fd, "    s%d = rdw(s%d);\n", x, x);
+        break;
+    case VM_LDAWORDIMM:
+        fprintf(fd, "    s%d = rdw(0x%04x);\n", d, w);
+        break;
+    case VM_LDABYTE:
+        fprintf(fd, "    s%d = memory[s%d];\n", x, x);
+        break;
+    case VM_LDABYTEIMM:
+        fprintf(fd, "    s%d = memory[0x%04x];\n", d, w);
+        break;
+    case VM_STAWORD:
+        fprintf(fd, "    wrw(s%d, s%d);\n", x, y);
+        break;
+    case VM_STAWORDIMM:
+        fprintf(fd, "    wrw(0x%04x, s%d);\n", w, x);
+        break;
+    case VM_STABYTE:
+        fprintf(fd, "    memory[s%d] = s%d;\n", x, y);
+        break;
+    case VM_STABYTEIMM:
+        fprintf(fd, "    memory[0x%04x] = s%d;\n", w, x);
+        break;
+    case VM_LDRWORD:
+        fprintf(fd, "    s%d = rdw(s%d + fp + 1);\n", x, x);
+        break;
+    case VM_LDRWORDIMM:
+        fprintf(fd, "    s%d = rdw(0x%04x + fp + 1);\n", d, w);
+        break;
+    case VM_LDRBYTE:
+        fprintf(fd, "    s%d = memory[(unsigned short) (s%d + fp + 1)];\n", x, x);
+        break;
+    case VM_LDRBYTEIMM:
+        fprintf(fd, "    s%d = memory[(unsigned short) (0x%04x + fp + 1)];\n", d, w);
+        break;
+    case VM_STRWORD:
+        fprintf(fd, "    wrw(s%d + fp + 1, s%d);\n", x, y);
+        break;
+    case VM_STRWORDIMM:
+        fprintf(fd, "    wrw(0x%04x + fp + 1, s%d);\n", w, x);
+        break;
+    case VM_STRBYTE:
+        fprintf(fd, "    memory[(unsigned short) (s%d + fp + 1)] = s%d;\n", x, y);
+        break;
+    case VM_STRBYTEIMM:
+        fprintf(fd, "    memory[(unsigned short) (0x%04x + fp + 1)] = s%d;\n", w, x);
+        break;
+    case VM_LDAWORDIDX:
+        fprintf(fd, "    s%d = rdw(0x%04x + (s%d << 1));\n", x, w, x);
+        break;
+    case VM_LDABYTEIDX:
+        fprintf(fd, "    s%d = memory[(unsigned short) (0x%04x + s%d)];\n", x, w, x);
+        break;
+    case VM_STAWORDIDX:
+        fprintf(fd, "    wrw(0x%04x + (s%d << 1), s%d);\n", w, y, x);
+        break;
+    case VM_STABYTEIDX:
+        fprintf(fd, "    memory[(unsigned short) (0x%04x + s%d)] = s%d;\n", w, y, x);
+        break;
+    case VM_LDRWORDIDX:
+        fprintf(fd, "    s%d = rdw(0x%04x + fp + 1 + (s%d << 1));\n", x, w, x);
+        break;
+    case VM_LDRBYTEIDX:
+        fprintf(fd, "    s%d = memory[(unsigned short) (0x%04x + fp + 1 + s%d)];\n", x, w, x);
+        break;
+    case VM_STRWORDIDX:
+        fprintf(fd, "    wrw(0x%04x + fp + 1 + (s%d << 1), s%d);\n", w, y, x);
+        break;
+    case VM_STRBYTEIDX:
+        fprintf(fd, "    memory[(unsigned short) (0x%04x + fp + 1 + s%d)] = s%d;\n", w, y, x);
+        break;
+    case VM_LDPWORDIDX:
+        fprintf(fd, "    s%d = rdw(rdw(0x%04x + fp + 1) + (s%d << 1));\n", x, w, x);
+        break;
+    case VM_LDPBYTEIDX:
+        fprintf(fd, "    s%d = memory[(unsigned short) (rdw(0x%04x + fp + 1) + s%d)];\n", x, w, x);
+        break;
+    case VM_STPWORDIDX:
+        fprintf(fd, "    wrw(rdw(0x%04x + fp + 1) + (s%d << 1), s%d);\n", w, y, x);
+        break;
+    case VM_STPBYTEIDX:
+        fprintf(fd, "    memory[(unsigned short) (rdw(0x%04x + fp + 1) + s%d)] = s%d;\n", w, y, x);
+        break;
+    case VM_SWAP:
+        fprintf(fd, "    t = s%d;\n    s%d = s%d;\n    s%d = t;\n", x, x, y, y);
+        break;
+    case VM_DUP:
+        fprintf(fd, "    s%d = s%d;\n", d, x);
+        break;
+    case VM_DUP2:
+        fprintf(fd, "    s%d = s%d;\n    s%d = s%d;\n", d, y, d + 1, x);
+        break;
+    case VM_OVER:
+        fprintf(fd, "    s%d = s%d;\n", d, y);
+        break;
+    case VM_POPWORD:
+        fprintf(fd, "    sp += 2;\n    s%d = rdw(sp - 1);\n", d);
+        break;
+    case VM_POPBYTE:
+        fprintf(fd, "    s%d = memory[++sp];\n", d);
+        break;
+    case VM_PSHWORD:
+        fprintf(fd, "    sp -= 2;\n    wrw(sp + 1, s%d);\n", x);
+        break;
+    case VM_PSHBYTE:
+        fprintf(fd, "    memory[sp--] = s%d;\n", x);
+        break;
+    case VM_DISCARD:
+        fprintf(fd, "    sp += s%d;\n", x);
+        break;
+    case VM_SPTOFP:
+        fprintf(fd, "    sp -= 2;\n    wrw(sp + 1, fp);\n    fp = sp;\n");
+        break;
+    case VM_FPTOSP:
+        fprintf(fd, "    sp = fp + 2;\n    fp = rdw(sp - 1);\n");
+        break;
+    case VM_ATOR:
+        fprintf(fd, "    s%d = s%d - fp - 1;\n", x, x);
+        break;
+    case VM_RTOA:
+        fprintf(fd, "    s%d = s%d + fp + 1;\n", x, x);
+        break;
+    case VM_INC:
+        fprintf(fd, "    ++s%d;\n", x);
+        break;
+    case VM_DEC:
+        fprintf(fd, "    --s%d;\n", x);
+        break;
+    case VM_ADD:
+    case VM_SUB:
+    case VM_MUL:
+    case VM_DIV:
+    case VM_MOD:
+        fprintf(fd, "    s%d = (unsigned) s%d %s s%d;\n", y, y, binops[op - VM_ADD], x);
+        break;
+    case VM_NEG:
+        fprintf(fd, "    s%d = -s%d;\n", x, x);
+        break;
+    case VM_GT:
+    case VM_GTE:
+    case VM_LT:
+    case VM_LTE:
+    case VM_EQL:
+    case VM_NEQL:
+        fprintf(fd, "    s%d = s%d %s s%d;\n", y, y, relops[op - VM_GT], x);
+        break;
+    case VM_AND:
+        fprintf(fd, "    s%d = s%d && s%d;\n", y, y, x);
+        break;
+    case VM_OR:
+        fprintf(fd, "    s%d = s%d || s%d;\n", y, y, x);
+        break;
+    case VM_NOT:
+        fprintf(fd, "    s%d = !s%d;\n", x, x);
+        break;
+    case VM_BITAND:
+        fprintf(fd, "    s%d &= s%d;\n", y, x);
+        break;
+    case VM_BITOR:
+        fprintf(fd, "    s%d |= s%d;\n", y, x);
+        break;
+    case VM_BITXOR:
+        fprintf(fd, "    s%d ^= s%d;\n", y, x);
+        break;
+    case VM_BITNOT:
+        fprintf(fd, "    s%d = ~s%d;\n", x, x);
+        break;
+    case VM_LSH:
+        fprintf(fd, "    s%d = (unsigned) s%d << s%d;\n", y, y, x);
+        break;
+    case VM_RSH:
+        fprintf(fd, "    s%d = s%d >> s%d;\n", y, y, x);
+        break;
+    case VM_JMPIMM:
+        if ((CBYTE(w) == VM_SPTOFP) && (w != entry)) {
+            /* Tail call */
+            fprintf(fd, "    return ");
+            xlatename(w);
+            fprintf(fd, "();\n");
+        } else {
+            fprintf(fd, "    goto L%04x;\n", w);
+        }
+        break;
+    case VM_BRNCHIMM:
+        fprintf(fd, "    if (s%d)\n        goto L%04x;\n", x, w);
+        break;
+    case VM_JSRIMM:
+        /* The return address is pushed to keep the frame layout */
+        fprintf(fd, "    sp -= 2;\n    wrw(sp + 1, 0x%04x);\n    s%d = ", a + 2, d);
+        xlatename(w);
+        fprintf(fd, "();\n");
+        break;
+    case VM_RTS:
+        fprintf(fd, "    sp += 2;\n    return s%d;\n", x);
+        break;
+    case VM_PRDEC:
+        fprintf(fd, "    printdec(s%d);\n", x);
+        break;
+    case VM_PRHEX:
+        fprintf(fd, "    printhex(s%d);\n", x);
+        break;
+    case VM_PRCH:
+        fprintf(fd, "    printchar(s%d);\n", x);
+        break;
+    case VM_PRSTR:
+        fprintf(fd, "    print((char *) &memory[s%d]);\n", x);
+        break;
+    case VM_PRMSG:
+        fprintf(fd, "    print((char *) &memory[0x%04x]);\n", a + 1);
+        break;
+    case VM_KBDCH:
+        fprintf(fd, "    s%d = getkey();\n", d);
+        break;
+    case VM_KBDLN:
+        fprintf(fd, "    getln((char *) &memory[s%d], s%d);\n", y, x);
+        break;
+    case VM_BRGTIMM:
+    case VM_BRGTEIMM:
+    case VM_BRLTIMM:
+    case VM_BRLTEIMM:
+    case VM_BREQLIMM:
+    case VM_BRNEQLIMM:
+        fprintf(fd, "    if (s%d %s s%d)\n        goto L%04x;\n", y, relops[op - VM_BRGTIMM], x, w);
+        break;
+    case VM_BRZIMM:
+        fprintf(fd, "    if (!s%d)\n        goto L%04x;\n", x, w);
+        break;
+    case VM_FILE:
+        switch (CBYTE(a + 1)) {
+        case FILE_OPEN:
+            fprintf(fd, "    wrw(s%d, fileopen((char *) &memory[s%d], s%d));\n", x, z, y);
+            break;
+        case FILE_CLOSE:
+            fprintf(fd, "    fileclose(s%d);\n", x);
+            break;
+        case FILE_READ:
+        case FILE_WRITE:
+            /* Don't run off the end of memory[] */
+            fprintf(fd, "    if (s%d > 0x10000 - s%d)\n        s%d = 0x10000 - s%d;\n", y, z, y, z);
+            fprintf(fd, "    wrw(s%d, file%s(s%d, (char *) &memory[s%d], s%d));\n", x,
+                    (CBYTE(a + 1) == FILE_READ ? "read" : "write"), d - 4, z, y);
+            break;
+        case FILE_SEEK:
+            fprintf(fd, "    fileseek(s%d, (long) (short) s%d * 65536L + s%d, s%d);\n",
+                    d - 4, y, z, x);
+            break;
+        case FILE_MAP:
+            fprintf(fd, "    wrw(s%d, (s%d > 0x10000 - s%d ? 0 : filemap(s%d, (char *) &memory[s%d], s%d, s%d)));\n",
+                    x, z, d - 4, d - 5, d - 4, z, y);
+            break;
+        case FILE_UNMAP:
+            fprintf(fd, "    if (s%d <= 0x10000 - s%d)\n        fileunmap((char *) &memory[s%d], s%d);\n",
+                    x, y, y, x);
+            break;
+        }
+        break;
+    case VM_MEM:
+        switch (CBYTE(a + 1)) {
+        case MEM_COPY:
+            /* Don't run off the end of memory[] */
+            fprintf(fd, "    if (s%d > 0x10000 - s%d)\n        s%d = 0x10000 - s%d;\n", x, z, x, z);
+            fprintf(fd, "    if (s%d > 0x10000 - s%d)\n        s%d = 0x10000 - s%d;\n", x, y, x, y);
+            fprintf(fd, "    memmove(&memory[s%d], &memory[s%d], s%d);\n", z, y, x);
+            break;
+        case MEM_FILL:
+            fprintf(fd, "    if (s%d > 0x10000 - s%d)\n        s%d = 0x10000 - s%d;\n", x, z, x, z);
+            fprintf(fd, "    memset(&memory[s%d], s%d, s%d);\n", z, y, x);
+            break;
+        case MEM_CMP:
+            fprintf(fd, "    if (s%d > 0x10000 - s%d)\n        s%d = 0x10000 - s%d;\n", y, d - 4, y, d - 4);
+            fprintf(fd, "    if (s%d > 0x10000 - s%d)\n        s%d = 0x10000 - s%d;\n", y, z, y, z);
+            fprintf(fd, "    {\n        int n = memcmp(&memory[s%d], &memory[s%d], s%d);\n", d - 4, z, y);
+            fprintf(fd, "        wrw(s%d, (n > 0 ? 1 : (n ? 0xffff : 0)));\n    }\n", x);
+            break;
+        case MEM_ALLOC:
+            fprintf(fd, "    wrw(s%d, heapalloc(memory, HEAP, s%d));\n", x, y);
+            break;
+        case MEM_FREE:
+            fprintf(fd, "    heapfree(memory, HEAP, s%d);\n", x);
+            break;
+        }
+        break;
+    case VM_STR:
+        /* memory[0x10000] is always zero, so strings end there at the latest */
+        switch (CBYTE(a + 1)) {
+        case STR_LEN:
+            fprintf(fd, "    wrw(s%d, strlen((char *) &memory[s%d]));\n", x, y);
+            break;
+        case STR_CPY:
+        case STR_CAT:
+            fprintf(fd, "    {\n        int d = s%d;\n", y);
+            if (CBYTE(a + 1) == STR_CAT) {
+                fprintf(fd, "        d += strlen((char *) &memory[d]);\n");
+            }
+            fprintf(fd, "        int n = strlen((char *) &memory[s%d]) + 1;\n", x);
+            fprintf(fd, "        memmove(&memory[d], &memory[s%d], (n > 0x10000 - d ? 0x10000 - d : n));\n    }\n", x);
+            break;
+        case STR_CMP:
+            fprintf(fd, "    {\n        int n = strcmp((char *) &memory[s%d], (char *) &memory[s%d]);\n", z, y);
+            fprintf(fd, "        wrw(s%d, (n > 0 ? 1 : (n ? 0xffff : 0)));\n    }\n", x);
+            break;
+        case STR_CHR:
+        case STR_FIND:
+            if (CBYTE(a + 1) == STR_CHR) {
+                fprintf(fd, "    {\n        char *p = strchr((char *) &memory[s%d], s%d);\n", z, y);
+            } else {
+                fprintf(fd, "    {\n        char *p = strstr((char *) &memory[s%d], (char *) &memory[s%d]);\n", z, y);
+            }
+            fprintf(fd, "        wrw(s%d, (p ? p - (char *) &memory[s%d] : 0xffff));\n    }\n", x, z);
+            break;
+        }
+        break;
+    case VM_VEC:
+        /* As the VM, but with 16 bit words, always little endian */
+        fn = CBYTE(a + 1);
+        size = ((fn == VEC_W) || (fn == VEC_WK) || (fn == VEC_RW) ? 2 : 1);
+        switch (fn) {
+        case VEC_W:
+        case VEC_B:
+            fprintf(fd, "    if (s%d * %d > 0x10000 - s%d)\n        s%d = (0x10000 - s%d) / %d;\n",
+                    x, size, z, x, z, size);
+            fprintf(fd, "    if (s%d * %d > 0x10000 - s%d)\n        s%d = (0x10000 - s%d) / %d;\n",
+                    x, size, y, x, y, size);
+            fprintf(fd, "    vecop(s%d, &memory[s%d], &memory[s%d], 0, s%d, %d);\n",
+                    d - 4, z, y, x, size);
+            break;
+        case VEC_WK:
+        case VEC_BK:
+            fprintf(fd, "    if (s%d * %d > 0x10000 - s%d)\n        s%d = (0x10000 - s%d) / %d;\n",
+                    x, size, z, x, z, size);
+            fprintf(fd, "    vecop(s%d, &memory[s%d], NULL, s%d, s%d, %d);\n",
+                    d - 4, z, y, x, size);
+            break;
+        case VEC_RW:
+        case VEC_RB:
+            fprintf(fd, "    if (s%d * %d > 0x10000 - s%d)\n        s%d = (0x10000 - s%d) / %d;\n",
+                    y, size, z, y, z, size);
+            fprintf(fd, "    wrw(s%d, vecreduce(s%d, &memory[s%d], s%d, %d));\n",
+                    x, d - 4, z, y, size);
+            break;
+        }
+        break;
+    case VM_SORT:
+        fn = CBYTE(a + 1);
+        size = ((fn == SORT_W) || (fn == SORT_SEARCHW) ? 2 : 1);
+        switch (fn) {
+        case SORT_W:
+        case SORT_B:
+            fprintf(fd, "    if (s%d * %d > 0x10000 - s%d)\n        s%d = (0x10000 - s%d) / %d;\n",
+                    z, size, d - 4, z, d - 4, size);
+            fprintf(fd, "    if (s%d && (s%d * 2 > 0x10000 - s%d))\n        s%d = (0x10000 - s%d) / 2;\n",
+                    x, z, x, z, x);
+            fprintf(fd, "    vecsort(&memory[s%d], s%d, %d, s%d, (s%d ? &memory[s%d] : NULL), 2);\n",
+                    d - 4, z, size, y, x, x);
+            break;
+        case SORT_SEARCHW:
+        case SORT_SEARCHB:
+            fprintf(fd, "    if (s%d * %d > 0x10000 - s%d)\n        s%d = (0x10000 - s%d) / %d;\n",
+                    d - 4, size, d - 5, d - 4, d - 5, size);
+            fprintf(fd, "    wrw(s%d, vecsearch(&memory[s%d], s%d, %d, s%d,\n", x, d - 5, d - 4, size, z);
+            fprintf(fd, "                       (s%d & SORT_SIGNED ? (unsigned long) (long) (short) s%d : s%d)));\n",
+                    z, y, y);
+            break;
+        }
+        break;
+    case VM_HASH:
+        /* As the VM: a table which would run off the end of memory[] is left alone */
+        switch (CBYTE(a + 1)) {
+        case HASH_NEW:
+            fprintf(fd, "    if (HASHWORDS((unsigned long) s%d) * 2 <= 0x10000ul - s%d)\n", y, z);
+            fprintf(fd, "        hashnew(&memory[s%d], s%d, s%d, 2);\n", z, y, x);
+            break;
+        case HASH_PUT:
+            fprintf(fd, "    wrw(s%d, HASHWORDS((unsigned long) rdw(s%d)) * 2 <= 0x10000ul - s%d &&\n",
+                    x, d - 4, d - 4);
+            fprintf(fd, "        hashput(&memory[s%d], s%d, s%d, (char *) memory, 2));\n", d - 4, z, y);
+            break;
+        case HASH_GET:
+            fprintf(fd, "    {\n        unsigned int v;\n");
+            fprintf(fd, "        int ok = HASHWORDS((unsigned long) rdw(s%d)) * 2 <= 0x10000ul - s%d &&\n",
+                    d - 4, d - 4);
+            fprintf(fd, "            hashget(&memory[s%d], s%d, &v, (char *) memory, 2);\n", d - 4, z);
+            fprintf(fd, "        if (ok)\n            wrw(s%d, v);\n        wrw(s%d, ok);\n    }\n", y, x);
+            break;
+        case HASH_DEL:
+            fprintf(fd, "    wrw(s%d, HASHWORDS((unsigned long) rdw(s%d)) * 2 <= 0x10000ul - s%d &&\n",
+                    x, z, z);
+            fprintf(fd, "        hashdel(&memory[s%d], s%d, (char *) memory, 2));\n", z, y);
+            break;
+        case HASH_NEXT:
+            fprintf(fd, "    {\n        unsigned int k, v, i = 0;\n");
+            fprintf(fd, "        if (HASHWORDS((unsigned long) rdw(s%d)) * 2 <= 0x10000ul - s%d)\n",
+                    d - 4, d - 4);
+            fprintf(fd, "            i = hashnext(&memory[s%d], rdw(s%d), &k, &v, 2);\n", d - 4, z);
+            fprintf(fd, "        if (i) {\n            wrw(s%d, k);\n            wrw(s%d, v);\n        }\n", y, x);
+            fprintf(fd, "        wrw(s%d, i);\n    }\n", z);
+            break;
+        }
+        break;
+    }
+}
+
+/*
+ * Write C translation of compiled code to file.
+ * Call this after compilation is done, instead of writebytecode().
+ */
+void writecsource()
+{
+    unsigned int len = rtPC - RTPCSTART;
+    signed char *depth = malloc(len);
+    unsigned char *flags = calloc(len, 1);
+    unsigned int entry;
+    unsigned int a;
+    unsigned int next;
+    unsigned char op;
+    unsigned char needs;
+    unsigned char swaps;
+    unsigned char selfcall;
+    signed char d;
+    signed char maxdepth;
+
+    a = xlateanalyse(depth, flags, len);
+    if (a) {
+        error(ERR_XLATE);
+        print(" at ");
+        printhex(a);
+        free(depth);
+        free(flags);
+        return;
+    }
+
+    strcpy(readbuf, filename);
+    printchar('\n');
+    if (openfile(1)) {
+        free(depth);
+        free(flags);
+        return;
+    }
+    print("...\n");
+
+    fprintf(fd, "/* Translated by EightBall v%s */\n\n", VERSIONSTR);
+    fprintf(fd, "#include <stdlib.h>\n#include <string.h>\n");
+    fprintf(fd, "#include \"eightballutils.h\"\n\n");
+    fprintf(fd, "static unsigned char memory[64 * 1024 + 1] __attribute__ ((aligned(MAPBLOCK)));\n");
+    fprintf(fd, "static unsigned short sp;\nstatic unsigned short fp;\n\n");
+    fprintf(fd, "#define HEAP 0x%04x\n\n", rtPC);
+    fprintf(fd, "static unsigned short rdw(unsigned short a)\n{\n");
+    fprintf(fd, "    return memory[a] | (memory[a + 1] << 8);\n}\n\n");
+    fprintf(fd, "static void wrw(unsigned short a, unsigned short w)\n{\n");
+    fprintf(fd, "    memory[a] = w;\n    memory[a + 1] = w >> 8;\n}\n\n");
+
+    fprintf(fd, "static const unsigned char image[] = {");
+    for (a = 0; a < len; ++a) {
+        fprintf(fd, "%s0x%02x%s", (a % 12 ? " " : "\n    "), CBYTE(a + RTPCSTART),
+                (a < len - 1 ? "," : ""));
+    }
+    fprintf(fd, "\n};\n\n");
+
+    for (a = 0; a < len; ++a) {
+        if (flags[a] & XLATE_FN) {
+            fprintf(fd, "static unsigned short ");
+            xlatename(a + RTPCSTART);
+            fprintf(fd, "(void);\n");
+        }
+    }
+
+    for (entry = 0; entry < len; entry = next) {
+
+        /* Find extent of function and deepest evaluation stack */
+        maxdepth = 0;
+        swaps = 0;
+        selfcall = 0;
+        for (next = entry; next < len; next += xlatelen(next + RTPCSTART)) {
+            if ((next != entry) && (flags[next] & XLATE_FN)) {
+                break;
+            }
+            op = CBYTE(next + RTPCSTART);
+            d = depth[next] + xlateeffect(next + RTPCSTART, &needs);
+            if ((depth[next] >= 0) && (d > maxdepth)) {
+                maxdepth = d;
+            }
+            swaps |= (op == VM_SWAP);
+            selfcall |= ((op == VM_JMPIMM) &&
+                         ((unsigned int) CWORD(next + RTPCSTART + 1) == entry + RTPCSTART));
+        }
+
+        fprintf(fd, "\nstatic unsigned short ");
+        xlatename(entry + RTPCSTART);
+        fprintf(fd, "(void)\n{\n");
+        if (swaps) {
+            fprintf(fd, "    unsigned short t;\n");
+        }
+        for (d = 0; d < maxdepth; ++d) {
+            fprintf(fd, "    unsigned short s%d;\n", d);
+        }
+        fprintf(fd, "\n");
+
+        d = -1;
+        for (a = entry; a < next; a += xlatelen(a + RTPCSTART)) {
+            d = depth[a];
+            if (d < 0) {
+                continue;
+            }
+            if ((flags[a] & XLATE_LBL) || ((a == entry) && selfcall)) {
+                fprintf(fd, "L%04x:\n", a + RTPCSTART);
+            }
+            xlateinsn(a + RTPCSTART, d, entry + RTPCSTART);
+            op = CBYTE(a + RTPCSTART);
+            d += xlateeffect(a + RTPCSTART, &needs);
+            if ((op == VM_JMPIMM) || (op == VM_RTS) || (op == VM_END)) {
+                d = -1;
+            }
+        }
+
+        /* Falls through into the following code */
+        if (d >= 0) {
+            if (next < len) {
+                fprintf(fd, "    return ");
+                xlatename(next + RTPCSTART);
+                fprintf(fd, "();\n");
+            } else {
+                fprintf(fd, "    exit(0);\n");
+            }
+        }
+        fprintf(fd, "}\n");
+    }
+
+    fprintf(fd, "\nint main()\n{\n");
+    fprintf(fd, "    memcpy(memory + 0x%04x, image, sizeof(image));\n", RTPCSTART);
+    fprintf(fd, "    sp = fp = 0x%04x;\n", RTCALLSTACKTOP);
+    fprintf(fd, "    heapinit(memory, HEAP, 0x%04x);\n", RTCALLSTACKLIM);
+    fprintf(fd, "    ebmain();\n    return 0;\n}\n");
+
+    fclose(fd);
+    free(depth);
+    free(flags);
+}
+
+/*
+ * Native 6502 backend (cross compiler, Linux only.)
+ *
+ * If the filename given to 'comp' ends in '.prg' then the compiled code is
+ * translated to 6502 machine code.  The output file has a two byte load
+ * address followed by the code.  The machine is chosen by the filename,
+ * in the same way as the EightBall binaries are named:
+ *
+ *   prog64.prg  Commodore 64.  Loads at $0801 and starts with a BASIC
+ *               stub (10 SYS 2061), so it can be LOADed and RUN.
+ *   prog20.prg  VIC-20 with 32K expansion, including BLK5.  Loads at
+ *               $1201 with a BASIC stub (10 SYS 4621.)
+ *   prog.prg    Apple II.  Loads at $0800 and starts executing at the
+ *               load address (800G from the monitor.)
+ *
+ * The call stack is where the Linux VM puts it, so globals have the same
+ * addresses, but the native code is bigger than bytecode so it is loaded
+ * lower, from the load address up to RTCALLSTACKLIM ($8000 on the VIC-20,
+ * where the call stack is in BLK5 and must stay above $A000.)  On the C64
+ * the BASIC ROM is banked out so the call stack is in RAM.  Console I/O
+ * uses the Apple II monitor COUT and RDKEY routines, or the CBM KERNAL
+ * CHROUT and GETIN routines, translating ASCII to and from PETSCII.
+ *
+ * The evaluation stack lives in zero page, indexed by the X register.  The
+ * depth of the evaluation stack is known for each instruction at
+ * translation time (see xlateanalyse()), so each slot has a fixed zero
+ * page offset from X within a subroutine.  When calling a subroutine X is
+ * advanced past the caller's slots, and the return value is left in the
+ * callee's first slot.  X must be preserved by everything else.  The VM
+ * allows 16 entries in all, so 64 bytes is plenty.  On the Apple II zero
+ * page from $60 to $B0 is used, which clobbers Applesoft, so run the
+ * program from the monitor.  On the Commodore machines $02 to $52 is
+ * used, which belongs to BASIC, so it is saved on entry and restored on
+ * exit.
+ *
+ * Simple operations are generated inline.  Everything else calls a small
+ * runtime library which is written at the start of the code.
+ */
+#define NA2         0           /* Native targets                         */
+#define NC64        1
+#define NVIC20      2
+
+#define NA2START    0x0800      /* Load addresses                         */
+#define NC64START   0x0801
+#define NVICSTART   0x1201
+#define NVICLIM     0x8000      /* End of VIC-20 RAM below BLK5           */
+
+#define NEVZP       nzp         /* Evaluation stack (64 bytes)            */
+#define NSP         (nzp + 0x40) /* VM stack pointer                      */
+#define NFP         (nzp + 0x42) /* VM frame pointer                      */
+#define NFP1        (nzp + 0x44) /* Frame pointer + 1                     */
+#define NFPL        (nzp + 0x46) /* Frame pointer + 1 - 256               */
+#define NT0         (nzp + 0x48) /* Temporaries / runtime library args    */
+#define NT1         (nzp + 0x4a)
+#define NT2         (nzp + 0x4c)
+#define NT3         (nzp + 0x4e)
+#define NSAVES      (nzp + 0x50) /* 6502 stack pointer on entry           */
+#define NZPLEN      0x51        /* Bytes of zero page used                */
+
+#define NCOUT       0xfded      /* Apple II monitor - output char         */
+#define NRDKEY      0xfd0c      /* Apple II monitor - read key            */
+#define NCHROUT     0xffd2      /* CBM KERNAL - output char               */
+#define NGETIN      0xffe4      /* CBM KERNAL - get key, 0 if none        */
+#define NC64PORT    0x01        /* C64 memory configuration               */
+
+#define EVLO(k)     (NEVZP + 2 * (k))
+#define EVHI(k)     (NEVZP + 2 * (k) + 1)
+
+/* 6502 opcodes */
+#define N_ADC_IMM   0x69
+#define N_ADC_ZP    0x65
+#define N_ADC_ZPX   0x75
+#define N_ADC_INDY  0x71
+#define N_AND_IMM   0x29
+#define N_AND_ZPX   0x35
+#define N_ASL_ZP    0x06
+#define N_ASL_ZPX   0x16
+#define N_BCC       0x90
+#define N_BCS       0xb0
+#define N_BEQ       0xf0
+#define N_BNE       0xd0
+#define N_BPL       0x10
+#define N_CLC       0x18
+#define N_CMP_IMM   0xc9
+#define N_CMP_ZPX   0xd5
+#define N_CPX_IMM   0xe0
+#define N_CPY_IMM   0xc0
+#define N_CPY_ZP    0xc4
+#define N_DEC_ZP    0xc6
+#define N_DEC_ZPX   0xd6
+#define N_DEX       0xca
+#define N_DEY       0x88
+#define N_EOR_IMM   0x49
+#define N_EOR_ZPX   0x55
+#define N_INC_ZP    0xe6
+#define N_INC_ZPX   0xf6
+#define N_INX       0xe8
+#define N_INY       0xc8
+#define N_JMP       0x4c
+#define N_JSR       0x20
+#define N_LDA_ABS   0xad
+#define N_LDA_ABSX  0xbd
+#define N_LDA_IMM   0xa9
+#define N_LDA_INDY  0xb1
+#define N_LDA_ZP    0xa5
+#define N_LDA_ZPX   0xb5
+#define N_LDX_IMM   0xa2
+#define N_LDX_ZP    0xa6
+#define N_LDY_IMM   0xa0
+#define N_LDY_ZP    0xa4
+#define N_LDY_ZPX   0xb4
+#define N_LSR_A     0x4a
+#define N_LSR_ZP    0x46
+#define N_ORA_IMM   0x09
+#define N_ORA_ZPX   0x15
+#define N_PHA       0x48
+#define N_PLA       0x68
+#define N_ROL_ZP    0x26
+#define N_ROL_ZPX   0x36
+#define N_ROR_ZP    0x66
+#define N_RTS       0x60
+#define N_SBC_ABSX  0xfd
+#define N_SBC_IMM   0xe9
+#define N_SBC_ZP    0xe5
+#define N_SBC_ZPX   0xf5
+#define N_SEC       0x38
+#define N_STA_ABS   0x8d
+#define N_STA_ABSX  0x9d
+#define N_STA_INDY  0x91
+#define N_STA_ZP    0x85
+#define N_STA_ZPX   0x95
+#define N_STX_ZP    0x86
+#define N_STY_ZP    0x84
+#define N_STY_ZPX   0x94
+#define N_TAX       0xaa
+#define N_TAY       0xa8
+#define N_TSX       0xba
+#define N_TXA       0x8a
+#define N_TXS       0x9a
+#define N_TYA       0x98
+
+unsigned char nattgt;           /* NA2, NC64 or NVIC20                  */
+unsigned int natorg;            /* Load address                         */
+unsigned char nzp;              /* First zero page location used        */
+unsigned int nzpsave;           /* Saved zero page (Commodore only)     */
+unsigned char *natbuf;          /* Native code, from natorg             */
+unsigned int natpc;             /* Address of next byte of native code  */
+
+/* Entry points of runtime library routines */
+unsigned int nrt_setfp1, nrt_addsp, nrt_decsp, nrt_pshw, nrt_pshb, nrt_popw, nrt_popb;
+unsigned int nrt_sptofp, nrt_fptosp, nrt_mul, nrt_div, nrt_lsh, nrt_rsh;
+unsigned int nrt_putch, nrt_prmsg, nrt_prstr, nrt_prdec, nrt_prhex;
+unsigned int nrt_getch, nrt_getln, nrt_exit;
+
+void n1(unsigned char b)
+{
+    natbuf[natpc++ - natorg] = b;
+}
+
+void n2(unsigned char op, unsigned char b)
+{
+    n1(op);
+    n1(b);
+}
+
+void n3(unsigned char op, unsigned int w)
+{
+    n1(op);
+    n1(w & 0xff);
+    n1((w >> 8) & 0xff);
+}
+
+/*
+ * Emit forward branch.  Returns address of the offset byte, to be
+ * passed to nland() when the destination is reached.
+ */
+unsigned int nfwd(unsigned char op)
+{
+    n2(op, 0);
+    return natpc - 1;
+}
+
+void nland(unsigned int at)
+{
+    natbuf[at - natorg] = natpc - at - 1;
+}
+
+/*
+ * Emit backward branch to address to.
+ */
+void nback(unsigned char op, unsigned int to)
+{
+    n2(op, (to - natpc - 2) & 0xff);
+}
+
+/*
+ * Add 16 bit value in zero page src to the one in zero page dst.
+ */
+void naddzp(unsigned char dst, unsigned char src)
+{
+    n1(N_CLC);
+    n2(N_LDA_ZP, dst);
+    n2(N_ADC_ZP, src);
+    n2(N_STA_ZP, dst);
+    n2(N_LDA_ZP, dst + 1);
+    n2(N_ADC_ZP, src + 1);
+    n2(N_STA_ZP, dst + 1);
+}
+
+/*
+ * Add constant to the 16 bit value in zero page dst.
+ */
+void naddimm(unsigned char dst, unsigned int w)
+{
+    n1(N_CLC);
+    n2(N_LDA_ZP, dst);
+    n2(N_ADC_IMM, w & 0xff);
+    n2(N_STA_ZP, dst);
+    n2(N_LDA_ZP, dst + 1);
+    n2(N_ADC_IMM, (w >> 8) & 0xff);
+    n2(N_STA_ZP, dst + 1);
+}
+
+/*
+ * Copy eval stack slot k to zero page pointer zp, and back.
+ */
+void nslottozp(signed char k, unsigned char zp)
+{
+    n2(N_LDA_ZPX, EVLO(k));
+    n2(N_STA_ZP, zp);
+    n2(N_LDA_ZPX, EVHI(k));
+    n2(N_STA_ZP, zp + 1);
+}
+
+void nzptoslot(unsigned char zp, signed char k)
+{
+    n2(N_LDA_ZP, zp);
+    n2(N_STA_ZPX, EVLO(k));
+    n2(N_LDA_ZP, zp + 1);
+    n2(N_STA_ZPX, EVHI(k));
+}
+
+/*
+ * Set zero page pointer zp to frame relative address off.
+ */
+void nframeptr(unsigned char zp, unsigned int off)
+{
+    n1(N_CLC);
+    n2(N_LDA_ZP, NFP1);
+    n2(N_ADC_IMM, off & 0xff);
+    n2(N_STA_ZP, zp);
+    n2(N_LDA_ZP, NFP1 + 1);
+    n2(N_ADC_IMM, (off >> 8) & 0xff);
+    n2(N_STA_ZP, zp + 1);
+}
+
+/*
+ * Load (word) eval stack slot k from the address in zero page zp, or store
+ * slot k there.
+ */
+void nldind(unsigned char zp, signed char k, unsigned char word)
+{
+    n2(N_LDY_IMM, 0);
+    n2(N_LDA_INDY, zp);
+    n2(N_STA_ZPX, EVLO(k));
+    if (word) {
+        n1(N_INY);
+        n2(N_LDA_INDY, zp);
+    } else {
+        n2(N_LDA_IMM, 0);
+    }
+    n2(N_STA_ZPX, EVHI(k));
+}
+
+void nstind(unsigned char zp, signed char k, unsigned char word)
+{
+    n2(N_LDY_IMM, 0);
+    n2(N_LDA_ZPX, EVLO(k));
+    n2(N_STA_INDY, zp);
+    if (word) {
+        n1(N_INY);
+        n2(N_LDA_ZPX, EVHI(k));
+        n2(N_STA_INDY, zp);
+    }
+}
+
+/*
+ * Load or store (word) eval stack slot k at frame relative address off.
+ * Offsets from -256 to 255 are reached using (NFPL),Y and (NFP1),Y.
+ */
+void nframe(unsigned int off, signed char k, unsigned char word, unsigned char store)
+{
+    unsigned char i;
+    unsigned int o;
+
+    if (((off > 0xff) && (off < 0xff00)) || (word && (off == 0xff))) {
+        nframeptr(NT0, off);
+        if (store) {
+            nstind(NT0, k, word);
+        } else {
+            nldind(NT0, k, word);
+        }
+        return;
+    }
+    for (i = 0; i < 2; ++i) {
+        o = (off + i) & 0xffff;
+        if (!i || word) {
+            if (store) {
+                n2(N_LDA_ZPX, (i ? EVHI(k) : EVLO(k)));
+            }
+            n2(N_LDY_IMM, o & 0xff);
+            n2((store ? N_STA_INDY : N_LDA_INDY), (o > 0xff ? NFPL : NFP1));
+            if (!store) {
+                n2(N_STA_ZPX, (i ? EVHI(k) : EVLO(k)));
+            }
+        } else if (!store) {
+            n2(N_LDA_IMM, 0);
+            n2(N_STA_ZPX, EVHI(k));
+        }
+    }
+}
+
+/*
+ * Copy the two operands to NT0 and NT1, call runtime routine and copy the
+ * result in NT0 back to the eval stack.
+ */
+void nbinrt(signed char d, unsigned int routine)
+{
+    nslottozp(d - 2, NT0);
+    nslottozp(d - 1, NT1);
+    n3(N_JSR, routine);
+    nzptoslot(NT0, d - 2);
+}
+
+/*
+ * Compare slots d-2 (Y) and d-1 (X) as unsigned 16 bit values.  If swap is
+ * zero carry is set if Y>=X, otherwise carry is set if X>=Y.
+ */
+void ncompare(signed char d, unsigned char swap)
+{
+    signed char a = (swap ? d - 1 : d - 2);
+    signed char b = (swap ? d - 2 : d - 1);
+    n2(N_LDA_ZPX, EVLO(a));
+    n2(N_CMP_ZPX, EVLO(b));
+    n2(N_LDA_ZPX, EVHI(a));
+    n2(N_SBC_ZPX, EVHI(b));
+}
+
+/*
+ * Write the runtime library.
+ */
+void nruntime()
+{
+    unsigned int l;
+    unsigned int m;
+    unsigned int tbl;
+    unsigned int k;
+
+    /* NFP -> NFP1, NFPL */
+    nrt_setfp1 = natpc;
+    n1(N_CLC);
+    n2(N_LDA_ZP, NFP);
+    n2(N_ADC_IMM, 1);
+    n2(N_STA_ZP, NFP1);
+    n2(N_STA_ZP, NFPL);
+    n2(N_LDA_ZP, NFP + 1);
+    n2(N_ADC_IMM, 0);
+    n2(N_STA_ZP, NFP1 + 1);
+    n1(N_SEC);
+    n2(N_SBC_IMM, 1);
+    n2(N_STA_ZP, NFPL + 1);
+    n1(N_RTS);
+
+    /* Add word in A (lo), Y (hi) to VM stack pointer */
+    nrt_addsp = natpc;
+    n1(N_CLC);
+    n2(N_ADC_ZP, NSP);
+    n2(N_STA_ZP, NSP);
+    n1(N_TYA);
+    n2(N_ADC_ZP, NSP + 1);
+    n2(N_STA_ZP, NSP + 1);
+    n1(N_RTS);
+
+    /* Decrement VM stack pointer */
+    nrt_decsp = natpc;
+    n2(N_LDA_ZP, NSP);
+    l = nfwd(N_BNE);
+    n2(N_DEC_ZP, NSP + 1);
+    nland(l);
+    n2(N_DEC_ZP, NSP);
+    n1(N_RTS);
+
+    /* Push word in A (lo), Y (hi) to VM call stack */
+    nrt_pshw = natpc;
+    n2(N_STA_ZP, NT3);
+    n1(N_TYA);
+    n2(N_LDY_IMM, 0);
+    n2(N_STA_INDY, NSP);
+    n3(N_JSR, nrt_decsp);
+    n2(N_LDA_ZP, NT3);
+    n2(N_STA_INDY, NSP);
+    n3(N_JMP, nrt_decsp);
+
+    /* Push byte in A to VM call stack */
+    nrt_pshb = natpc;
+    n2(N_LDY_IMM, 0);
+    n2(N_STA_INDY, NSP);
+    n3(N_JMP, nrt_decsp);
+
+    /* Pop word from VM call stack to A (lo), Y (hi) */
+    nrt_popw = natpc;
+    n2(N_LDY_IMM, 1);
+    n2(N_LDA_INDY, NSP);
+    n2(N_STA_ZP, NT3);
+    n1(N_INY);
+    n2(N_LDA_INDY, NSP);
+    n2(N_STA_ZP, NT3 + 1);
+    naddimm(NSP, 2);
+    n2(N_LDA_ZP, NT3);
+    n2(N_LDY_ZP, NT3 + 1);
+    n1(N_RTS);
+
+    /* Pop byte from VM call stack to A */
+    nrt_popb = natpc;
+    n2(N_LDY_IMM, 1);
+    n2(N_LDA_INDY, NSP);
+    n2(N_INC_ZP, NSP);
+    l = nfwd(N_BNE);
+    n2(N_INC_ZP, NSP + 1);
+    nland(l);
+    n1(N_RTS);
+
+    /* VM_SPTOFP */
+    nrt_sptofp = natpc;
+    n2(N_LDA_ZP, NFP);
+    n2(N_LDY_ZP, NFP + 1);
+    n3(N_JSR, nrt_pshw);
+    n2(N_LDA_ZP, NSP);
+    n2(N_STA_ZP, NFP);
+    n2(N_LDA_ZP, NSP + 1);
+    n2(N_STA_ZP, NFP + 1);
+    n3(N_JMP, nrt_setfp1);
+
+    /* VM_FPTOSP */
+    nrt_fptosp = natpc;
+    n2(N_LDA_ZP, NFP);
+    n2(N_STA_ZP, NSP);
+    n2(N_LDA_ZP, NFP + 1);
+    n2(N_STA_ZP, NSP + 1);
+    n3(N_JSR, nrt_popw);
+    n2(N_STA_ZP, NFP);
+    n2(N_STY_ZP, NFP + 1);
+    n3(N_JMP, nrt_setfp1);
+
+    /* NT0 = NT0 * NT1 */
+    nrt_mul = natpc;
+    n2(N_LDA_IMM, 0);
+    n2(N_STA_ZP, NT2);
+    n2(N_STA_ZP, NT2 + 1);
+    n2(N_LDY_IMM, 16);
+    l = natpc;
+    n2(N_LSR_ZP, NT1 + 1);
+    n2(N_ROR_ZP, NT1);
+    m = nfwd(N_BCC);
+    naddzp(NT2, NT0);
+    nland(m);
+    n2(N_ASL_ZP, NT0);
+    n2(N_ROL_ZP, NT0 + 1);
+    n1(N_DEY);
+    nback(N_BNE, l);
+    n2(N_LDA_ZP, NT2);
+    n2(N_STA_ZP, NT0);
+    n2(N_LDA_ZP, NT2 + 1);
+    n2(N_STA_ZP, NT0 + 1);
+    n1(N_RTS);
+
+    /* NT0 = NT0 / NT1, NT2 = NT0 % NT1 */
+    nrt_div = natpc;
+    n2(N_LDA_IMM, 0);
+    n2(N_STA_ZP, NT2);
+    n2(N_STA_ZP, NT2 + 1);
+    n2(N_LDY_IMM, 16);
+    l = natpc;
+    n2(N_ASL_ZP, NT0);
+    n2(N_ROL_ZP, NT0 + 1);
+    n2(N_ROL_ZP, NT2);
+    n2(N_ROL_ZP, NT2 + 1);
+    n1(N_SEC);
+    n2(N_LDA_ZP, NT2);
+    n2(N_SBC_ZP, NT1);
+    n2(N_STA_ZP, NT3);
+    n2(N_LDA_ZP, NT2 + 1);
+    n2(N_SBC_ZP, NT1 + 1);
+    m = nfwd(N_BCC);
+    n2(N_STA_ZP, NT2 + 1);
+    n2(N_LDA_ZP, NT3);
+    n2(N_STA_ZP, NT2);
+    n2(N_INC_ZP, NT0);
+    nland(m);
+    n1(N_DEY);
+    nback(N_BNE, l);
+    n1(N_RTS);
+
+    /* NT0 = NT0 << NT1, NT0 = NT0 >> NT1 */
+    nrt_lsh = natpc;
+    n2(N_LDY_ZP, NT1);
+    m = nfwd(N_BEQ);
+    l = natpc;
+    n2(N_ASL_ZP, NT0);
+    n2(N_ROL_ZP, NT0 + 1);
+    n1(N_DEY);
+    nback(N_BNE, l);
+    nland(m);
+    n1(N_RTS);
+    nrt_rsh = natpc;
+    n2(N_LDY_ZP, NT1);
+    m = nfwd(N_BEQ);
+    l = natpc;
+    n2(N_LSR_ZP, NT0 + 1);
+    n2(N_ROR_ZP, NT0);
+    n1(N_DEY);
+    nback(N_BNE, l);
+    nland(m);
+    n1(N_RTS);
+
+    /* Output char in A */
+    nrt_putch = natpc;
+    n2(N_CMP_IMM, '\n');
+    l = nfwd(N_BNE);
+    n2(N_LDA_IMM, 13);
+    nland(l);
+    if (nattgt == NA2) {
+        n2(N_ORA_IMM, 0x80);
+        n3(N_JMP, NCOUT);
+    } else {
+        /* ASCII to PETSCII: swap the case of letters */
+        n2(N_CMP_IMM, 'A');
+        l = nfwd(N_BCC);
+        n2(N_CMP_IMM, 'Z' + 1);
+        m = nfwd(N_BCS);
+        n2(N_ORA_IMM, 0x80);
+        k = nfwd(N_BNE);
+        nland(m);
+        n2(N_CMP_IMM, 'a');
+        m = nfwd(N_BCC);
+        n2(N_CMP_IMM, 'z' + 1);
+        tbl = nfwd(N_BCS);
+        n2(N_AND_IMM, 0xdf);
+        nland(l);
+        nland(m);
+        nland(k);
+        nland(tbl);
+        n3(N_JMP, NCHROUT);
+    }
+
+    /* Output string following JSR */
+    nrt_prmsg = natpc;
+    n1(N_PLA);
+    n2(N_STA_ZP, NT0);
+    n1(N_PLA);
+    n2(N_STA_ZP, NT0 + 1);
+    l = natpc;
+    n2(N_INC_ZP, NT0);
+    m = nfwd(N_BNE);
+    n2(N_INC_ZP, NT0 + 1);
+    nland(m);
+    n2(N_LDY_IMM, 0);
+    n2(N_LDA_INDY, NT0);
+    m = nfwd(N_BEQ);
+    n3(N_JSR, nrt_putch);
+    n3(N_JMP, l);
+    nland(m);
+    n2(N_LDA_ZP, NT0 + 1);
+    n1(N_PHA);
+    n2(N_LDA_ZP, NT0);
+    n1(N_PHA);
+    n1(N_RTS);
+
+    /* Output string pointed to by NT0 */
+    nrt_prstr = natpc;
+    n2(N_LDY_IMM, 0);
+    n2(N_LDA_INDY, NT0);
+    m = nfwd(N_BEQ);
+    n3(N_JSR, nrt_putch);
+    n2(N_INC_ZP, NT0);
+    nback(N_BNE, nrt_prstr);
+    n2(N_INC_ZP, NT0 + 1);
+    n3(N_JMP, nrt_prstr);
+    nland(m);
+    n1(N_RTS);
+
+    /* Output NT0 as unsigned decimal */
+    tbl = natpc;
+    n1(10000 & 0xff);
+    n1(1000 & 0xff);
+    n1(100);
+    n1(10);
+    n1(10000 >> 8);
+    n1(1000 >> 8);
+    n1(0);
+    n1(0);
+    nrt_prdec = natpc;
+    n1(N_TXA);
+    n1(N_PHA);
+    n2(N_LDA_IMM, 0);
+    n2(N_STA_ZP, NT2);
+    n2(N_LDX_IMM, 0);
+    l = natpc;
+    n2(N_LDY_IMM, '0');
+    m = natpc;
+    n1(N_SEC);
+    n2(N_LDA_ZP, NT0);
+    n3(N_SBC_ABSX, tbl);
+    n2(N_STA_ZP, NT3);
+    n2(N_LDA_ZP, NT0 + 1);
+    n3(N_SBC_ABSX, tbl + 4);
+    k = nfwd(N_BCC);
+    n2(N_STA_ZP, NT0 + 1);
+    n2(N_LDA_ZP, NT3);
+    n2(N_STA_ZP, NT0);
+    n1(N_INY);
+    nback(N_BNE, m);
+    nland(k);
+    n2(N_CPY_IMM, '0');
+    m = nfwd(N_BNE);
+    n2(N_LDA_ZP, NT2);
+    k = nfwd(N_BEQ);
+    nland(m);
+    n2(N_STY_ZP, NT2);
+    n1(N_TYA);
+    n3(N_JSR, nrt_putch);
+    nland(k);
+    n1(N_INX);
+    n2(N_CPX_IMM, 4);
+    nback(N_BNE, l);
+    n2(N_LDA_ZP, NT0);
+    n2(N_ORA_IMM, '0');
+    n3(N_JSR, nrt_putch);
+    n1(N_PLA);
+    n1(N_TAX);
+    n1(N_RTS);
+
+    /* Output NT0 as hex.  Uses the code below as a subroutine */
+    nrt_prhex = natpc;
+    n2(N_LDA_IMM, '$');
+    n3(N_JSR, nrt_putch);
+    n2(N_LDA_ZP, NT0 + 1);
+    l = natpc + 5;
+    n3(N_JSR, l);
+    n2(N_LDA_ZP, NT0);
+    /* Output byte in A as hex */
+    n1(N_PHA);
+    n1(N_LSR_A);
+    n1(N_LSR_A);
+    n1(N_LSR_A);
+    n1(N_LSR_A);
+    l = natpc + 6;
+    n3(N_JSR, l);
+    n1(N_PLA);
+    n2(N_AND_IMM, 0x0f);
+    /* Output nibble in A as hex */
+    n2(N_CMP_IMM, 10);
+    m = nfwd(N_BCC);
+    n2(N_ADC_IMM, 'a' - 10 - '0' - 1);
+    nland(m);
+    n2(N_ADC_IMM, '0');
+    n3(N_JMP, nrt_putch);
+
+    /* Read char into A */
+    nrt_getch = natpc;
+    if (nattgt == NA2) {
+        n3(N_JSR, NRDKEY);
+        n2(N_AND_IMM, 0x7f);
+        n1(N_RTS);
+    } else {
+        /* GETIN uses X.  Wait for a key, then PETSCII to ASCII */
+        n1(N_TXA);
+        n1(N_PHA);
+        l = natpc;
+        n3(N_JSR, NGETIN);
+        nback(N_BEQ, l);
+        n2(N_STA_ZP, NT3);
+        n1(N_PLA);
+        n1(N_TAX);
+        n2(N_LDA_ZP, NT3);
+        n2(N_CMP_IMM, 'A');
+        l = nfwd(N_BCC);
+        n2(N_CMP_IMM, 'Z' + 1);
+        m = nfwd(N_BCS);
+        n2(N_ORA_IMM, 0x20);
+        n1(N_RTS);
+        nland(m);
+        n2(N_CMP_IMM, 'A' | 0x80);
+        m = nfwd(N_BCC);
+        n2(N_CMP_IMM, ('Z' + 1) | 0x80);
+        k = nfwd(N_BCS);
+        n2(N_AND_IMM, 0x7f);
+        nland(l);
+        nland(m);
+        nland(k);
+        n1(N_RTS);
+    }
+
+    /*
+     * Read line into buffer at NT0.  Reads up to NT1 chars, like getln(),
+     * and the last one read is replaced with NUL.  Y can only index 256
+     * bytes, so longer buffers are treated as 255 bytes.  If there is no
+     * room for anything but the NUL then the rest of the line is discarded.
+     */
+    nrt_getln = natpc;
+    n2(N_LDA_ZP, NT1 + 1);
+    m = nfwd(N_BEQ);
+    n2(N_LDA_IMM, 0xff);
+    n2(N_STA_ZP, NT1);
+    nland(m);
+    n2(N_LDY_IMM, 0);
+    l = natpc;
+    n2(N_STY_ZP, NT2);
+    n3(N_JSR, nrt_getch);
+    n2(N_LDY_ZP, NT2);
+    n2(N_STA_INDY, NT0);
+    n1(N_INY);
+    n2(N_CMP_IMM, 13);
+    m = nfwd(N_BEQ);
+    n2(N_CPY_ZP, NT1);
+    nback(N_BCC, l);
+    n2(N_CPY_IMM, 2);
+    k = nfwd(N_BCS);
+    l = natpc;
+    n3(N_JSR, nrt_getch);
+    n2(N_CMP_IMM, 13);
+    nback(N_BNE, l);
+    n2(N_LDY_IMM, 1);
+    nland(k);
+    nland(m);
+    n1(N_DEY);
+    n2(N_LDA_IMM, 0);
+    n2(N_STA_INDY, NT0);
+    n1(N_RTS);
+
+    /* Return to caller of program */
+    nrt_exit = natpc;
+    n2(N_LDX_ZP, NSAVES);
+    n1(N_TXS);
+    if (nattgt == NC64) {
+        /* BASIC ROM back in */
+        n2(N_LDA_IMM, 0x37);
+        n2(N_STA_ZP, NC64PORT);
+    }
+    if (nattgt != NA2) {
+        /* Give BASIC its zero page back */
+        n2(N_LDX_IMM, NZPLEN - 1);
+        l = natpc;
+        n3(N_LDA_ABSX, nzpsave);
+        n2(N_STA_ZPX, nzp);
+        n1(N_DEX);
+        nback(N_BPL, l);
+    }
+    n1(N_RTS);
+}
+
+/*
+ * Write 6502 code for the bytecode instruction at address a, with the
+ * evaluation stack d deep.
+ * Jumps and branches are written with the bytecode address of their
+ * destination, which is fixed up later.  Their addresses are added to
+ * fixups[].
+ */
+void ninsn(unsigned int a, signed char d, unsigned int *fixups, unsigned int *nfixups)
+{
+    unsigned char op = CBYTE(a);
+    unsigned int w = CWORD(a + 1);
+    signed char x = d - 1;
+    signed char y = d - 2;
+    unsigned int l;
+    unsigned char i;
+
+    switch (op) {
+    case VM_DROP:
+        break;
+    case VM_END:
+        if (d) {
+            n3(N_JSR, nrt_prmsg);
+            for (l = 0; "WARNING: evalptr "[l]; ++l) {
+                n1("WARNING: evalptr "[l]);
+            }
+            n1(0);
+            n2(N_LDA_IMM, d);
+            n2(N_STA_ZP, NT0);
+            n2(N_LDA_IMM, 0);
+            n2(N_STA_ZP, NT0 + 1);
+            n3(N_JSR, nrt_prdec);
+            n2(N_LDA_IMM, '\n');
+            n3(N_JSR, nrt_putch);
+        }
+        n3(N_JMP, nrt_exit);
+        break;
+    case VM_LDIMM:
+        n2(N_LDA_IMM, w & 0xff);
+        n2(N_STA_ZPX, EVLO(d));
+        if ((w & 0xff) != (w >> 8)) {
+            n2(N_LDA_IMM, w >> 8);
+        }
+        n2(N_STA_ZPX, EVHI(d));
+        break;
+    case VM_LDAWORD:
+    case VM_LDABYTE:
+        nslottozp(x, NT0);
+        nldind(NT0, x, op == VM_LDAWORD);
+        break;
+    case VM_LDAWORDIMM:
+    case VM_LDABYTEIMM:
+        n3(N_LDA_ABS, w);
+        n2(N_STA_ZPX, EVLO(d));
+        if (op == VM_LDAWORDIMM) {
+            n3(N_LDA_ABS, w + 1);
+        } else {
+            n2(N_LDA_IMM, 0);
+        }
+        n2(N_STA_ZPX, EVHI(d));
+        break;
+    case VM_STAWORD:
+    case VM_STABYTE:
+        nslottozp(x, NT0);
+        nstind(NT0, y, op == VM_STAWORD);
+        break;
+    case VM_STAWORDIMM:
+    case VM_STABYTEIMM:
+        n2(N_LDA_ZPX, EVLO(x));
+        n3(N_STA_ABS, w);
+        if (op == VM_STAWORDIMM) {
+            n2(N_LDA_ZPX, EVHI(x));
+            n3(N_STA_ABS, w + 1);
+        }
+        break;
+    case VM_LDRWORD:
+    case VM_LDRBYTE:
+        nslottozp(x, NT0);
+        naddzp(NT0, NFP1);
+        nldind(NT0, x, op == VM_LDRWORD);
+        break;
+    case VM_LDRWORDIMM:
+    case VM_LDRBYTEIMM:
+        nframe(w, d, op == VM_LDRWORDIMM, 0);
+        break;
+    case VM_STRWORD:
+    case VM_STRBYTE:
+        nslottozp(x, NT0);
+        naddzp(NT0, NFP1);
+        nstind(NT0, y, op == VM_STRWORD);
+        break;
+    case VM_STRWORDIMM:
+    case VM_STRBYTEIMM:
+        nframe(w, x, op == VM_STRWORDIMM, 1);
+        break;
+    case VM_LDAWORDIDX:
+    case VM_LDABYTEIDX:
+    case VM_STAWORDIDX:
+    case VM_STABYTEIDX:
+    case VM_LDRWORDIDX:
+    case VM_LDRBYTEIDX:
+    case VM_STRWORDIDX:
+    case VM_STRBYTEIDX:
+    case VM_LDPWORDIDX:
+    case VM_LDPBYTEIDX:
+    case VM_STPWORDIDX:
+    case VM_STPBYTEIDX:
+        /* Even opcodes are loads of index in X, odd are stores, index in Y */
+        i = (op - VM_LDAWORDIDX) & 0x03;
+        nslottozp((i & 0x02 ? y : x), NT0);
+        if (!(i & 0x01)) {
+            n2(N_ASL_ZP, NT0);
+            n2(N_ROL_ZP, NT0 + 1);
+        }
+        if (op <= VM_STABYTEIDX) {
+            naddimm(NT0, w);
+        } else if (op <= VM_STRBYTEIDX) {
+            naddimm(NT0, w);
+            naddzp(NT0, NFP1);
+        } else {
+            nframeptr(NT1, w);
+            n2(N_LDY_IMM, 0);
+            n1(N_CLC);
+            n2(N_LDA_INDY, NT1);
+            n2(N_ADC_ZP, NT0);
+            n2(N_STA_ZP, NT0);
+            n1(N_INY);
+            n2(N_LDA_INDY, NT1);
+            n2(N_ADC_ZP, NT0 + 1);
+            n2(N_STA_ZP, NT0 + 1);
+        }
+        if (i & 0x02) {
+            nstind(NT0, x, !(i & 0x01));
+        } else {
+            nldind(NT0, x, !(i & 0x01));
+        }
+        break;
+    case VM_SWAP:
+        for (i = 0; i < 2; ++i) {
+            n2(N_LDA_ZPX, EVLO(x) + i);
+            n2(N_LDY_ZPX, EVLO(y) + i);
+            n2(N_STA_ZPX, EVLO(y) + i);
+            n2(N_STY_ZPX, EVLO(x) + i);
+        }
+        break;
+    case VM_DUP:
+    case VM_OVER:
+        nslottozp((op == VM_DUP ? x : y), NT0);
+        nzptoslot(NT0, d);
+        break;
+    case VM_DUP2:
+        nslottozp(y, NT0);
+        nzptoslot(NT0, d);
+        nslottozp(x, NT0);
+        nzptoslot(NT0, d + 1);
+        break;
+    case VM_POPWORD:
+        n3(N_JSR, nrt_popw);
+        n2(N_STA_ZPX, EVLO(d));
+        n2(N_STY_ZPX, EVHI(d));
+        break;
+    case VM_POPBYTE:
+        n3(N_JSR, nrt_popb);
+        n2(N_STA_ZPX, EVLO(d));
+        n2(N_LDA_IMM, 0);
+        n2(N_STA_ZPX, EVHI(d));
+        break;
+    case VM_PSHWORD:
+        n2(N_LDA_ZPX, EVLO(x));
+        n2(N_LDY_ZPX, EVHI(x));
+        n3(N_JSR, nrt_pshw);
+        break;
+    case VM_PSHBYTE:
+        n2(N_LDA_ZPX, EVLO(x));
+        n3(N_JSR, nrt_pshb);
+        break;
+    case VM_DISCARD:
+        n2(N_LDA_ZPX, EVLO(x));
+        n2(N_LDY_ZPX, EVHI(x));
+        n3(N_JSR, nrt_addsp);
+        break;
+    case VM_SPTOFP:
+        n3(N_JSR, nrt_sptofp);
+        break;
+    case VM_FPTOSP:
+        n3(N_JSR, nrt_fptosp);
+        break;
+    case VM_ATOR:
+    case VM_SUB:
+        /* Subtract NFP1 from X, or X from Y */
+        n1(N_SEC);
+        n2(N_LDA_ZPX, EVLO(op == VM_SUB ? y : x));
+        if (op == VM_SUB) {
+            n2(N_SBC_ZPX, EVLO(x));
+        } else {
+            n2(N_SBC_ZP, NFP1);
+        }
+        n2(N_STA_ZPX, EVLO(op == VM_SUB ? y : x));
+        n2(N_LDA_ZPX, EVHI(op == VM_SUB ? y : x));
+        if (op == VM_SUB) {
+            n2(N_SBC_ZPX, EVHI(x));
+        } else {
+            n2(N_SBC_ZP, NFP1 + 1);
+        }
+        n2(N_STA_ZPX, EVHI(op == VM_SUB ? y : x));
+        break;
+    case VM_RTOA:
+    case VM_ADD:
+        n1(N_CLC);
+        n2(N_LDA_ZPX, EVLO(op == VM_ADD ? y : x));
+        if (op == VM_ADD) {
+            n2(N_ADC_ZPX, EVLO(x));
+        } else {
+            n2(N_ADC_ZP, NFP1);
+        }
+        n2(N_STA_ZPX, EVLO(op == VM_ADD ? y : x));
+        n2(N_LDA_ZPX, EVHI(op == VM_ADD ? y : x));
+        if (op == VM_ADD) {
+            n2(N_ADC_ZPX, EVHI(x));
+        } else {
+            n2(N_ADC_ZP, NFP1 + 1);
+        }
+        n2(N_STA_ZPX, EVHI(op == VM_ADD ? y : x));
+        break;
+    case VM_INC:
+        n2(N_INC_ZPX, EVLO(x));
+        l = nfwd(N_BNE);
+        n2(N_INC_ZPX, EVHI(x));
+        nland(l);
+        break;
+    case VM_DEC:
+        n2(N_LDA_ZPX, EVLO(x));
+        l = nfwd(N_BNE);
+        n2(N_DEC_ZPX, EVHI(x));
+        nland(l);
+        n2(N_DEC_ZPX, EVLO(x));
+        break;
+    case VM_MUL:
+        nbinrt(d, nrt_mul);
+        break;
+    case VM_DIV:
+        nbinrt(d, nrt_div);
+        break;
+    case VM_MOD:
+        nbinrt(d, nrt_div);
+        nzptoslot(NT2, y);
+        break;
+    case VM_LSH:
+        nbinrt(d, nrt_lsh);
+        break;
+    case VM_RSH:
+        nbinrt(d, nrt_rsh);
+        break;
+    case VM_NEG:
+        n1(N_SEC);
+        n2(N_LDA_IMM, 0);
+        n2(N_SBC_ZPX, EVLO(x));
+        n2(N_STA_ZPX, EVLO(x));
+        n2(N_LDA_IMM, 0);
+        n2(N_SBC_ZPX, EVHI(x));
+        n2(N_STA_ZPX, EVHI(x));
+        break;
+    case VM_NOT:
+        n2(N_LDY_IMM, 0);
+        n2(N_LDA_ZPX, EVLO(x));
+        n2(N_ORA_ZPX, EVHI(x));
+        n2(N_BNE, 1);
+        n1(N_INY);
+        n2(N_STY_ZPX, EVLO(x));
+        n2(N_LDA_IMM, 0);
+        n2(N_STA_ZPX, EVHI(x));
+        break;
+    case VM_GT:
+    case VM_GTE:
+    case VM_LT:
+    case VM_LTE:
+    case VM_EQL:
+    case VM_NEQL:
+    case VM_AND:
+    case VM_OR:
+        /* Result in Y register is 0 or 1 */
+        if ((op == VM_EQL) || (op == VM_NEQL)) {
+            n2(N_LDY_IMM, (op == VM_NEQL));
+            n2(N_LDA_ZPX, EVLO(y));
+            n2(N_CMP_ZPX, EVLO(x));
+            n2(N_BNE, 7);
+            n2(N_LDA_ZPX, EVHI(y));
+            n2(N_CMP_ZPX, EVHI(x));
+            n2(N_BNE, 1);
+            n1(op == VM_EQL ? N_INY : N_DEY);
+        } else if ((op == VM_AND) || (op == VM_OR)) {
+            n2(N_LDY_IMM, (op == VM_OR));
+            n2(N_LDA_ZPX, EVLO(y));
+            n2(N_ORA_ZPX, EVHI(y));
+            n2((op == VM_AND ? N_BEQ : N_BNE), 7);
+            n2(N_LDA_ZPX, EVLO(x));
+            n2(N_ORA_ZPX, EVHI(x));
+            n2((op == VM_AND ? N_BEQ : N_BNE), 1);
+            n1(op == VM_AND ? N_INY : N_DEY);
+        } else {
+            n2(N_LDY_IMM, 0);
+            /* GT and LTE compare X with Y, GTE and LT compare Y with X */
+            ncompare(d, (op == VM_GT) || (op == VM_LTE));
+            n2(((op == VM_GTE) || (op == VM_LTE) ? N_BCC : N_BCS), 1);
+            n1(N_INY);
+        }
+        n2(N_STY_ZPX, EVLO(y));
+        n2(N_LDA_IMM, 0);
+        n2(N_STA_ZPX, EVHI(y));
+        break;
+    case VM_BITAND:
+    case VM_BITOR:
+    case VM_BITXOR:
+        for (i = 0; i < 2; ++i) {
+            n2(N_LDA_ZPX, EVLO(y) + i);
+            n2((op == VM_BITAND ? N_AND_ZPX : (op == VM_BITOR ? N_ORA_ZPX : N_EOR_ZPX)),
+               EVLO(x) + i);
+            n2(N_STA_ZPX, EVLO(y) + i);
+        }
+        break;
+    case VM_BITNOT:
+        for (i = 0; i < 2; ++i) {
+            n2(N_LDA_ZPX, EVLO(x) + i);
+            n2(N_EOR_IMM, 0xff);
+            n2(N_STA_ZPX, EVLO(x) + i);
+        }
+        break;
+    case VM_JMPIMM:
+        fixups[(*nfixups)++] = natpc + 1;
+        n3(N_JMP, w);
+        break;
+    case VM_BRNCHIMM:
+    case VM_BRZIMM:
+        n2(N_LDA_ZPX, EVLO(x));
+        n2(N_ORA_ZPX, EVHI(x));
+        n2((op == VM_BRZIMM ? N_BNE : N_BEQ), 3);
+        fixups[(*nfixups)++] = natpc + 1;
+        n3(N_JMP, w);
+        break;
+    case VM_BRGTIMM:
+    case VM_BRGTEIMM:
+    case VM_BRLTIMM:
+    case VM_BRLTEIMM:
+        /* As for VM_GT etc. but skip the jump if condition is false */
+        ncompare(d, (op == VM_BRGTIMM) || (op == VM_BRLTEIMM));
+        n2(((op == VM_BRGTEIMM) || (op == VM_BRLTEIMM) ? N_BCC : N_BCS), 3);
+        fixups[(*nfixups)++] = natpc + 1;
+        n3(N_JMP, w);
+        break;
+    case VM_BREQLIMM:
+    case VM_BRNEQLIMM:
+        n2(N_LDA_ZPX, EVLO(y));
+        n2(N_CMP_ZPX, EVLO(x));
+        n2(N_BNE, (op == VM_BREQLIMM ? 9 : 6));
+        n2(N_LDA_ZPX, EVHI(y));
+        n2(N_CMP_ZPX, EVHI(x));
+        n2((op == VM_BREQLIMM ? N_BNE : N_BEQ), 3);
+        fixups[(*nfixups)++] = natpc + 1;
+        n3(N_JMP, w);
+        break;
+    case VM_JSRIMM:
+        /* Push return address to keep the frame layout */
+        n2(N_LDA_IMM, (a + 2) & 0xff);
+        n2(N_LDY_IMM, (a + 2) >> 8);
+        n3(N_JSR, nrt_pshw);
+        if (d) {
+            n1(N_TXA);
+            n1(N_CLC);
+            n2(N_ADC_IMM, 2 * d);
+            n1(N_TAX);
+        }
+        fixups[(*nfixups)++] = natpc + 1;
+        n3(N_JSR, w);
+        if (d) {
+            n1(N_TXA);
+            n1(N_SEC);
+            n2(N_SBC_IMM, 2 * d);
+            n1(N_TAX);
+        }
+        break;
+    case VM_RTS:
+        if (x) {
+            nslottozp(x, NT0);
+            nzptoslot(NT0, 0);
+        }
+        naddimm(NSP, 2);
+        n1(N_RTS);
+        break;
+    case VM_PRDEC:
+    case VM_PRHEX:
+    case VM_PRSTR:
+        nslottozp(x, NT0);
+        n3(N_JSR, (op == VM_PRDEC ? nrt_prdec : (op == VM_PRHEX ? nrt_prhex : nrt_prstr)));
+        break;
+    case VM_PRCH:
+        n2(N_LDA_ZPX, EVLO(x));
+        n3(N_JSR, nrt_putch);
+        break;
+    case VM_PRMSG:
+        n3(N_JSR, nrt_prmsg);
+        for (l = a + 1; CBYTE(l); ++l) {
+            n1(CBYTE(l));
+        }
+        n1(0);
+        break;
+    case VM_KBDCH:
+        n3(N_JSR, nrt_getch);
+        n2(N_STA_ZPX, EVLO(d));
+        n2(N_LDA_IMM, 0);
+        n2(N_STA_ZPX, EVHI(d));
+        break;
+    case VM_KBDLN:
+        nslottozp(y, NT0);
+        nslottozp(x, NT1);
+        n3(N_JSR, nrt_getln);
+        break;
+    }
+}
+
+/*
+ * Choose the target machine from the output filename.  For the Commodore
+ * machines write a BASIC line 10 SYS to the code which follows it.
+ */
+void nstub()
+{
+    unsigned int len = strlen(filename);
+    unsigned int sys;
+    unsigned int p;
+
+    nattgt = NA2;
+    natorg = NA2START;
+    nzp = 0x60;
+    if ((len > 6) && !strcmp(filename + len - 6, "64.prg")) {
+        nattgt = NC64;
+        natorg = NC64START;
+    } else if ((len > 6) && !strcmp(filename + len - 6, "20.prg")) {
+        nattgt = NVIC20;
+        natorg = NVICSTART;
+    }
+    natpc = natorg;
+    if (nattgt == NA2) {
+        return;
+    }
+    nzp = 0x02;
+    n1((natorg + 10) & 0xff);   /* Link to end of program */
+    n1((natorg + 10) >> 8);
+    n1(10);                     /* Line number */
+    n1(0);
+    n1(0x9e);                   /* SYS token */
+    sys = natorg + 12;
+    for (p = 1000; p; p /= 10) {
+        n1('0' + (sys / p) % 10);
+    }
+    n1(0);                      /* End of line */
+    n1(0);                      /* End of program */
+    n1(0);
+}
+
+/*
+ * Write 6502 translation of compiled code to file.
+ * Call this after compilation is done, instead of writebytecode().
+ */
+void writenative()
+{
+    unsigned int len = rtPC - RTPCSTART;
+    signed char *depth = malloc(len);
+    unsigned char *flags = calloc(len, 1);
+    unsigned int *natmap = malloc(len * sizeof(unsigned int));
+    unsigned int *fixups = malloc(len * sizeof(unsigned int));
+    unsigned int nfixups = 0;
+    unsigned int a;
+    unsigned int w;
+
+    natbuf = malloc(64 * 1024);
+    a = xlateanalyse(depth, flags, len);
+    if (a) {
+        error(ERR_XLATE);
+        print(" at ");
+        printhex(a);
+        goto done;
+    }
+
+    /* Entry point jumps over the runtime library */
+    nstub();
+    a = natpc - natorg;
+    n3(N_JMP, 0);
+    if (nattgt != NA2) {
+        nzpsave = natpc;
+        for (w = 0; w < NZPLEN; ++w) {
+            n1(0);
+        }
+    }
+    nruntime();
+    natbuf[a + 1] = natpc & 0xff;
+    natbuf[a + 2] = natpc >> 8;
+
+    /* Set up machine */
+    if (nattgt != NA2) {
+        n2(N_LDX_IMM, NZPLEN - 1);
+        w = natpc;
+        n2(N_LDA_ZPX, nzp);
+        n3(N_STA_ABSX, nzpsave);
+        n1(N_DEX);
+        nback(N_BPL, w);
+        n2(N_LDA_IMM, 14);      /* Lower case character set */
+        n3(N_JSR, NCHROUT);
+    }
+    if (nattgt == NC64) {
+        /* BASIC ROM out, for the call stack */
+        n2(N_LDA_IMM, 0x36);
+        n2(N_STA_ZP, NC64PORT);
+    }
+
+    /* Set up registers and fall into the program */
+    n1(N_TSX);
+    n2(N_STX_ZP, NSAVES);
+    n2(N_LDA_IMM, RTCALLSTACKTOP & 0xff);
+    n2(N_STA_ZP, NSP);
+    n2(N_STA_ZP, NFP);
+    n2(N_LDA_IMM, RTCALLSTACKTOP >> 8);
+    n2(N_STA_ZP, NSP + 1);
+    n2(N_STA_ZP, NFP + 1);
+    n3(N_JSR, nrt_setfp1);
+    n2(N_LDX_IMM, 0);
+
+    for (a = 0; a < len; a += xlatelen(a + RTPCSTART)) {
+        natmap[a] = natpc;
+        w = a + xlatelen(a + RTPCSTART);
+        if ((depth[a] >= 0) && (CBYTE(a + RTPCSTART) == VM_LDIMM) && (w < len) &&
+            (CBYTE(w + RTPCSTART) == VM_DISCARD) && !(flags[w] & XLATE_LBL)) {
+            /* Constant DISCARD, used to drop args after each call */
+            w = CWORD(a + RTPCSTART + 1);
+            n2(N_LDA_IMM, w & 0xff);
+            n2(N_LDY_IMM, w >> 8);
+            n3(N_JSR, nrt_addsp);
+            a += 3;
+            natmap[a] = natpc;
+        } else if ((depth[a] >= 0) && (CBYTE(a + RTPCSTART) >= VM_FILE) &&
+                   (CBYTE(a + RTPCSTART) <= VM_HASH)) {
+            /* No library functions in the 6502 runtime */
+            error(ERR_XLATE);
+            print(" at ");
+            printhex(a + RTPCSTART);
+            goto done;
+        } else if (depth[a] >= 0) {
+            ninsn(a + RTPCSTART, depth[a], fixups, &nfixups);
+        }
+        /* Longest translation of one instruction is well under 256 bytes */
+        if (natpc > (nattgt == NVIC20 ? NVICLIM : RTCALLSTACKLIM) - 256) {
+            error(ERR_XLATE);
+            goto done;
+        }
+    }
+    n3(N_JMP, nrt_exit);
+
+    /* Fix up jumps with native addresses */
+    for (a = 0; a < nfixups; ++a) {
+        w = natbuf[fixups[a] - natorg] | (natbuf[fixups[a] - natorg + 1] << 8);
+        w = natmap[w - RTPCSTART];
+        natbuf[fixups[a] - natorg] = w & 0xff;
+        natbuf[fixups[a] - natorg + 1] = w >> 8;
+    }
+
+    strcpy(readbuf, filename);
+    printchar('\n');
+    if (openfile(1)) {
+        goto done;
+    }
+    print("...\n");
+    fputc(natorg & 0xff, fd);
+    fputc(natorg >> 8, fd);
+    fwrite(natbuf, 1, natpc - natorg, fd);
+    fclose(fd);
+    print("Native code ");
+    printdec(natpc - natorg);
+    print(" bytes\n");
+
+  done:
+    free(natbuf);
+    free(depth);
+    free(flags);
+    free(natmap);
+    free(fixups);
+}
+
 #endif
 
 #ifdef A2E
@@ -5372,15 +10025,649 @@ void list(unsigned int startline, unsigned int endline)
     push_operator_stack(SENTINEL);
 
 
+#ifdef EBLIB
+
+/*
+ * Library interface (see eightball.h.)
+ *
+ * The interpreter keeps its state in globals, which is what suits the
+ * 6502 best.  A context holds the part of that state which belongs to a
+ * program - its text, heap 1 and the variables in it.  eb_use() saves
+ * this state from the globals to the context which was in use, and
+ * loads it from the next.  The rest of the globals only live for the
+ * length of a call, and ebstart() resets them.  Since heap 1 is pointed
+ * to by heap1, switching contexts does not copy it.
+ */
+/* Pointers are kept in ints, so build with -m32 (see eightball.h) */
+typedef char ebneedsm32[(sizeof(void *) == sizeof(int)) ? 1 : -1];
+
+struct ebctx {
+    unsigned char heap1[HEAP1SZ];       /* Variables, and compiled code */
+    unsigned char *heap1Ptr;
+    struct lineofcode *program;
+    var_t *varsbegin;
+    var_t *varsend;
+    var_t *varslocal;
+    int printfd;
+};
+
+ebctx_t *active = NULL;         /* Context whose state is in the globals */
+
+/*
+ * Make ctx the active context.
+ */
+void eb_use(ebctx_t *ctx)
+{
+    if (active == ctx) {
+        return;
+    }
+    if (active) {
+        active->heap1Ptr = heap1Ptr;
+        active->program = program;
+        active->varsbegin = varsbegin;
+        active->varsend = varsend;
+        active->varslocal = varslocal;
+        active->printfd = printfd;
+    }
+    active = ctx;
+    if (ctx) {
+        heap1 = ctx->heap1;
+        heap1Ptr = ctx->heap1Ptr;
+        program = ctx->program;
+        varsbegin = ctx->varsbegin;
+        varsend = ctx->varsend;
+        varslocal = ctx->varslocal;
+        printfd = ctx->printfd;
+    }
+}
+
+/*
+ * Make ctx the active context and reset the state left by the last call.
+ */
+void ebstart(ebctx_t *ctx)
+{
+    eb_use(ctx);
+    clearexprstacks();
+    returnSP = RETSTACKSZ - 1;
+    skipFlag = 0;
+    compile = 0;
+    compilingsub = 0;
+    stepbudget = 0;
+    current = NULL;
+}
+
+ebctx_t *eb_new()
+{
+    ebctx_t *ctx = malloc(sizeof(ebctx_t));
+
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->heap1Ptr = ctx->heap1 + HEAP1SZ - 1;
+    ctx->program = NULL;
+    ctx->varsbegin = NULL;
+    ctx->varsend = NULL;
+    ctx->varslocal = NULL;
+    ctx->printfd = 1;
+    return ctx;
+}
+
+void eb_free(ebctx_t *ctx)
+{
+    eb_use(ctx);
+    new();
+    CLEARHEAP2TOP();
+    active = NULL;
+    free(ctx);
+}
+
+void eb_output(ebctx_t *ctx, int fd)
+{
+    ctx->printfd = fd;
+    if (active == ctx) {
+        printfd = fd;
+    }
+}
+
+int eb_load(ebctx_t *ctx, const char *source)
+{
+    size_t len;
+
+    ebstart(ctx);
+    if (setjmp(jumpbuf)) {
+        return EB_ERROR;
+    }
+    clearvars();
+    new();
+    while (*source) {
+        len = strcspn(source, "\n");
+        if (len >= sizeof(lnbuf)) {
+            error(ERR_TOOLONG);
+            return EB_ERROR;
+        }
+        memcpy(lnbuf, source, len);
+        lnbuf[len] = '\0';
+        if (len && (lnbuf[len - 1] == '\r')) {
+            lnbuf[len - 1] = '\0';
+        }
+        if (!program) {
+            insertfirstline(lnbuf);
+            findline(1);
+        } else {
+            appendline(lnbuf);
+        }
+        source += len;
+        if (*source) {
+            ++source;
+        }
+    }
+    current = NULL;
+    return EB_OK;
+}
+
+int eb_run(ebctx_t *ctx, unsigned long steps)
+{
+    unsigned char status;
+
+    ebstart(ctx);
+    stepbudget = (steps != 0);
+    stepsleft = steps;
+    switch (setjmp(jumpbuf)) {
+    case 0:
+        status = run(0);
+        break;
+    case 2:
+        /* quit */
+        status = 0;
+        break;
+    default:
+        status = 2;
+    }
+    stepbudget = 0;
+    flushout();
+    switch (status) {
+    case 0:
+    case 1:
+        return EB_OK;
+    case 3:
+        return EB_STEPS;
+    }
+    return EB_ERROR;
+}
+
+int eb_compile(ebctx_t *ctx, unsigned char **image, unsigned int *len)
+{
+    unsigned char failed;
+
+    ebstart(ctx);
+    memout = 1;
+    memimage = NULL;
+    strcpy(readbuf, "bytecode");
+    if (setjmp(jumpbuf) == 0) {
+        failed = compileprogram();
+    } else {
+        failed = 1;
+        compile = 0;
+        compilingsub = 0;
+        CLEARHEAP2TOP();
+    }
+    memout = 0;
+    flushout();
+    if (failed || !memimage) {
+        free(memimage);
+        return EB_ERROR;
+    }
+    *image = (unsigned char *) memimage;
+    *len = memimagelen;
+    return EB_OK;
+}
+
+int eb_getvar(ebctx_t *ctx, const char *name, int *val)
+{
+    unsigned char local = 0;
+    var_t *v;
+
+    ebstart(ctx);
+    if (setjmp(jumpbuf)) {
+        return EB_ERROR;
+    }
+    v = findintvar((char *) name, &local);
+    if (!v || (v->type & 0x10)) {
+        return EB_ERROR;
+    }
+    if ((v->type & 0x0f) == TYPE_BYTE) {
+        *val = *getptrtoscalarbyte(v);
+    } else {
+        *val = *getptrtoscalarword(v);
+    }
+    return EB_OK;
+}
+
+#else
+
+#ifdef SUBTHREADS
+/*
+ * Queue a job to compile the sub on the current line and skip to the line
+ * with its endsub, where the main program carries on.  Returns 1 if the
+ * job was queued, or 0 if the sub has to be compiled here, which is when
+ * its endsub is not on a line by itself.
+ */
+unsigned char queuesub()
+{
+    struct lineofcode *l;
+    struct subjob *job;
+    char *p;
+    int n = 0;
+
+    if (strstr(current->line, "endsub")) {
+        return 0;
+    }
+    for (l = current->next; l; l = l->next) {
+        ++n;
+        p = l->line;
+        while (*p == ' ') {
+            ++p;
+        }
+        if (!strncmp(p, "endsub", 6)) {
+            p += 6;
+            while (*p == ' ') {
+                ++p;
+            }
+            if (!*p) {
+                break;
+            }
+        }
+        if (!strncmp(p, "sub ", 4) || strstr(p, "endsub")) {
+            return 0;
+        }
+    }
+    if (!l) {
+        return 0;
+    }
+
+    job = malloc(sizeof(struct subjob));
+    if (!job) {
+        return 0;
+    }
+    job->vars = malloc(HEAP1SZ - (heap1Ptr - heap1));
+    if (!job->vars) {
+        free(job);
+        return 0;
+    }
+    job->first = current;
+    job->last = l;
+    job->counter = counter;
+    job->rtsp = rtSP;
+    job->calllevel = calllevel;
+    job->heap1 = heap1;
+    job->varsoff = heap1Ptr - heap1;
+    memcpy(job->vars, heap1Ptr, HEAP1SZ - job->varsoff);
+    job->varsbegin = varsbegin;
+    job->varsend = varsend;
+    job->varslocal = varslocal;
+    job->code = NULL;
+    job->len = 0;
+    job->subs = job->calls = NULL;
+    job->heap2 = NULL;
+    job->errors = 0;
+    job->next = NULL;
+    if (subjobsend) {
+        subjobsend->next = job;
+    }
+    subjobsend = job;
+    if (!subjobs) {
+        subjobs = job;
+    }
+
+    current = l;
+    counter += n;
+    txtPtr = l->line + strlen(l->line);
+    return 1;
+}
+
+/*
+ * Worker thread: compile the sub of job in this thread's heap 1, starting
+ * from the variable table as it was when the job was queued.
+ */
+void compilesub(struct subjob *job)
+{
+    int delta = heap1 - job->heap1;
+    unsigned char status;
+    var_t *v;
+
+    compile = 1;
+    errors = 0;
+    clearexprstacks();
+    returnSP = RETSTACKSZ - 1;
+    skipFlag = 0;
+    calllevel = job->calllevel;
+    loopopt = 0;
+    nlooptmps = 0;
+    subsbegin = subsend = NULL;
+    callsbegin = callsend = NULL;
+    memset(subhash, 0, sizeof(subhash));
+    CLEARRTCALLSTACK();
+    rtSP = job->rtsp;
+    rtFP = rtSP;
+
+    /* Move the variable table into this heap 1 */
+    heap1Ptr = heap1 + job->varsoff;
+    memcpy(heap1Ptr, job->vars, HEAP1SZ - job->varsoff);
+    varsbegin = varsend = varslocal = NULL;
+    if (job->varsbegin) {
+        varsbegin = (var_t *) ((char *) job->varsbegin + delta);
+        varsend = (var_t *) ((char *) job->varsend + delta);
+        if (job->varslocal) {
+            varslocal = (var_t *) ((char *) job->varslocal + delta);
+        }
+        for (v = varsbegin; v; v = v->next) {
+            if (v->next) {
+                v->next = (var_t *) ((char *) v->next + delta);
+            }
+            /* Call frame markers point to the previous entry */
+            if ((v->name[0] == '-') && *getptrtoscalarword(v)) {
+                *getptrtoscalarword(v) += delta;
+            }
+        }
+    }
+
+    current = job->first;
+    counter = job->counter;
+    if (setjmp(jumpbuf) == 0) {
+        for (;;) {
+            txtPtr = current->line;
+            status = parseline();
+            if (status || (current == job->last)) {
+                break;
+            }
+            current = current->next;
+            ++counter;
+        }
+        if (status < 2) {
+            job->len = rtPC - RTPCSTART;
+            job->code = malloc(job->len);
+            if (job->code) {
+                memcpy(job->code, CODESTART, job->len);
+            } else {
+                diag("no mem");
+                ++errors;
+            }
+        } else if (!errors) {
+            /* Not every syntax error is reported using error() */
+            diag("syntax");
+            ++errors;
+        }
+    } else if (!errors) {
+        diag("bad expr");
+        ++errors;
+    }
+
+    job->errors = errors;
+    job->subs = subsbegin;
+    job->calls = callsbegin;
+    job->heap2 = heap2top;
+    heap2top = NULL;
+    compile = 0;
+    compilingsub = 0;
+}
+
+/*
+ * Worker thread: compile queued subs until there are none left.
+ */
+void *subworker(void *arg)
+{
+    struct subjob *job;
+
+    (void) arg;
+    subthread = 1;
+    for (;;) {
+        pthread_mutex_lock(&subjobmutex);
+        job = subjobnext;
+        if (job) {
+            subjobnext = job->next;
+        }
+        pthread_mutex_unlock(&subjobmutex);
+        if (!job) {
+            return NULL;
+        }
+        compilesub(job);
+    }
+}
+
+/*
+ * Compile the queued subs on compjobs worker threads.  Then append the
+ * code of each to the program in turn, relocating the addresses in it
+ * apart from the calls, which linksubs() will fill in, and add its entry
+ * points and calls to the tables.  Sets compile to 0 if there were errors.
+ * Frees the jobs, which is all there is to do if compile is 0 already.
+ */
+void compilesubs()
+{
+    pthread_t *threads = NULL;
+    struct subjob *job;
+    struct heap2blk *b;
+    sub_t *s;
+    unsigned int a;
+    unsigned int delta;
+    int nthreads = 0;
+    int i;
+
+    if (compile && subjobs) {
+        threads = malloc(compjobs * sizeof(pthread_t));
+        subjobnext = subjobs;
+        for (i = 0; threads && (i < compjobs); ++i) {
+            if (!pthread_create(&threads[nthreads], NULL, subworker, NULL)) {
+                ++nthreads;
+            }
+        }
+        if (!nthreads) {
+            diag("no threads");
+            ++errors;
+            compile = 0;
+        }
+        for (i = 0; i < nthreads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+
+    while (subjobs) {
+        job = subjobs;
+        subjobs = job->next;
+
+        /* The entries in the tables are freed with the rest of heap 2 */
+        if (job->heap2) {
+            for (b = job->heap2; b->next; b = b->next) {
+            }
+            b->next = heap2top;
+            heap2top = job->heap2;
+        }
+        if (job->errors) {
+            errors += job->errors;
+            compile = 0;
+        }
+        if (compile && (codeptr + job->len > heap1Ptr)) {
+            diag("no mem");
+            ++errors;
+            compile = 0;
+        }
+
+        if (compile) {
+            delta = rtPC - RTPCSTART;
+            memcpy(codeptr, job->code, job->len);
+            codeptr += job->len;
+            a = rtPC;
+            rtPC += job->len;
+            s = job->calls;
+            for (; a < rtPC; a += codelen(a)) {
+                if (s && (s->addr + delta == a + 1)) {
+                    s = s->next;
+                } else if (hasaddr(getcodebyte(a))) {
+                    emit_fixup(a + 1, getcodeword(a + 1) + delta);
+                }
+            }
+
+            for (s = job->subs; s; s = s->next) {
+                s->addr += delta;
+                i = subhashfn(s->name);
+                s->hnext = subhash[i];
+                subhash[i] = s;
+            }
+            if (job->subs) {
+                if (subsend) {
+                    subsend->next = job->subs;
+                } else {
+                    subsbegin = job->subs;
+                }
+                for (subsend = job->subs; subsend->next; subsend = subsend->next) {
+                }
+            }
+
+            for (s = job->calls; s; s = s->next) {
+                s->addr += delta;
+            }
+            if (job->calls) {
+                if (callsend) {
+                    callsend->next = job->calls;
+                } else {
+                    callsbegin = job->calls;
+                }
+                for (callsend = job->calls; callsend->next; callsend = callsend->next) {
+                }
+            }
+        }
+
+        free(job->code);
+        free(job->vars);
+        free(job);
+    }
+    subjobsend = NULL;
+}
+#endif
+
+#ifdef __GNUC__
+
+/*
+ * Batch compiler (Linux only.)
+ *
+ *   eightball [-j n] -c in.8b [-o out] [-c in2.8b [-o out2] ...]
+ *
+ * Each source file is loaded and compiled in turn, without the banner or
+ * progress messages.  The output file defaults to the name of the source
+ * file with .8b replaced by .bin, and the kind of file written depends on
+ * its name, just as for 'comp'.  Errors are reported on stderr as
+ * file:line: message, and the output file is removed.
+ *
+ * With -j, the subs of each program are compiled on n threads at the same
+ * time (see compilesubs().)
+ */
+
+/*
+ * Compile the source file in to out.
+ * Returns 0 if OK, 1 if there were errors.
+ */
+unsigned char batchjob(char *in, char *out)
+{
+    static unsigned int olderrors;  /* Static as longjmp() may return here */
+
+    batchfile = in;
+    if ((strlen(in) >= sizeof(readbuf)) || (strlen(out) > FILENAMELEN)) {
+        diag("name too long");
+        return 1;
+    }
+    olderrors = errors;
+    if (setjmp(jumpbuf) == 0) {
+        clearexprstacks();
+        returnSP = RETSTACKSZ - 1;
+        skipFlag = 0;
+        current = NULL;
+        strcpy(readbuf, in);
+        if (readfile()) {
+            return 1;
+        }
+        strcpy(readbuf, out);
+        if (!compileprogram()) {
+            return 0;
+        }
+    }
+    /* Compile failed, or gave up with longjmp() */
+    if (errors == olderrors) {
+        diag("bad expr");
+    }
+    compile = 0;
+    compilingsub = 0;
+    remove(out);
+    return 1;
+}
+
+/*
+ * Returns the exit status: 0 if all compiled OK, 1 if any failed, 2 for
+ * bad usage.
+ */
+int batch(int argc, char *argv[])
+{
+    char **ins = malloc(argc * sizeof(char *));
+    char **outs = malloc(argc * sizeof(char *));
+    int n = 0;
+    int njobs = 1;
+    int failed = 0;
+    int i;
+    int len;
+
+    if (!ins || !outs) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 2;
+    }
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-j") && (i + 1 < argc)) {
+            njobs = atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "-c") || (i + 1 == argc)) {
+            fprintf(stderr, "usage: %s [-j n] -c in.8b [-o out] ...\n", argv[0]);
+            return 2;
+        }
+        ins[n] = argv[++i];
+        if ((i + 2 < argc) && !strcmp(argv[i + 1], "-o")) {
+            outs[n] = argv[i + 2];
+            i += 2;
+        } else {
+            len = strlen(ins[n]);
+            if ((len > 3) && !strcmp(ins[n] + len - 3, ".8b")) {
+                len -= 3;
+            }
+            outs[n] = malloc(len + 5);
+            if (!outs[n]) {
+                fprintf(stderr, "%s: out of memory\n", argv[0]);
+                return 2;
+            }
+            sprintf(outs[n], "%.*s.bin", len, ins[n]);
+        }
+        ++n;
+    }
+    if (njobs < 1) {
+        njobs = 1;
+    }
+
+    printfd = -1;
+    compjobs = njobs;
+    for (i = 0; i < n; ++i) {
+        failed |= batchjob(ins[i], outs[i]);
+    }
+    batchfile = NULL;
+    return failed;
+}
+
+#endif
+
 /*
  * Entry point.
  */
 #ifdef __GNUC__
-int
+int main(int argc, char *argv[])
 #else
-void
+void main()
 #endif
-main()
 {
 
 #ifdef EXTMEM
@@ -5414,6 +10701,13 @@ main()
     program = NULL;
     current = NULL;
 
+#ifdef __GNUC__
+    if (argc > 1) {
+        CLEARHEAP1();
+        return batch(argc, argv);
+    }
+#endif
+
 #ifdef A2E
     videomode(VIDEOMODE_80COL);
     revers(1);
@@ -5477,7 +10771,14 @@ main()
         }
 
         compile = 0;
+#ifdef __GNUC__
+        if (getln(lnbuf, 255)) {
+            /* End of input */
+            EXIT(0);
+        }
+#else
         getln(lnbuf, 255);
+#endif
 
         switch (editmode) {
         case 0:                /* Not editing - immediate mode execute */
@@ -5521,3 +10822,5 @@ main()
         }
     }
 }
+
+#endif
@@ -0,0 +1,105 @@
+/**************************************************************************/
+/* EightBall                                                              */
+/*                                                                        */
+/* The Eight Bit Algorithmic Language                                     */
+/*                                                                        */
+/* Library interface for embedding EightBall in another program (Linux    */
+/* only.)  Build eightball.c with -DEBLIB, or link with the library made  */
+/* by 'make bin/libeightball.a'.                                          */
+/*                                                                        */
+/* Copyright Bobbi Webber-Manners 2018                                    */
+/*                                                                        */
+/**************************************************************************/
+
+/**************************************************************************/
+/*  GNU PUBLIC LICENCE v3 OR LATER                                        */
+/*                                                                        */
+/*  This program is free software: you can redistribute it and/or modify  */
+/*  it under the terms of the GNU General Public License as published by  */
+/*  the Free Software Foundation, either version 3 of the License, or     */
+/*  (at your option) any later version.                                   */
+/*                                                                        */
+/*  This program is distributed in the hope that it will be useful,       */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*  GNU General Public License for more details.                          */
+/*                                                                        */
+/*  You should have received a copy of the GNU General Public License     */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                        */
+/**************************************************************************/
+
+/*
+ * A context holds a program and its variables, but it is not independent
+ * of the rest of the interpreter.  The interpreter keeps its state in
+ * globals, and a context is only somewhere to save the part of that state
+ * which belongs to a program.  Only one context is active at a time: each
+ * call makes the context passed to it the active one, saving the globals
+ * to the context which was active before and loading them from the new
+ * one.  So a program can be loaded into each of several contexts and they
+ * can be run in turn, but one cannot run while another is running, and
+ * only one thread in the process may be calling into the library at a
+ * time.
+ *
+ * The library must be built, and the program using it compiled, with
+ * gcc -m32, as the interpreter keeps pointers in ints.
+ *
+ *   ebctx_t *ctx = eb_new();
+ *   eb_load(ctx, "word n = 0\nwhile n < 10\n n = n + 1\nendwhile\nend\n");
+ *   if (eb_run(ctx, 1000) == EB_OK) {
+ *       eb_getvar(ctx, "n", &n);
+ *   }
+ *   eb_free(ctx);
+ */
+
+/*
+ * Return values
+ */
+#define EB_OK     0             /* Success                              */
+#define EB_ERROR  1             /* Error in the program, or no memory   */
+#define EB_STEPS  2             /* eb_run() used up its step budget     */
+
+typedef struct ebctx ebctx_t;
+
+/*
+ * Create a new context, with an empty program.  Output from the program
+ * goes to stdout.  Returns NULL if there is no memory.
+ */
+ebctx_t *eb_new(void);
+
+/*
+ * Free a context and its program.
+ */
+void eb_free(ebctx_t *ctx);
+
+/*
+ * Send output from PRINT and error messages to file descriptor fd, or
+ * discard it if fd is -1.
+ */
+void eb_output(ebctx_t *ctx, int fd);
+
+/*
+ * Replace the program with the newline separated lines in source.
+ * This also clears the variables.
+ */
+int eb_load(ebctx_t *ctx, const char *source);
+
+/*
+ * Run the program from the start.  If steps is not 0, give up with
+ * EB_STEPS after that many statements.  quit ends the program with EB_OK,
+ * and internal errors return EB_ERROR, rather than exiting the caller.  The variables are kept after the
+ * program stops, so they can be read with eb_getvar().
+ */
+int eb_run(ebctx_t *ctx, unsigned long steps);
+
+/*
+ * Compile the program to bytecode, in the format described in
+ * eightballvm.h.  On success *image points to the bytecode, which the
+ * caller must free(), and *len is its length.
+ */
+int eb_compile(ebctx_t *ctx, unsigned char **image, unsigned int *len);
+
+/*
+ * Read the global scalar variable name into *val.
+ */
+int eb_getvar(ebctx_t *ctx, const char *name, int *val);
@@ -38,6 +38,7 @@
 /**************************************************************************/
 
 #include "eightballutils.h"
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -48,6 +49,110 @@
 #include <conio.h>
 #endif
 
+#ifdef __GNUC__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __GNUC__
+/*
+ * File descriptor written by print() and printchar().  Set to -1 to
+ * discard the output.
+ */
+int printfd = 1;
+
+/*
+ * Output is collected in outbuf and written out when it is full, at the
+ * end of each line if it is going to a terminal, before reading from the
+ * keyboard and at exit.
+ */
+#define OUTBUFSZ 4096
+char outbuf[OUTBUFSZ];
+unsigned int outlen = 0;	/* Number of bytes in outbuf          */
+int outfd = -1;			/* File descriptor outbuf is for      */
+char outtty;			/* 1 if outfd is a terminal           */
+
+/*
+ * Write the contents of outbuf.
+ */
+void flushout(void) {
+	char *p = outbuf;
+	int n;
+
+	while (outlen) {
+		n = write(outfd, p, outlen);
+		if (n <= 0) {
+			break;
+		}
+		p += n;
+		outlen -= n;
+	}
+	outlen = 0;
+}
+
+/*
+ * Called when printfd has changed, to start buffering for the new one.
+ */
+void setoutfd(void) {
+	if (outfd == -1) {
+		atexit(flushout);
+	}
+	flushout();
+	outfd = printfd;
+	outtty = isatty(outfd);
+}
+
+/*
+ * Print a string.
+ */
+void print(char *str) {
+	unsigned int len;
+	unsigned int n;
+	char nl;
+
+	if (printfd < 0) {
+		return;
+	}
+	if (printfd != outfd) {
+		setoutfd();
+	}
+	len = strlen(str);
+	nl = (outtty && memchr(str, '\n', len));
+	while (len) {
+		n = OUTBUFSZ - outlen;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(outbuf + outlen, str, n);
+		outlen += n;
+		str += n;
+		len -= n;
+		if (outlen == OUTBUFSZ) {
+			flushout();
+		}
+	}
+	if (nl) {
+		flushout();
+	}
+}
+
+/*
+ * Print a character.
+ */
+void printchar(char c) {
+	if (printfd < 0) {
+		return;
+	}
+	if (printfd != outfd) {
+		setoutfd();
+	}
+	outbuf[outlen++] = c;
+	if ((outlen == OUTBUFSZ) || (outtty && (c == '\n'))) {
+		flushout();
+	}
+}
+#else
 /*
  * This does the same thing as fputs(str, 1), but uses marginally less
  * memory.
@@ -62,30 +167,24 @@ void print(char *str) {
 void printchar(char c) {
 	write(1, &c, 1);
 }
+#endif
 
 /*
- * Print a 16 bit integer value as an unsigned decimal
+ * Print an integer value as an unsigned decimal.
+ * The digits are generated least significant first, into a buffer which
+ * is printed in one go.
  */
 void printdec(unsigned int val) {
 
-	unsigned char digit;
-	unsigned int denom = 10000;
-	unsigned char doprint = 0;
+	char buf[3 * sizeof(unsigned int) + 1];
+	char *p = buf + sizeof(buf) - 1;
 
+	*p = '\0';
 	do {
-		digit = val / denom;
-		if (digit) {
-			doprint = 1;
-		}
-		if (doprint) {
-			printchar(digit + '0');
-		}
-		val = val % denom;
-		denom = denom / 10;
-	} while (denom);
-	if (!doprint) {
-		printchar('0');
-	}
+		*--p = (val % 10) + '0';
+		val /= 10;
+	} while (val);
+	print(p);
 }
 
 /*
@@ -125,15 +224,137 @@ void printhexbyte(unsigned char val) {
 #define KEY_LEFTARROW 8
 #endif
 
+#ifdef __GNUC__
+/*
+ * Input is read from stdin in blocks into inbuf, and lines are handed out
+ * from there by readln().  On a terminal each read() returns one line, so
+ * this makes no difference, but with a file or pipe a whole block of
+ * lines is read at once.
+ */
+#define INBUFSZ 4096
+char inbuf[INBUFSZ];
+unsigned int inpos = 0;		/* Position of next byte in inbuf     */
+unsigned int inlen = 0;		/* Number of bytes in inbuf           */
+char ineof = 0;			/* 1 once read() has hit end of file  */
+
+/*
+ * Read more input into inbuf, after moving what is left to the start.
+ * Returns 0 if there is no more input.
+ */
+unsigned char fillin(void) {
+	int n;
+
+	if (ineof) {
+		return 0;
+	}
+	flushout();
+	inlen -= inpos;
+	memmove(inbuf, inbuf + inpos, inlen);
+	inpos = 0;
+	n = read(0, inbuf + inlen, INBUFSZ - inlen);
+	if (n <= 0) {
+		ineof = 1;
+		return 0;
+	}
+	inlen += n;
+	return 1;
+}
+
+/*
+ * Read the next line of input, or as much of it as fits in max bytes (the
+ * rest is returned by the next call.)  Returns a pointer to the text in
+ * the input buffer, which is valid until the next read, and sets *len to
+ * its length, not including the newline.  Returns NULL at end of file.
+ */
+char *readln(unsigned int max, unsigned int *len) {
+	char *p;
+	char *nl;
+	unsigned int n;
+
+	if (max > INBUFSZ - 1) {
+		max = INBUFSZ - 1;
+	}
+	for (;;) {
+		p = inbuf + inpos;
+		n = inlen - inpos;
+		nl = memchr(p, '\n', (n > max ? max + 1 : n));
+		if (nl) {
+			*len = nl - p;
+			inpos += *len + 1;
+			return p;
+		}
+		if (n > max) {
+			/* Too long, split it */
+			*len = max;
+			inpos += max;
+			return p;
+		}
+		if (!fillin()) {
+			/* Last line may not end with a newline */
+			if (inpos == inlen) {
+				return NULL;
+			}
+			p = inbuf + inpos;
+			*len = inlen - inpos;
+			inpos = inlen;
+			return p;
+		}
+	}
+}
+
+/*
+ * Read a line from stdin into str, which is buflen bytes long.  A line
+ * which is too long is split, unless there is no room for anything but
+ * the terminator, in which case the line is discarded.
+ * Returns 1 at end of file (str is empty), 0 otherwise.
+ */
+unsigned char getln(char *str, unsigned int buflen) {
+    unsigned int len;
+    char *p;
+
+    if (buflen <= 1) {
+        *str = '\0';
+        if ((inpos == inlen) && !fillin()) {
+            return 1;
+        }
+        do {
+            if ((inpos == inlen) && !fillin()) {
+                break;
+            }
+        } while (inbuf[inpos++] != '\n');
+        return 0;
+    }
+    p = readln(buflen - 1, &len);
+    if (!p) {
+        *str = '\0';
+        return 1;
+    }
+    memcpy(str, p, len);
+    str[len] = '\0';
+    return 0;
+}
+
+/*
+ * Read a character from stdin, waiting if there is none.
+ * Returns 4 (^D) at end of file.
+ */
+char getkey(void) {
+    if ((inpos == inlen) && !fillin()) {
+        return 4;
+    }
+    return inbuf[inpos++];
+}
+#else
 /*
  * This is lighter than gets() and also safe!
  * Will read up to buflen bytes from STDIN
+ * Returns 0 (there is no end of file on the keyboard.)
  * Has some ugly special case code for Apple II.
  */
-void getln(char *str, unsigned char buflen)
+unsigned char getln(char *str, unsigned int buflen)
 {
     unsigned char i;
-    unsigned char j = 0;
+    unsigned int j = 0;
 #ifdef A2E
     unsigned char key;
 #endif
@@ -153,9 +374,16 @@ void getln(char *str, unsigned char buflen)
         ++j;
 #endif
     } while ((i) && (j < buflen) && *(str + j - 1) != '\n');
+    if ((buflen <= 1) && (i) && (*str != '\n')) {
+        /* No room for the line, so discard it */
+        while ((read(0, str, 1) == 1) && (*str != '\n'));
+    }
     str[j - 1] = '\0';
+    return 0;
 }
 
+#endif
+
 #ifdef A2E
 /*
  * This is for Apple II only.  Obtain keypress.
@@ -196,3 +424,654 @@ unsigned char checkInterrupted(void)
     return 0;
 }
 
+#ifdef __GNUC__
+/*
+ * Runtime for the file, memory block, string, array, sort, hash table and
+ * heap statements.  These are only supported on Linux, as they would not
+ * fit in the 8 bit builds.
+ */
+
+/*
+ * Files opened by programs (f.open etc.)  Handles are 1 to NFILES, so that
+ * 0 can mean failure.
+ */
+#define NFILES 16
+FILE *files[NFILES];
+
+/*
+ * Modes for fileopen(): read, write, append, read and write.
+ */
+char *filemodes[] = {"rb", "wb", "ab", "r+b"};
+
+/*
+ * Returns the FILE for handle h, or NULL if it is not open.
+ */
+FILE *filehandle(unsigned int h) {
+	if ((h == 0) || (h > NFILES)) {
+		return NULL;
+	}
+	return files[h - 1];
+}
+
+/*
+ * Open the file name in mode (0 to 3, see filemodes[].)
+ * Returns the handle, or 0 on error.
+ */
+unsigned char fileopen(char *name, unsigned int mode) {
+	unsigned char h;
+
+	if (mode > 3) {
+		return 0;
+	}
+	for (h = 0; h < NFILES; ++h) {
+		if (!files[h]) {
+			files[h] = fopen(name, filemodes[mode]);
+			return (files[h] ? h + 1 : 0);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Close file handle h.
+ */
+void fileclose(unsigned int h) {
+	FILE *fp = filehandle(h);
+
+	if (fp) {
+		fclose(fp);
+		files[h - 1] = NULL;
+	}
+}
+
+/*
+ * Read up to len bytes from handle h to buf.
+ * Returns the number of bytes read, which is 0 at end of file.
+ */
+unsigned int fileread(unsigned int h, char *buf, unsigned int len) {
+	FILE *fp = filehandle(h);
+
+	return (fp ? fread(buf, 1, len, fp) : 0);
+}
+
+/*
+ * Write len bytes from buf to handle h.
+ * Returns the number of bytes written.
+ */
+unsigned int filewrite(unsigned int h, char *buf, unsigned int len) {
+	FILE *fp = filehandle(h);
+
+	return (fp ? fwrite(buf, 1, len, fp) : 0);
+}
+
+/*
+ * Move the position of handle h.  whence is 0 to set it to off, 1 to move
+ * it by off and 2 to set it to off from the end.
+ */
+void fileseek(unsigned int h, long off, unsigned int whence) {
+	FILE *fp = filehandle(h);
+
+	if (!fp) {
+		return;
+	}
+	switch (whence) {
+	case 0:
+		fseek(fp, off, SEEK_SET);
+		break;
+	case 1:
+		fseek(fp, off, SEEK_CUR);
+		break;
+	case 2:
+		fseek(fp, off, SEEK_END);
+		break;
+	}
+}
+
+/*
+ * Map the part of handle h starting at block (in units of MAPBLOCK bytes)
+ * into memory at addr, so that reading and writing the len bytes at addr
+ * reads and writes the file.  Any mapping already at addr is replaced,
+ * so calling this again with a different block slides the window along
+ * the file.  addr and len must be multiples of MAPBLOCK.  If the window
+ * runs past the end of the file the rest of it is zero, and is not
+ * written to the file.  If the file was opened read only, changes are
+ * not written to the file.
+ * Returns 1 on success, 0 on error (in which case the window is zero.)
+ */
+unsigned char filemap(unsigned int h, char *addr, unsigned int len,
+		      unsigned int block) {
+	FILE *fp = filehandle(h);
+	struct stat st;
+	off_t off = (off_t) block * MAPBLOCK;
+	size_t flen = 0;
+	int flags = MAP_SHARED | MAP_FIXED;
+	long pagesz = sysconf(_SC_PAGESIZE);
+
+	if (!fp || !len || ((unsigned long) addr % MAPBLOCK) ||
+	    (len % MAPBLOCK) || (MAPBLOCK % pagesz)) {
+		return 0;
+	}
+	fileunmap(addr, len);
+	fflush(fp);
+	if (fstat(fileno(fp), &st)) {
+		return 0;
+	}
+	if (st.st_size > off) {
+		flen = st.st_size - off;
+		flen = (flen > len ? len : (flen + pagesz - 1) / pagesz * pagesz);
+	}
+	if (!flen) {
+		/* Nothing to map, but a window past the end isn't an error */
+		return 1;
+	}
+	if ((fcntl(fileno(fp), F_GETFL) & O_ACCMODE) == O_RDONLY) {
+		flags = MAP_PRIVATE | MAP_FIXED;
+	}
+	if (mmap(addr, flen, PROT_READ | PROT_WRITE, flags, fileno(fp), off)
+	    == MAP_FAILED) {
+		fileunmap(addr, len);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Undo filemap(), leaving the len bytes at addr set to zero.
+ */
+void fileunmap(char *addr, unsigned int len) {
+	if (((unsigned long) addr % MAPBLOCK) || (len % MAPBLOCK)) {
+		return;
+	}
+	mmap(addr, len, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+}
+
+/*
+ * The array kernels below are plain loops, written for the compiler to
+ * vectorize.  The Makefile builds this file with -O2 -ftree-vectorize
+ * -msse2 for that.
+ */
+
+#define VECLOOP(OPER) \
+	if (s) { \
+		for (i = 0; i < n; ++i) { \
+			d[i] = d[i] OPER s[i]; \
+		} \
+	} else { \
+		for (i = 0; i < n; ++i) { \
+			d[i] = d[i] OPER v; \
+		} \
+	} \
+	break;
+
+#define VECOP(T) { \
+	T *d = dst; \
+	T *s = src; \
+	T v = k; \
+	switch (op) { \
+	case '+': VECLOOP(+) \
+	case '-': VECLOOP(-) \
+	case '&': VECLOOP(&) \
+	case '|': \
+	case '#': VECLOOP(|) \
+	case '!': VECLOOP(^) \
+	case '<': VECLOOP(<<) \
+	case '>': VECLOOP(>>) \
+	} \
+}
+
+/*
+ * Set dst[i] = dst[i] op src[i] for each of the n elements of dst, or
+ * dst[i] = dst[i] op k if src is NULL.  op is one of + - & | ! < >, where
+ * ! is exclusive or and < and > are shifts.  # may be used for | (as on
+ * CBM.)  dst and src may be the same array, but should not otherwise
+ * overlap.
+ */
+void vecop(char op, void *dst, void *src, int k, unsigned int n,
+	   unsigned char size) {
+	unsigned int i;
+
+	if (size == 1) {
+		VECOP(unsigned char)
+	} else if (size == 2) {
+		VECOP(unsigned short)
+	} else {
+		VECOP(int)
+	}
+}
+
+#define VECREDUCE(T) { \
+	T *s = src; \
+	switch (op) { \
+	case '+': \
+		for (i = 0; i < n; ++i) { \
+			r += s[i]; \
+		} \
+		break; \
+	case '<': \
+		r = (n ? s[0] : 0); \
+		for (i = 0; i < n; ++i) { \
+			r = (s[i] < r ? s[i] : r); \
+		} \
+		break; \
+	case '>': \
+		r = (n ? s[0] : 0); \
+		for (i = 0; i < n; ++i) { \
+			r = (s[i] > r ? s[i] : r); \
+		} \
+		break; \
+	case '#': \
+		for (i = 0; i < n; ++i) { \
+			r += (s[i] != 0); \
+		} \
+		break; \
+	} \
+}
+
+/*
+ * Reduce the n elements of src to one value.  op is + for the sum, < for
+ * the smallest element, > for the largest or # for the number which are
+ * not zero.  Elements compare as the relational operators do: bytes and
+ * 16 bit words are unsigned, 32 bit interpreter words are signed.
+ */
+int vecreduce(char op, void *src, unsigned int n, unsigned char size) {
+	unsigned int i;
+	int r = 0;
+
+	if (size == 1) {
+		VECREDUCE(unsigned char)
+	} else if (size == 2) {
+		VECREDUCE(unsigned short)
+	} else {
+		VECREDUCE(int)
+	}
+	return r;
+}
+
+/*
+ * Returns element i of the array a of size byte elements, sign extended if
+ * flags includes SORT_SIGNED.
+ */
+unsigned long vecget(void *a, unsigned int i, unsigned char size,
+		     unsigned char flags) {
+	if (size == 1) {
+		return (flags & SORT_SIGNED ?
+			(unsigned long) (long) ((signed char *) a)[i] :
+			((unsigned char *) a)[i]);
+	} else if (size == 2) {
+		return (flags & SORT_SIGNED ?
+			(unsigned long) (long) ((short *) a)[i] :
+			((unsigned short *) a)[i]);
+	}
+	return (flags & SORT_SIGNED ?
+		(unsigned long) (long) ((int *) a)[i] :
+		((unsigned int *) a)[i]);
+}
+
+/*
+ * Returns 1 if x sorts after y.
+ */
+unsigned char vecafter(unsigned long x, unsigned long y,
+		       unsigned char flags) {
+	unsigned long t;
+
+	if (flags & SORT_DESC) {
+		t = x;
+		x = y;
+		y = t;
+	}
+	return (flags & SORT_SIGNED ? (long) x > (long) y : x > y);
+}
+
+/*
+ * Swap elements i and j of the array a of size byte elements.
+ */
+void vecswap(void *a, unsigned int i, unsigned int j, unsigned char size) {
+	unsigned char *p = (unsigned char *) a + i * size;
+	unsigned char *q = (unsigned char *) a + j * size;
+	unsigned char t;
+
+	while (size--) {
+		t = *p;
+		*p++ = *q;
+		*q++ = t;
+	}
+}
+
+/*
+ * Sort the n elements of the array a in place, in ascending order unless
+ * flags includes SORT_DESC.  If other is not NULL, its elements (of osize
+ * bytes) are moved in the same way, so it can hold values or indexes to go
+ * with the keys in a.  Heapsort, which needs no extra memory or recursion
+ * but is not stable.
+ */
+void vecsort(void *a, unsigned int n, unsigned char size,
+	     unsigned char flags, void *other, unsigned char osize) {
+	unsigned int start = n / 2;
+	unsigned int end = n;
+	unsigned int root;
+	unsigned int child;
+
+	while (end > 1) {
+		if (start) {
+			--start;
+		} else {
+			--end;
+			vecswap(a, 0, end, size);
+			if (other) {
+				vecswap(other, 0, end, osize);
+			}
+		}
+		/* Sift element start down the heap */
+		root = start;
+		while ((child = 2 * root + 1) < end) {
+			if ((child + 1 < end) &&
+			    vecafter(vecget(a, child + 1, size, flags),
+				     vecget(a, child, size, flags), flags)) {
+				++child;
+			}
+			if (!vecafter(vecget(a, child, size, flags),
+				      vecget(a, root, size, flags), flags)) {
+				break;
+			}
+			vecswap(a, root, child, size);
+			if (other) {
+				vecswap(other, root, child, osize);
+			}
+			root = child;
+		}
+	}
+}
+
+/*
+ * Binary search the n elements of the array a, which must have been sorted
+ * by vecsort() with the same flags, for key (sign extended if the flags
+ * include SORT_SIGNED.)  Returns the index of the first element equal to
+ * key, or -1 if there is none.
+ */
+int vecsearch(void *a, unsigned int n, unsigned char size,
+	      unsigned char flags, unsigned long key) {
+	unsigned int lo = 0;
+	unsigned int hi = n;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vecafter(key, vecget(a, mid, size, flags), flags)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return ((lo < n) && (vecget(a, lo, size, flags) == key) ? (int) lo : -1);
+}
+
+/*
+ * Hash tables.  The words of the table are capacity, count and flags,
+ * followed by three words for each slot: state, key and value.  Open
+ * addressing with linear probing.  Deleted slots are marked, and reused by
+ * hashput(), so that searches for keys added after them carry on past.
+ */
+#define SLOT_EMPTY   0
+#define SLOT_USED    1
+#define SLOT_DELETED 2
+
+#define HASHCAP(t)      hashword(t, 0, size)
+#define HASHSTATE(t, s) hashword(t, 3 + 3 * (s), size)
+#define HASHKEY(t, s)   hashword(t, 4 + 3 * (s), size)
+#define HASHVAL(t, s)   hashword(t, 5 + 3 * (s), size)
+
+/*
+ * Returns word i of table t.
+ */
+unsigned int hashword(void *t, unsigned int i, unsigned char size) {
+	return (size == 2 ? ((unsigned short *) t)[i] : ((unsigned int *) t)[i]);
+}
+
+/*
+ * Set word i of table t to w.
+ */
+void hashsetword(void *t, unsigned int i, unsigned int w, unsigned char size) {
+	if (size == 2) {
+		((unsigned short *) t)[i] = w;
+	} else {
+		((unsigned int *) t)[i] = w;
+	}
+}
+
+/*
+ * Initialize table t with room for cap keys.
+ */
+void hashnew(void *t, unsigned int cap, unsigned char flags,
+	     unsigned char size) {
+	memset(t, 0, HASHWORDS(cap) * size);
+	hashsetword(t, 0, cap, size);
+	hashsetword(t, 2, flags, size);
+}
+
+/*
+ * Returns the slot of table t holding key and sets *found to 1.  If key is
+ * not there, sets *found to 0 and returns the slot where it should go: the
+ * first deleted slot passed, or else the empty slot where the search
+ * stopped, or the capacity if the table is full.
+ * Only the low 16 bits of word keys are hashed, so that keys which fit in
+ * a VM word are stored in the same order by the interpreter and the VM.
+ */
+unsigned int hashfind(void *t, unsigned int key, char *base,
+		      unsigned char size, unsigned char *found) {
+	unsigned int cap = HASHCAP(t);
+	unsigned int h = 0;
+	unsigned int s;
+	unsigned int avail = cap;
+	unsigned int n;
+	unsigned char strkeys = hashword(t, 2, size) & HASH_STRKEYS;
+	char *p;
+
+	*found = 0;
+	if (!cap) {
+		return 0;
+	}
+	if (strkeys) {
+		for (p = base + key; *p; ++p) {
+			h = ((h * 31) + (unsigned char) *p) & 0xffff;
+		}
+	} else {
+		h = (key * 40503u) & 0xffff;
+	}
+	s = h % cap;
+	for (n = 0; n < cap; ++n) {
+		switch (HASHSTATE(t, s)) {
+		case SLOT_EMPTY:
+			return (avail < cap ? avail : s);
+		case SLOT_DELETED:
+			if (avail == cap) {
+				avail = s;
+			}
+			break;
+		default:
+			if (strkeys ? !strcmp(base + HASHKEY(t, s), base + key) :
+			    (HASHKEY(t, s) == key)) {
+				*found = 1;
+				return s;
+			}
+		}
+		if (++s == cap) {
+			s = 0;
+		}
+	}
+	return avail;
+}
+
+/*
+ * Add key to table t with value val, or change its value if it is already
+ * there.  Returns 1 on success, 0 if the table is full.
+ */
+unsigned char hashput(void *t, unsigned int key, unsigned int val,
+		      char *base, unsigned char size) {
+	unsigned char found;
+	unsigned int s = hashfind(t, key, base, size, &found);
+
+	if (s == HASHCAP(t)) {
+		return 0;
+	}
+	if (!found) {
+		hashsetword(t, 3 + 3 * s, SLOT_USED, size);
+		hashsetword(t, 4 + 3 * s, key, size);
+		hashsetword(t, 1, hashword(t, 1, size) + 1, size);
+	}
+	hashsetword(t, 5 + 3 * s, val, size);
+	return 1;
+}
+
+/*
+ * Look up key in table t, storing its value to *val.  Returns 1 if the key
+ * was found, 0 (leaving *val alone) if not.
+ */
+unsigned char hashget(void *t, unsigned int key, unsigned int *val,
+		      char *base, unsigned char size) {
+	unsigned char found;
+	unsigned int s = hashfind(t, key, base, size, &found);
+
+	if (found) {
+		*val = HASHVAL(t, s);
+	}
+	return found;
+}
+
+/*
+ * Remove key from table t.  Returns 1 if it was there, 0 if not.
+ */
+unsigned char hashdel(void *t, unsigned int key, char *base,
+		      unsigned char size) {
+	unsigned char found;
+	unsigned int s = hashfind(t, key, base, size, &found);
+
+	if (found) {
+		hashsetword(t, 3 + 3 * s, SLOT_DELETED, size);
+		hashsetword(t, 1, hashword(t, 1, size) - 1, size);
+	}
+	return found;
+}
+
+/*
+ * Iterate over table t.  Finds the first key in slot i or after, storing
+ * it and its value to *key and *val.  Returns the slot after it, which is
+ * where to carry on from, or 0 if there are no more keys.  Start with 0.
+ */
+unsigned int hashnext(void *t, unsigned int i, unsigned int *key,
+		      unsigned int *val, unsigned char size) {
+	unsigned int cap = HASHCAP(t);
+
+	for (; i < cap; ++i) {
+		if (HASHSTATE(t, i) == SLOT_USED) {
+			*key = HASHKEY(t, i);
+			*val = HASHVAL(t, i);
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Heap.  A size class allocator small enough for the VM.  Blocks are powers
+ * of two from HEAPMINBLK to 32K bytes, each starting with a header word
+ * holding its class.  Each class has a free list, linked through the word
+ * after the header.  A request is served from the free list of its class,
+ * else by splitting the smallest larger free block in half as often as
+ * needed, else from the top of the heap.  Free blocks are never merged.
+ *
+ * The heap header is the top of the heap, the limit, then the free list
+ * heads for each class.
+ */
+#define HEAPMINBLK  8u
+#define HEAPCLASSES 13          /* 8 bytes to 32K */
+#define HEAPHDRLEN  (4 + 2 * HEAPCLASSES)
+#define HEAPUSED    0xeb00      /* Marks header of an allocated block */
+#define HEAPLIST(c) (heap + 4 + 2 * (c))
+
+/*
+ * Read the little endian word at address a.
+ */
+unsigned int heaprdw(unsigned char *mem, unsigned int a) {
+	return mem[a] | (mem[a + 1] << 8);
+}
+
+/*
+ * Write the little endian word w to address a.
+ */
+void heapwrw(unsigned char *mem, unsigned int a, unsigned int w) {
+	mem[a] = w;
+	mem[a + 1] = w >> 8;
+}
+
+/*
+ * Make an empty heap.
+ */
+void heapinit(unsigned char *mem, unsigned int heap, unsigned int lim) {
+	unsigned int top = (heap + HEAPHDRLEN + 1) & ~1u;
+
+	memset(mem + heap, 0, HEAPHDRLEN);
+	heapwrw(mem, heap, top);
+	heapwrw(mem, heap + 2, (lim > top ? lim : top));
+}
+
+/*
+ * Allocate a block with room for n bytes.
+ */
+unsigned int heapalloc(unsigned char *mem, unsigned int heap, unsigned int n) {
+	unsigned char c = 0;
+	unsigned char k;
+	unsigned int b;
+	unsigned int top;
+
+	while ((HEAPMINBLK << c) - 2 < n) {
+		if (++c == HEAPCLASSES) {
+			return 0;
+		}
+	}
+	for (k = c; k < HEAPCLASSES; ++k) {
+		b = heaprdw(mem, HEAPLIST(k));
+		if (b) {
+			heapwrw(mem, HEAPLIST(k), heaprdw(mem, b + 2));
+			/* Give back the upper half until it is small enough */
+			while (k > c) {
+				--k;
+				heapwrw(mem, b + (HEAPMINBLK << k), k);
+				heapwrw(mem, b + (HEAPMINBLK << k) + 2, heaprdw(mem, HEAPLIST(k)));
+				heapwrw(mem, HEAPLIST(k), b + (HEAPMINBLK << k));
+			}
+			break;
+		}
+	}
+	if (k == HEAPCLASSES) {
+		top = heaprdw(mem, heap);
+		if ((HEAPMINBLK << c) > heaprdw(mem, heap + 2) - top) {
+			return 0;
+		}
+		b = top;
+		heapwrw(mem, heap, top + (HEAPMINBLK << c));
+	}
+	heapwrw(mem, b, HEAPUSED | c);
+	return b + 2;
+}
+
+/*
+ * Free the block at p.  Anything which is not an allocated block is
+ * ignored, so freeing 0 or freeing twice is harmless.
+ */
+void heapfree(unsigned char *mem, unsigned int heap, unsigned int p) {
+	unsigned int h;
+
+	if ((p < heap + HEAPHDRLEN + 2) || (p >= heaprdw(mem, heap))) {
+		return;
+	}
+	p -= 2;
+	h = heaprdw(mem, p);
+	if (((h & 0xff00) != HEAPUSED) || ((h & 0xff) >= HEAPCLASSES)) {
+		return;
+	}
+	heapwrw(mem, p, h & 0xff);
+	heapwrw(mem, p + 2, heaprdw(mem, HEAPLIST(h & 0xff)));
+	heapwrw(mem, HEAPLIST(h & 0xff), p);
+}
+#endif
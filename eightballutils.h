@@ -39,6 +39,14 @@
 
 #define VERSIONSTR "0.78"
 
+#ifdef __GNUC__
+extern int printfd;
+
+void flushout(void);
+
+char *readln(unsigned int max, unsigned int *len);
+#endif
+
 void print(char *str);
 
 void printchar(char c);
@@ -51,9 +59,83 @@ void printhex(unsigned int val);
 
 void printhexbyte(unsigned char val);
 
-void getln(char *str, unsigned char buflen);
+unsigned char getln(char *str, unsigned int buflen);
 
 char getkey(void);
 
 unsigned char checkInterrupted(void);
 
+#ifdef __GNUC__
+/*
+ * The rest is the runtime for the file, memory block, string, array, sort,
+ * hash table and heap statements, which is only built on Linux.
+ */
+
+unsigned char fileopen(char *name, unsigned int mode);
+
+void fileclose(unsigned int h);
+
+unsigned int fileread(unsigned int h, char *buf, unsigned int len);
+
+unsigned int filewrite(unsigned int h, char *buf, unsigned int len);
+
+void fileseek(unsigned int h, long off, unsigned int whence);
+
+/*
+ * filemap() windows must start and end on a multiple of MAPBLOCK.
+ */
+#define MAPBLOCK 4096
+
+unsigned char filemap(unsigned int h, char *addr, unsigned int len, unsigned int block);
+
+void fileunmap(char *addr, unsigned int len);
+
+/*
+ * Whole array operations on n elements of size bytes (1, 2 or
+ * sizeof(int)).  op is a character naming the operator, as in
+ * EightBall expressions.
+ */
+void vecop(char op, void *dst, void *src, int k, unsigned int n, unsigned char size);
+
+int vecreduce(char op, void *src, unsigned int n, unsigned char size);
+
+/*
+ * Flags for vecsort() and vecsearch()
+ */
+#define SORT_DESC   1           /* Largest first                */
+#define SORT_SIGNED 2           /* Elements are signed          */
+
+void vecsort(void *a, unsigned int n, unsigned char size, unsigned char flags, void *other, unsigned char osize);
+
+int vecsearch(void *a, unsigned int n, unsigned char size, unsigned char flags, unsigned long key);
+
+/*
+ * Hash tables, stored in an array of 3 + 3 * capacity words of size bytes.
+ * Keys are words, or with HASH_STRKEYS, addresses of strings (relative to
+ * base.)
+ */
+#define HASH_STRKEYS 1
+
+#define HASHWORDS(cap) (3 + 3 * (cap))
+
+void hashnew(void *t, unsigned int cap, unsigned char flags, unsigned char size);
+
+unsigned char hashput(void *t, unsigned int key, unsigned int val, char *base, unsigned char size);
+
+unsigned char hashget(void *t, unsigned int key, unsigned int *val, char *base, unsigned char size);
+
+unsigned char hashdel(void *t, unsigned int key, char *base, unsigned char size);
+
+unsigned int hashnext(void *t, unsigned int i, unsigned int *key, unsigned int *val, unsigned char size);
+
+/*
+ * Heap for a 16 bit address space at mem.  The heap header is at address
+ * heap and blocks are allocated from above it up to lim.  Addresses are
+ * offsets from mem.  heapalloc() returns 0 if there is no room.
+ */
+void heapinit(unsigned char *mem, unsigned int heap, unsigned int lim);
+
+unsigned int heapalloc(unsigned char *mem, unsigned int heap, unsigned int n);
+
+void heapfree(unsigned char *mem, unsigned int heap, unsigned int p);
+#endif
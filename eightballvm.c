@@ -48,6 +48,14 @@
 #define DEBUGREGS
 */
 
+/*
+ * Define COUNTINSNS to print the number of instructions executed to stderr
+ * at the end of the run (Linux only.)  Used by 'make test6502'.
+ */
+#ifndef __GNUC__
+#undef COUNTINSNS
+#endif
+
 /* Define STACKCHECKS to enable paranoid stack checking */
 #ifdef __GNUC__
 #define STACKCHECKS
@@ -96,6 +104,9 @@ UINT16 tempword;
 unsigned short *wordptr;
 unsigned char *byteptr;
 UINT16 evalstack[EVALSTACKSZ];  /* Evaluation stack - 16 bit ints.  Addressed by evalptr */
+#ifdef COUNTINSNS
+unsigned long insncount;        /* Number of instructions executed */
+#endif
 
 #else
 
@@ -123,6 +134,41 @@ extern UINT16 evalstack[EVALSTACKSZ];
 
 #endif
 
+/*
+ * Address of the first instruction to execute.  This is the start of the
+ * first image loaded.
+ */
+UINT16 entry = RTPCSTART;
+
+/*
+ * Address of the heap header.  The heap lies between the end of the
+ * highest image loaded and RTCALLSTACKLIM.
+ */
+UINT16 heap = RTPCSTART;
+
+/*
+ * Addresses of the images loaded, which may not overlap
+ */
+#define MAXIMAGES 8
+UINT16 imagebase[MAXIMAGES];
+UINT16 imageend[MAXIMAGES];
+unsigned char nimages;
+
+#ifdef __GNUC__
+/*
+ * Subs defined by the object files loaded, and the calls they make to
+ * subs in other images, which are filled in when all the images have been
+ * loaded.
+ */
+struct objname {
+    char name[OBJNAMELEN + 1];
+    UINT16 addr;                /* Entry point of sub, or operand of call */
+    struct objname *next;
+};
+struct objname *objsyms;
+struct objname *objrefs;
+#endif
+
 /*
  * System memory - addressed in bytes.
  * Used for program storage.  Addressed by pc.
@@ -131,7 +177,11 @@ extern UINT16 evalstack[EVALSTACKSZ];
  *  - Callstack grows down from top of memory.
  */
 #ifdef __GNUC__
-unsigned char memory[MEMORYSZ];
+/*
+ * Aligned so that files can be mapped into it (see filemap()).  The extra
+ * byte past the end is always zero, so string operations stop there.
+ */
+unsigned char memory[MEMORYSZ + 1] __attribute__ ((aligned(MAPBLOCK)));
 #else
 unsigned char *memory = 0;
 #endif
@@ -261,6 +311,9 @@ void vm_end() {
         printchar('\n');
     }
 #ifdef __GNUC__
+#ifdef COUNTINSNS
+    fprintf(stderr, "%lu instructions\n", insncount);
+#endif
     exit(0);
 #else
     for (tempword = 0; tempword < 25000; ++tempword);
@@ -495,6 +548,182 @@ void vm_strbyteimm() {
     pc += 2;
 }
 
+/*
+ * Indexed mode - replaces X with 16 bit value at base+2*X, where base is
+ * addr after opcode
+ */
+void vm_ldawordidx() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr;                        /* Base address */
+    tempword += XREG << 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to element */
+    XREG = *wordptr;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - replaces X with 8 bit value at base+X, where base is
+ * addr after opcode
+ */
+void vm_ldabyteidx() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr;                        /* Base address */
+    tempword += XREG;
+    XREG = MEM(tempword);
+    pc += 2;
+}
+
+/*
+ * Indexed mode - stores 16 bit value X at base+2*Y, where base is
+ * addr after opcode.  Drops X and Y
+ */
+void vm_stawordidx() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr;                        /* Base address */
+    tempword += YREG << 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to element */
+    *wordptr = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - stores 8 bit value X at base+Y, where base is
+ * addr after opcode.  Drops X and Y
+ */
+void vm_stabyteidx() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr;                        /* Base address */
+    tempword += YREG;
+    MEM(tempword) = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - replaces X with 16 bit value at base+2*X, where base is
+ * frame relative addr after opcode
+ */
+void vm_ldrwordidx() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;               /* Base address */
+    tempword += XREG << 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to element */
+    XREG = *wordptr;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - replaces X with 8 bit value at base+X, where base is
+ * frame relative addr after opcode
+ */
+void vm_ldrbyteidx() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;               /* Base address */
+    tempword += XREG;
+    XREG = MEM(tempword);
+    pc += 2;
+}
+
+/*
+ * Indexed mode - stores 16 bit value X at base+2*Y, where base is
+ * frame relative addr after opcode.  Drops X and Y
+ */
+void vm_strwordidx() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;               /* Base address */
+    tempword += YREG << 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to element */
+    *wordptr = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - stores 8 bit value X at base+Y, where base is
+ * frame relative addr after opcode.  Drops X and Y
+ */
+void vm_strbyteidx() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;               /* Base address */
+    tempword += YREG;
+    MEM(tempword) = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - replaces X with 16 bit value at base+2*X, where base is
+ * the pointer at frame relative addr after opcode
+ */
+void vm_ldpwordidx() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to base pointer */
+    tempword = *wordptr;                        /* Base address */
+    tempword += XREG << 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to element */
+    XREG = *wordptr;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - replaces X with 8 bit value at base+X, where base is
+ * the pointer at frame relative addr after opcode
+ */
+void vm_ldpbyteidx() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to base pointer */
+    tempword = *wordptr;                        /* Base address */
+    tempword += XREG;
+    XREG = MEM(tempword);
+    pc += 2;
+}
+
+/*
+ * Indexed mode - stores 16 bit value X at base+2*Y, where base is
+ * the pointer at frame relative addr after opcode.  Drops X and Y
+ */
+void vm_stpwordidx() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to base pointer */
+    tempword = *wordptr;                        /* Base address */
+    tempword += YREG << 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to element */
+    *wordptr = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
+/*
+ * Indexed mode - stores 8 bit value X at base+Y, where base is
+ * the pointer at frame relative addr after opcode.  Drops X and Y
+ */
+void vm_stpbyteidx() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    tempword = *wordptr + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to base pointer */
+    tempword = *wordptr;                        /* Base address */
+    tempword += YREG;
+    MEM(tempword) = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
 /*
  * Swaps X and Y
  */
@@ -1058,8 +1287,7 @@ void vm_kbdch() {
 #elif defined(CBM)
     while (!(*(char *) XREG = cbm_k_getin()));
 #else
-    /* TODO: Unimplemented in Linux */
-    XREG = 0;
+    XREG = getkey();
 #endif
     ++pc;
 }
@@ -1075,6 +1303,571 @@ void vm_kbdln() {
     ++pc;
 }
 
+/*
+ * Imm mode - if Y>X branch to 16 bit word following opcode.  Drop X, Y
+ */
+void vm_brgtimm() {
+    wordptr = (unsigned short *)&MEM(++pc);
+    CHECKUNDERFLOW(2);
+    if (YREG > XREG) {
+        pc = *wordptr;
+    } else {
+        pc += 2;
+    }
+    evalptr -= 2;
+}
+
+/*
+ * Imm mode - if Y>=X branch to 16 bit word following opcode.  Drop X, Y
+ */
+void vm_brgteimm() {
+    wordptr = (unsigned short *)&MEM(++pc);
+    CHECKUNDERFLOW(2);
+    if (YREG >= XREG) {
+        pc = *wordptr;
+    } else {
+        pc += 2;
+    }
+    evalptr -= 2;
+}
+
+/*
+ * Imm mode - if Y<X branch to 16 bit word following opcode.  Drop X, Y
+ */
+void vm_brltimm() {
+    wordptr = (unsigned short *)&MEM(++pc);
+    CHECKUNDERFLOW(2);
+    if (YREG < XREG) {
+        pc = *wordptr;
+    } else {
+        pc += 2;
+    }
+    evalptr -= 2;
+}
+
+/*
+ * Imm mode - if Y<=X branch to 16 bit word following opcode.  Drop X, Y
+ */
+void vm_brlteimm() {
+    wordptr = (unsigned short *)&MEM(++pc);
+    CHECKUNDERFLOW(2);
+    if (YREG <= XREG) {
+        pc = *wordptr;
+    } else {
+        pc += 2;
+    }
+    evalptr -= 2;
+}
+
+/*
+ * Imm mode - if Y==X branch to 16 bit word following opcode.  Drop X, Y
+ */
+void vm_breqlimm() {
+    wordptr = (unsigned short *)&MEM(++pc);
+    CHECKUNDERFLOW(2);
+    if (YREG == XREG) {
+        pc = *wordptr;
+    } else {
+        pc += 2;
+    }
+    evalptr -= 2;
+}
+
+/*
+ * Imm mode - if Y!=X branch to 16 bit word following opcode.  Drop X, Y
+ */
+void vm_brneqlimm() {
+    wordptr = (unsigned short *)&MEM(++pc);
+    CHECKUNDERFLOW(2);
+    if (YREG != XREG) {
+        pc = *wordptr;
+    } else {
+        pc += 2;
+    }
+    evalptr -= 2;
+}
+
+/*
+ * Imm mode - if X==0 branch to 16 bit word following opcode.  Drop X
+ */
+void vm_brzimm() {
+    wordptr = (unsigned short *)&MEM(++pc);
+    CHECKUNDERFLOW(1);
+    if (!XREG) {
+        pc = *wordptr;
+    } else {
+        pc += 2;
+    }
+    --evalptr;
+}
+
+/*
+ * Short imm mode - pushes the following 8 bit value to the evaluation stack.
+ */
+void vm_ldimmb() {
+    ++evalptr;
+    CHECKOVERFLOW();
+    XREG = MEM(++pc);
+    ++pc;
+}
+
+/*
+ * Short imm mode - as vm_ldrwordimm() etc. but the frame relative address
+ * following the opcode is a signed 8 bit value.
+ */
+void vm_ldrwordimmb() {
+    ++evalptr;
+    CHECKOVERFLOW();
+    tempword = (signed char) MEM(++pc) + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to variable */
+    XREG = *wordptr;
+    ++pc;
+}
+
+void vm_ldrbyteimmb() {
+    ++evalptr;
+    CHECKOVERFLOW();
+    tempword = (signed char) MEM(++pc) + fp + 1;
+    byteptr = (unsigned char *)&MEM(tempword); /* Pointer to variable */
+    XREG = *byteptr;
+    ++pc;
+}
+
+void vm_strwordimmb() {
+    CHECKUNDERFLOW(1);
+    tempword = (signed char) MEM(++pc) + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword); /* Pointer to variable */
+    *wordptr = XREG;
+    --evalptr;
+    ++pc;
+}
+
+void vm_strbyteimmb() {
+    CHECKUNDERFLOW(1);
+    tempword = (signed char) MEM(++pc) + fp + 1;
+    byteptr = (unsigned char *)&MEM(tempword); /* Pointer to variable */
+    *byteptr = XREG;
+    --evalptr;
+    ++pc;
+}
+
+/*
+ * Relative mode - jump by the signed 8 bit offset following the opcode.
+ * The offset is relative to the address of the next instruction.
+ */
+void vm_jmprel() {
+    pc += (signed char) MEM(pc + 1) + 2;
+}
+
+/*
+ * Relative mode - if X!=0 branch by offset.  Drop X.
+ */
+void vm_brnchrel() {
+    CHECKUNDERFLOW(1);
+    if (XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    --evalptr;
+}
+
+/*
+ * Relative mode - if Y>X branch by offset.  Drop X, Y.
+ */
+void vm_brgtrel() {
+    CHECKUNDERFLOW(2);
+    if (YREG > XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    evalptr -= 2;
+}
+
+/*
+ * Relative mode - if Y>=X branch by offset.  Drop X, Y.
+ */
+void vm_brgterel() {
+    CHECKUNDERFLOW(2);
+    if (YREG >= XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    evalptr -= 2;
+}
+
+/*
+ * Relative mode - if Y<X branch by offset.  Drop X, Y.
+ */
+void vm_brltrel() {
+    CHECKUNDERFLOW(2);
+    if (YREG < XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    evalptr -= 2;
+}
+
+/*
+ * Relative mode - if Y<=X branch by offset.  Drop X, Y.
+ */
+void vm_brlterel() {
+    CHECKUNDERFLOW(2);
+    if (YREG <= XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    evalptr -= 2;
+}
+
+/*
+ * Relative mode - if Y==X branch by offset.  Drop X, Y.
+ */
+void vm_breqlrel() {
+    CHECKUNDERFLOW(2);
+    if (YREG == XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    evalptr -= 2;
+}
+
+/*
+ * Relative mode - if Y!=X branch by offset.  Drop X, Y.
+ */
+void vm_brneqlrel() {
+    CHECKUNDERFLOW(2);
+    if (YREG != XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    evalptr -= 2;
+}
+
+/*
+ * Relative mode - if X==0 branch by offset.  Drop X.
+ */
+void vm_brzrel() {
+    CHECKUNDERFLOW(1);
+    if (!XREG) {
+        pc += (signed char) MEM(pc + 1);
+    }
+    pc += 2;
+    --evalptr;
+}
+
+#ifdef __GNUC__
+/*
+ * The file, memory block, string, array, sort and hash table instructions
+ * are only supported on Linux.  The 8 bit VMs treat them as unsupported.
+ */
+
+/*
+ * File I/O.  The function code follows the opcode.
+ */
+void vm_file() {
+    switch (MEM(pc + 1)) {
+    case FILE_OPEN:
+        CHECKUNDERFLOW(3);
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = fileopen((char *) &MEM(ZREG), YREG);
+        evalptr -= 3;
+        break;
+    case FILE_CLOSE:
+        CHECKUNDERFLOW(1);
+        fileclose(XREG);
+        --evalptr;
+        break;
+    case FILE_READ:
+    case FILE_WRITE:
+        CHECKUNDERFLOW(4);
+        /* Don't run off the end of memory[] */
+        if (YREG > MEMORYSZ - ZREG) {
+            YREG = MEMORYSZ - ZREG;
+        }
+        wordptr = (unsigned short *)&MEM(XREG);
+        if (MEM(pc + 1) == FILE_READ) {
+            *wordptr = fileread(TREG, (char *) &MEM(ZREG), YREG);
+        } else {
+            *wordptr = filewrite(TREG, (char *) &MEM(ZREG), YREG);
+        }
+        evalptr -= 4;
+        break;
+    case FILE_SEEK:
+        CHECKUNDERFLOW(4);
+        /* Offset is 32 bits, with the high word in Y */
+        fileseek(TREG, (long) (short) YREG * 65536L + ZREG, XREG);
+        evalptr -= 4;
+        break;
+    case FILE_MAP:
+        CHECKUNDERFLOW(5);
+        wordptr = (unsigned short *)&MEM(XREG);
+        if (ZREG > MEMORYSZ - TREG) {
+            *wordptr = 0;
+        } else {
+            *wordptr = filemap(evalstack[evalptr - 5], (char *) &MEM(TREG), ZREG, YREG);
+        }
+        evalptr -= 5;
+        break;
+    case FILE_UNMAP:
+        CHECKUNDERFLOW(2);
+        if (XREG <= MEMORYSZ - YREG) {
+            fileunmap((char *) &MEM(YREG), XREG);
+        }
+        evalptr -= 2;
+        break;
+    default:
+        unsupported();
+    }
+    pc += 2;
+}
+
+/*
+ * Length of a block at addr, shortened if need be so as not to run off
+ * the end of memory[].
+ */
+#define CLIP(addr, len) ((len) > MEMORYSZ - (addr) ? MEMORYSZ - (addr) : (len))
+
+/*
+ * Number of elements of size bytes at addr, reduced if need be in the same
+ * way as CLIP()
+ */
+#define CLIPN(addr, n, size) ((n) * (size) > MEMORYSZ - (addr) ? (MEMORYSZ - (addr)) / (size) : (n))
+
+/*
+ * Block memory operations.  The function code follows the opcode.
+ */
+void vm_mem() {
+    int n;
+
+    switch (MEM(pc + 1)) {
+    case MEM_COPY:
+        CHECKUNDERFLOW(3);
+        XREG = CLIP(ZREG, XREG);
+        XREG = CLIP(YREG, XREG);
+        memmove(&MEM(ZREG), &MEM(YREG), XREG);
+        evalptr -= 3;
+        break;
+    case MEM_FILL:
+        CHECKUNDERFLOW(3);
+        memset(&MEM(ZREG), YREG, CLIP(ZREG, XREG));
+        evalptr -= 3;
+        break;
+    case MEM_CMP:
+        CHECKUNDERFLOW(4);
+        YREG = CLIP(TREG, YREG);
+        YREG = CLIP(ZREG, YREG);
+        n = memcmp(&MEM(TREG), &MEM(ZREG), YREG);
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = (n > 0 ? 1 : (n ? 0xffff : 0));
+        evalptr -= 4;
+        break;
+    case MEM_ALLOC:
+        CHECKUNDERFLOW(2);
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = heapalloc(&MEM(0), heap, YREG);
+        evalptr -= 2;
+        break;
+    case MEM_FREE:
+        CHECKUNDERFLOW(1);
+        heapfree(&MEM(0), heap, XREG);
+        --evalptr;
+        break;
+    default:
+        unsupported();
+    }
+    pc += 2;
+}
+
+/*
+ * Null terminated string operations.  The function code follows the
+ * opcode.
+ */
+void vm_str() {
+    char *p;
+    int n;
+    int dst;
+
+    switch (MEM(pc + 1)) {
+    case STR_LEN:
+        CHECKUNDERFLOW(2);
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = strlen((char *) &MEM(YREG));
+        evalptr -= 2;
+        break;
+    case STR_CPY:
+    case STR_CAT:
+        CHECKUNDERFLOW(2);
+        dst = YREG;
+        if (MEM(pc + 1) == STR_CAT) {
+            dst += strlen((char *) &MEM(dst));
+        }
+        n = strlen((char *) &MEM(XREG)) + 1;
+        memmove(&MEM(dst), &MEM(XREG), CLIP(dst, n));
+        evalptr -= 2;
+        break;
+    case STR_CMP:
+        CHECKUNDERFLOW(3);
+        n = strcmp((char *) &MEM(ZREG), (char *) &MEM(YREG));
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = (n > 0 ? 1 : (n ? 0xffff : 0));
+        evalptr -= 3;
+        break;
+    case STR_CHR:
+    case STR_FIND:
+        CHECKUNDERFLOW(3);
+        if (MEM(pc + 1) == STR_CHR) {
+            p = strchr((char *) &MEM(ZREG), YREG);
+        } else {
+            p = strstr((char *) &MEM(ZREG), (char *) &MEM(YREG));
+        }
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = (p ? p - (char *) &MEM(ZREG) : 0xffff);
+        evalptr -= 3;
+        break;
+    default:
+        unsupported();
+    }
+    pc += 2;
+}
+
+/*
+ * Whole array operations.  The function code follows the opcode.
+ */
+void vm_vec() {
+    unsigned char fn = MEM(pc + 1);
+    unsigned char size = ((fn == VEC_W) || (fn == VEC_WK) || (fn == VEC_RW) ? 2 : 1);
+
+    CHECKUNDERFLOW(4);
+    switch (fn) {
+    case VEC_W:
+    case VEC_B:
+        XREG = CLIPN(ZREG, XREG, size);
+        XREG = CLIPN(YREG, XREG, size);
+        vecop(TREG, &MEM(ZREG), &MEM(YREG), 0, XREG, size);
+        break;
+    case VEC_WK:
+    case VEC_BK:
+        vecop(TREG, &MEM(ZREG), 0, YREG, CLIPN(ZREG, XREG, size), size);
+        break;
+    case VEC_RW:
+    case VEC_RB:
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = vecreduce(TREG, &MEM(ZREG), CLIPN(ZREG, YREG, size), size);
+        break;
+    default:
+        unsupported();
+    }
+    evalptr -= 4;
+    pc += 2;
+}
+
+/*
+ * Sort and binary search.  The function code follows the opcode.
+ */
+void vm_sort() {
+    unsigned char fn = MEM(pc + 1);
+    unsigned char size = ((fn == SORT_W) || (fn == SORT_SEARCHW) ? 2 : 1);
+
+    switch (fn) {
+    case SORT_W:
+    case SORT_B:
+        CHECKUNDERFLOW(4);
+        ZREG = CLIPN(TREG, ZREG, size);
+        if (XREG) {
+            ZREG = CLIPN(XREG, ZREG, 2);
+        }
+        vecsort(&MEM(TREG), ZREG, size, YREG, (XREG ? &MEM(XREG) : 0), 2);
+        evalptr -= 4;
+        break;
+    case SORT_SEARCHW:
+    case SORT_SEARCHB:
+        CHECKUNDERFLOW(5);
+        TREG = CLIPN(evalstack[evalptr - 5], TREG, size);
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = vecsearch(&MEM(evalstack[evalptr - 5]), TREG, size, ZREG,
+                             (ZREG & SORT_SIGNED ? (unsigned long) (long) (short) YREG : YREG));
+        evalptr -= 5;
+        break;
+    default:
+        unsupported();
+    }
+    pc += 2;
+}
+
+/*
+ * Returns 1 if a hash table at addr with capacity cap fits in memory[]
+ */
+#define HASHFITS(addr, cap) ((unsigned long) HASHWORDS((unsigned long) (cap)) * 2 <= (unsigned long) (MEMORYSZ - (addr)))
+
+/*
+ * Hash tables.  The function code follows the opcode.
+ */
+void vm_hash() {
+    unsigned int key;
+    unsigned int val;
+    char *base = (char *) &MEM(0);
+
+    switch (MEM(pc + 1)) {
+    case HASH_NEW:
+        CHECKUNDERFLOW(3);
+        if (HASHFITS(ZREG, YREG)) {
+            hashnew(&MEM(ZREG), YREG, XREG, 2);
+        }
+        evalptr -= 3;
+        break;
+    case HASH_PUT:
+        CHECKUNDERFLOW(4);
+        wordptr = (unsigned short *)&MEM(TREG);
+        val = HASHFITS(TREG, *wordptr) && hashput(&MEM(TREG), ZREG, YREG, base, 2);
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = val;
+        evalptr -= 4;
+        break;
+    case HASH_GET:
+        CHECKUNDERFLOW(4);
+        wordptr = (unsigned short *)&MEM(TREG);
+        key = HASHFITS(TREG, *wordptr) && hashget(&MEM(TREG), ZREG, &val, base, 2);
+        if (key) {
+            wordptr = (unsigned short *)&MEM(YREG);
+            *wordptr = val;
+        }
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = key;
+        evalptr -= 4;
+        break;
+    case HASH_DEL:
+        CHECKUNDERFLOW(3);
+        wordptr = (unsigned short *)&MEM(ZREG);
+        val = HASHFITS(ZREG, *wordptr) && hashdel(&MEM(ZREG), YREG, base, 2);
+        wordptr = (unsigned short *)&MEM(XREG);
+        *wordptr = val;
+        evalptr -= 3;
+        break;
+    case HASH_NEXT:
+        CHECKUNDERFLOW(4);
+        wordptr = (unsigned short *)&MEM(TREG);
+        if (HASHFITS(TREG, *wordptr)) {
+            wordptr = (unsigned short *)&MEM(ZREG);
+            *wordptr = hashnext(&MEM(TREG), *wordptr, &key, &val, 2);
+            if (*wordptr) {
+                wordptr = (unsigned short *)&MEM(YREG);
+                *wordptr = key;
+                wordptr = (unsigned short *)&MEM(XREG);
+                *wordptr = val;
+            }
+        } else {
+            wordptr = (unsigned short *)&MEM(ZREG);
+            *wordptr = 0;
+        }
+        evalptr -= 4;
+        break;
+    default:
+        unsupported();
+    }
+    pc += 2;
+}
+#endif
+
 typedef void (*func)(void);
 
 /*
@@ -1151,45 +1944,54 @@ func jumptbl[] = {
     vm_prmsg,
     vm_kbdch,
     vm_kbdln,
+    vm_brgtimm,
+    vm_brgteimm,
+    vm_brltimm,
+    vm_brlteimm,
+    vm_breqlimm,
+    vm_brneqlimm,
+    vm_brzimm,
+    vm_ldimmb,
+    vm_ldrwordimmb,
+    vm_ldrbyteimmb,
+    vm_strwordimmb,
+    vm_strbyteimmb,
+    vm_jmprel,
+    vm_brnchrel,
+    vm_brgtrel,
+    vm_brgterel,
+    vm_brltrel,
+    vm_brlterel,
+    vm_breqlrel,
+    vm_brneqlrel,
+    vm_brzrel,
+#ifdef __GNUC__
+    vm_file,
+    vm_mem,
+    vm_str,
+    vm_vec,
+    vm_sort,
+    vm_hash,
+#else
     unsupported,
     unsupported,
     unsupported,
     unsupported,
     unsupported,
     unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
+#endif
+    vm_ldawordidx,
+    vm_ldabyteidx,
+    vm_stawordidx,
+    vm_stabyteidx,
+    vm_ldrwordidx,
+    vm_ldrbyteidx,
+    vm_strwordidx,
+    vm_strbyteidx,
+    vm_ldpwordidx,
+    vm_ldpbyteidx,
+    vm_stpwordidx,
+    vm_stpbyteidx,
     unsupported,
     unsupported,
     unsupported,
@@ -1351,8 +2153,11 @@ void execute()
 #endif
 
     evalptr = 0;
-    pc = RTPCSTART;
+    pc = entry;
     sp = fp = RTCALLSTACKTOP;
+#ifdef __GNUC__
+    heapinit(&MEM(0), heap, RTCALLSTACKLIM);
+#endif
 
     while (1) {
 
@@ -1403,13 +2208,19 @@ void execute()
         (MEM(pc) == VM_STABYTEIMM) ||
         (MEM(pc) == VM_STRWORDIMM) ||
         (MEM(pc) == VM_STRBYTEIMM) ||
+        ((MEM(pc) >= VM_LDAWORDIDX) && (MEM(pc) <= VM_STPBYTEIDX)) ||
         (MEM(pc) == VM_JMPIMM) ||
         (MEM(pc) == VM_BRNCHIMM) ||
-        (MEM(pc) == VM_JSRIMM)) {
+        (MEM(pc) == VM_JSRIMM) ||
+        ((MEM(pc) >= VM_BRGTIMM) && (MEM(pc) <= VM_BRZIMM))) {
         printchar(' ');
         wordptr = (unsigned short *)&MEM(pc + 1);
         printhex(*wordptr);
         printchar(' ');
+    } else if ((MEM(pc) >= VM_LDIMMB) && (MEM(pc) <= VM_HASH)) {
+        print("   ");
+        printhexbyte(MEM(pc + 1));
+        printchar(' ');
     } else {
         print("       ");
     }
@@ -1441,6 +2252,9 @@ void execute()
 #endif
 
 #ifndef A2E
+#ifdef COUNTINSNS
+    ++insncount;
+#endif
     jumptbl[MEM(pc)]();
 #else
 #if 0
@@ -1484,42 +2298,295 @@ void execute()
     }
 };
 
+/*
+ * Read a little endian word from a file.
+ */
+UINT16 readword(FILE *fp)
+{
+    UINT16 w = fgetc(fp);
+    return w | (fgetc(fp) << 8);
+}
+
+/*
+ * Returns 1 if the len bytes at addr overlap an image already loaded.
+ * Otherwise records them as the next image and returns 0.
+ */
+unsigned char overlaps(UINT16 addr, UINT16 len)
+{
+    unsigned char i;
+
+    for (i = 0; i < nimages; ++i) {
+        if ((addr < imageend[i]) && (addr + len > imagebase[i])) {
+            print("Overlaps image at ");
+            printhex(imagebase[i]);
+            printchar('\n');
+            return 1;
+        }
+    }
+    if (nimages == MAXIMAGES) {
+        print("Too many images\n");
+        return 1;
+    }
+    imagebase[nimages] = addr;
+    imageend[nimages++] = addr + len;
+    return 0;
+}
+
+#ifdef __GNUC__
+/*
+ * Read n symbol or reference table entries of an object file loaded at
+ * addr from fp, and add them to the list at *list.
+ * Returns 0 on success, 1 on error.
+ */
+unsigned char readnames(FILE *fp, UINT16 n, UINT16 addr, struct objname **list)
+{
+    struct objname *o;
+
+    while (n--) {
+        o = malloc(sizeof(struct objname));
+        if (!o) {
+            print("No memory\n");
+            return 1;
+        }
+        fread(o->name, 1, OBJNAMELEN, fp);
+        o->name[OBJNAMELEN] = '\0';
+        o->addr = addr + readword(fp);
+        o->next = *list;
+        *list = o;
+    }
+    return 0;
+}
+
+/*
+ * Free a list made by readnames()
+ */
+void freenames(struct objname **list)
+{
+    struct objname *o;
+
+    while (*list) {
+        o = *list;
+        *list = o->next;
+        free(o);
+    }
+}
+
+/*
+ * Fill in the calls from each object file loaded to subs in the others.
+ * Returns 0 on success, 1 if a sub is not defined or defined twice.
+ */
+unsigned char linkimages()
+{
+    struct objname *r;
+    struct objname *s;
+    struct objname *dup;
+    unsigned char err = 0;
+
+    for (s = objsyms; s; s = s->next) {
+        for (dup = s->next; dup; dup = dup->next) {
+            if (!strcmp(s->name, dup->name)) {
+                print("Sub ");
+                print(s->name);
+                print(" defined twice\n");
+                err = 1;
+            }
+        }
+    }
+    for (r = objrefs; r; r = r->next) {
+        for (s = objsyms; s && strcmp(s->name, r->name); s = s->next);
+        if (!s) {
+            print("Sub ");
+            print(r->name);
+            print(" not defined\n");
+            err = 1;
+            continue;
+        }
+        wordptr = (unsigned short *) &MEM(r->addr);
+        *wordptr = s->addr;
+    }
+    freenames(&objsyms);
+    freenames(&objrefs);
+    return err;
+}
+#endif
+
+/*
+ * Load the bytecode file name at address addr.  If the file has a header
+ * (see eightballvm.h) the code is relocated to run at addr.  Files without
+ * a header can only be loaded at RTPCSTART.  On Linux, object files may be
+ * loaded too.  Their symbols and calls to other modules are kept for
+ * linkimages(), and only the first image loaded may have a main program.
+ * Returns the address following the image, or 0 on error.
+ */
+UINT16 loadimage(char *name, UINT16 addr)
+{
+    FILE *fp;
+    UINT16 len;
+    UINT16 nrelocs;
+    UINT16 a;
+    int ch;
+#ifdef __GNUC__
+    UINT16 nsyms = 0;
+    UINT16 nrefs = 0;
+    unsigned char obj;
+#endif
+
+    print("Loading '");
+    print(name);
+    print("' at ");
+    printhex(addr);
+    printchar('\n');
+    fp = fopen(name, "r");
+    if (!fp) {
+        print("Can't open\n");
+        return 0;
+    }
+    ch = fgetc(fp);
+#ifdef __GNUC__
+    obj = (ch == OBJMAGIC);
+    if (obj) {
+        if (fgetc(fp) != OBJVERSION) {
+            print("Bad version\n");
+            goto err;
+        }
+        len = readword(fp);
+        nrelocs = readword(fp);
+        nsyms = readword(fp);
+        nrefs = readword(fp);
+        if (readword(fp) && nimages) {
+            print("Globals or main program (only allowed in first image)\n");
+            goto err;
+        }
+    } else
+#endif
+    if (ch != BCMAGIC) {
+        if ((addr != RTPCSTART) || nimages) {
+            print("No relocation info\n");
+            goto err;
+        }
+        while (ch != EOF) {
+            if (addr >= RTCALLSTACKLIM) {
+                goto toobig;
+            }
+            MEM(addr++) = ch;
+            /* Print dot for each page */
+            if (addr % 0xff == 0) {
+                printchar('.');
+            }
+            ch = fgetc(fp);
+        }
+        fclose(fp);
+        overlaps(RTPCSTART, addr - RTPCSTART);
+        return addr;
+    } else {
+        if (fgetc(fp) != BCVERSION) {
+            print("Bad version\n");
+            goto err;
+        }
+        len = readword(fp);
+        nrelocs = readword(fp);
+    }
+    if ((addr < RTPCSTART) || (addr > RTCALLSTACKLIM) ||
+        (len > RTCALLSTACKLIM - addr)) {
+        goto toobig;
+    }
+    if (overlaps(addr, len)) {
+        goto err;
+    }
+    for (a = addr; a < addr + len; ++a) {
+        MEM(a) = fgetc(fp);
+        if (a % 0xff == 0) {
+            printchar('.');
+        }
+    }
+    while (nrelocs--) {
+        a = addr + readword(fp);
+        wordptr = (unsigned short *) &MEM(a);
+        *wordptr += addr - RTPCSTART;
+    }
+#ifdef __GNUC__
+    if (obj && (readnames(fp, nsyms, addr, &objsyms) ||
+                readnames(fp, nrefs, addr, &objrefs))) {
+        goto err;
+    }
+#endif
+    if (feof(fp)) {
+        print("Truncated\n");
+        goto err;
+    }
+    fclose(fp);
+    return addr + len;
+toobig:
+    print("Too big\n");
+err:
+    fclose(fp);
+    return 0;
+}
+
 /*
  * Load bytecode into memory[].
+ * Several images may be given, separated by commas, each optionally
+ * followed by @ and the hex address to load it at.  Otherwise the first
+ * is loaded at RTPCSTART and each following one directly after the one
+ * before.  The images may not overlap.  Execution starts with the first.
+ * On Linux, object files may be loaded, such as a main program followed
+ * by library modules, and calls between them are linked.
+ * The bottom of the call stack is used as the filename buffer.
  */
 void load()
 {
-    FILE *fp;
-    char ch;
-    char *p = (char*)&MEM(RTPCSTART);
+    char *p = (char *) &MEM(RTCALLSTACKLIM);
+    char *q;
+    char *at;
+    UINT16 addr;
 
-    pc = RTPCSTART;
     do {
 #ifndef VIC20
         /* TODO: Not sure why getln() is blowing up on VIC20 */
         print("\nBytecode file (CR for default)>");
-        getln(p, 15);
+        getln(p, 63);
 #else
         *p = 0;
 #endif
         if (strlen(p) == 0) {
             strcpy(p, "bytecode");
         }
-        print("Loading '");
-        print(p);
-        print("'\n");
-        fp = fopen(p, "r");
-    } while (!fp);
-    while (!feof(fp)) {
-        ch = fgetc(fp);
-        MEM(pc++) = ch;
-        /* Print dot for each page */
-        if (pc%0xff == 0) {
-            printchar('.');
+        addr = RTPCSTART;
+        entry = 0;
+        heap = RTPCSTART;
+        nimages = 0;
+        for (q = p; q; q = p) {
+            p = strchr(q, ',');
+            if (p) {
+                *p++ = '\0';
+            }
+            at = strchr(q, '@');
+            if (at) {
+                *at++ = '\0';
+                addr = strtoul(at, NULL, 16);
+            }
+            if (!entry) {
+                entry = addr;
+            }
+            addr = loadimage(q, addr);
+            if (!addr) {
+                break;
+            }
+            if (addr > heap) {
+                heap = addr;
+            }
         }
-    }
-    fclose(fp);
-    pc = RTPCSTART;
+#ifdef __GNUC__
+        if (!addr) {
+            freenames(&objsyms);
+            freenames(&objrefs);
+        } else if (linkimages()) {
+            addr = 0;
+        }
+#endif
+        p = (char *) &MEM(RTCALLSTACKLIM);
+    } while (!addr);
+    pc = entry;
 #ifdef A2E
     printchar(7);
 #endif
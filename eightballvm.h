@@ -149,11 +149,141 @@ enum bytecode {
     VM_PRSTR,                   /* Print null terminated string pointed to by X.  Drop X        */
     VM_PRMSG,                   /* Print literal string at PC (null terminated)                 */
     VM_KBDCH,                   /* Push character from keyboard onto eval stack                 */
-    VM_KBDLN                    /* Obtain line from keyboard and write to memory pointed to by  */
+    VM_KBDLN,                   /* Obtain line from keyboard and write to memory pointed to by  */
                                 /* Y. X contains the max number of bytes in buf. Drop X, Y.     */
+    /**** Fused compare and branch **************************************************************/
+    /* Must be in the same order as VM_GT .. VM_NEQL                                            */
+    VM_BRGTIMM,                 /* Imm mode - if Y>X branch to 16 bit word. Drop X, Y.          */
+    VM_BRGTEIMM,                /* Imm mode - if Y>=X branch to 16 bit word. Drop X, Y.         */
+    VM_BRLTIMM,                 /* Imm mode - if Y<X branch to 16 bit word. Drop X, Y.          */
+    VM_BRLTEIMM,                /* Imm mode - if Y<=X branch to 16 bit word. Drop X, Y.         */
+    VM_BREQLIMM,                /* Imm mode - if Y==X branch to 16 bit word. Drop X, Y.         */
+    VM_BRNEQLIMM,               /* Imm mode - if Y!=X branch to 16 bit word. Drop X, Y.         */
+    VM_BRZIMM,                  /* Imm mode - if X==0 branch to 16 bit word. Drop X.            */
+    /**** Compact encoding **********************************************************************/
+    /* Two byte forms of the above, with an 8 bit operand.  The compiler uses them in place of   */
+    /* the three byte forms when the operand fits (see compact() in eightball.c)                */
+    VM_LDIMMB,                  /* Imm mode - push 8 bit value following opcode [X]             */
+    VM_LDRWORDIMMB,             /* As LDRWORDIMM, with signed 8 bit frame relative address      */
+    VM_LDRBYTEIMMB,             /* As LDRBYTEIMM, with signed 8 bit frame relative address      */
+    VM_STRWORDIMMB,             /* As STRWORDIMM, with signed 8 bit frame relative address      */
+    VM_STRBYTEIMMB,             /* As STRBYTEIMM, with signed 8 bit frame relative address      */
+    /* Branch by signed 8 bit offset, relative to the following instruction.                    */
+    /* Must be in the same order as VM_BRGTIMM .. VM_BRZIMM                                     */
+    VM_JMPREL,                  /* Jump by offset following opcode                              */
+    VM_BRNCHREL,                /* If X!=0 branch by offset. Drop X.                            */
+    VM_BRGTREL,                 /* If Y>X branch by offset. Drop X, Y.                          */
+    VM_BRGTEREL,                /* If Y>=X branch by offset. Drop X, Y.                         */
+    VM_BRLTREL,                 /* If Y<X branch by offset. Drop X, Y.                          */
+    VM_BRLTEREL,                /* If Y<=X branch by offset. Drop X, Y.                         */
+    VM_BREQLREL,                /* If Y==X branch by offset. Drop X, Y.                         */
+    VM_BRNEQLREL,               /* If Y!=X branch by offset. Drop X, Y.                         */
+    VM_BRZREL,                  /* If X==0 branch by offset. Drop X.                            */
+    /**** Library functions *********************************************************************/
+    /* Also two bytes long: the opcode is followed by an 8 bit function code (see below.)        */
+    /* The arguments are taken from the eval stack and dropped.  Results are stored to the word */
+    /* pointed to by the last argument.                                                         */
+    VM_FILE,                    /* File I/O                                                     */
+    VM_MEM,                     /* Block memory operations                                      */
+    VM_STR,                     /* Null terminated string operations                            */
+    VM_VEC,                     /* Whole array operations                                       */
+    VM_SORT,                    /* Sort and binary search                                       */
+    VM_HASH,                    /* Hash tables                                                  */
+    /**** Indexed addressing ******************************************************************/
+    /* Appended here so that existing bytecode files still load.  Three bytes long: the base    */
+    /* address follows the opcode.  The index is in X (load) or Y (store.)                      */
+    VM_LDAWORDIDX,              /* Replaces X with 16 bit value at base+2*X.                    */
+    VM_LDABYTEIDX,              /* Replaces X with 8 bit value at base+X.                       */
+    VM_STAWORDIDX,              /* Stores 16 bit value X at base+2*Y. Drops X and Y.            */
+    VM_STABYTEIDX,              /* Stores 8 bit value X at base+Y. Drops X and Y.               */
+    VM_LDRWORDIDX,              /* As LDAWORDIDX, but base is relative to frame pointer.        */
+    VM_LDRBYTEIDX,              /* As LDABYTEIDX, but base is relative to frame pointer.        */
+    VM_STRWORDIDX,              /* As STAWORDIDX, but base is relative to frame pointer.        */
+    VM_STRBYTEIDX,              /* As STABYTEIDX, but base is relative to frame pointer.        */
+    VM_LDPWORDIDX,              /* As LDAWORDIDX, but base is the pointer stored at the frame   */
+    VM_LDPBYTEIDX,              /* relative address following the opcode.  Used for arrays      */
+    VM_STPWORDIDX,              /* passed by reference.                                         */
+    VM_STPBYTEIDX               /*                                                              */
     /********************************************************************************************/
 };
 
+/*
+ * Function codes for VM_FILE.  Arguments are listed with the first pushed
+ * first, so the last is X.
+ */
+enum filefn {
+    FILE_OPEN,                  /* name, mode, ptr: open file, store handle or 0 at ptr        */
+    FILE_CLOSE,                 /* handle: close file                                           */
+    FILE_READ,                  /* handle, addr, len, ptr: read to addr, store count at ptr     */
+    FILE_WRITE,                 /* handle, addr, len, ptr: write from addr, store count at ptr  */
+    FILE_SEEK,                  /* handle, offset, offset high, whence: move file position      */
+    FILE_MAP,                   /* handle, addr, len, block, ptr: map file at addr, store 1 or 0 */
+    FILE_UNMAP                  /* addr, len: remove mapping, leaving memory zero               */
+};
+
+/*
+ * Function codes for VM_MEM.  Arguments as for VM_FILE.
+ */
+enum memfn {
+    MEM_COPY,                   /* dst, src, len: copy len bytes from src to dst (may overlap)  */
+    MEM_FILL,                   /* dst, val, len: set len bytes at dst to val                   */
+    MEM_CMP,                    /* a, b, len, ptr: compare len bytes, store -1, 0 or 1 at ptr   */
+    MEM_ALLOC,                  /* len, ptr: allocate len bytes from heap, store address at ptr */
+    MEM_FREE                    /* addr: return block from MEM_ALLOC to heap                    */
+};
+
+/*
+ * Function codes for VM_STR.  Arguments as for VM_FILE.  Indexes stored
+ * by STR_CHR and STR_FIND are -1 if nothing was found.
+ */
+enum strfn {
+    STR_LEN,                    /* str, ptr: store length of str at ptr                         */
+    STR_CPY,                    /* dst, src: copy src to dst                                    */
+    STR_CAT,                    /* dst, src: append src to dst                                  */
+    STR_CMP,                    /* a, b, ptr: compare strings, store -1, 0 or 1 at ptr          */
+    STR_CHR,                    /* str, ch, ptr: store index of first ch in str at ptr          */
+    STR_FIND                    /* str, sub, ptr: store index of first sub in str at ptr        */
+};
+
+/*
+ * Function codes for VM_VEC.  Arguments as for VM_FILE.  op is the
+ * character naming the operator (see vecop() and vecreduce().)
+ */
+enum vecfn {
+    VEC_W,                      /* op, dst, src, n: dst[i] = dst[i] op src[i] for n words       */
+    VEC_B,                      /* op, dst, src, n: as VEC_W, for n bytes                       */
+    VEC_WK,                     /* op, dst, k, n: dst[i] = dst[i] op k for n words              */
+    VEC_BK,                     /* op, dst, k, n: as VEC_WK, for n bytes                        */
+    VEC_RW,                     /* op, src, n, ptr: reduce n words, store result at ptr         */
+    VEC_RB                      /* op, src, n, ptr: as VEC_RW, for n bytes                      */
+};
+
+/*
+ * Function codes for VM_SORT.  Arguments as for VM_FILE.  flags are
+ * SORT_DESC and SORT_SIGNED (see eightballutils.h.)  other is a word array
+ * rearranged in the same way as the keys, or 0.  Index stored by
+ * SORT_SEARCHW and SORT_SEARCHB is -1 if key was not found.
+ */
+enum sortfn {
+    SORT_W,                     /* a, n, flags, other: sort n words at a                        */
+    SORT_B,                     /* a, n, flags, other: sort n bytes at a                        */
+    SORT_SEARCHW,               /* a, n, flags, key, ptr: store index of key in sorted words    */
+    SORT_SEARCHB                /* a, n, flags, key, ptr: store index of key in sorted bytes    */
+};
+
+/*
+ * Function codes for VM_HASH.  Arguments as for VM_FILE.  A table is a
+ * word array of HASHWORDS(cap) words (see eightballutils.h.)  ok is 1 on
+ * success, 0 if the table is full or the key was not found.
+ */
+enum hashfn {
+    HASH_NEW,                   /* tab, cap, flags: make empty table for cap keys               */
+    HASH_PUT,                   /* tab, key, val, ptr: add or change key, store ok at ptr       */
+    HASH_GET,                   /* tab, key, vptr, ptr: store value at vptr, ok at ptr          */
+    HASH_DEL,                   /* tab, key, ptr: remove key, store ok at ptr                   */
+    HASH_NEXT                   /* tab, iptr, kptr, vptr: store next key and value, update *iptr */
+};
+
 #ifdef A2E
 
 /*
@@ -194,3 +324,45 @@ enum bytecode {
 //#define RTPCSTART 0
 #define RTPCSTART 0x5000 // SO THINGS WORK ON APPLE II :)
 #endif
+
+/*
+ * Bytecode file format
+ *
+ * A bytecode file starts with a six byte header:
+ *   BCMAGIC, BCVERSION, code length (word), number of relocations (word)
+ * This is followed by the code, which is linked to run at RTPCSTART, and
+ * then the relocation table.  Each entry in the relocation table is the
+ * offset from the start of the code of a word which holds an absolute code
+ * address (the operand of a long jump, branch or call).  When the image is
+ * loaded at some other address, the difference is added to each of these
+ * words.  Short jumps and branches are PC relative so need no relocation.
+ *
+ * BCMAGIC is not a valid opcode, so files with no header (from older
+ * versions) can still be loaded at RTPCSTART.
+ */
+#define BCMAGIC   0xeb
+#define BCVERSION 1
+#define BCHDRLEN  6
+
+/*
+ * Object file format
+ *
+ * A module compiled to an object file (comp "name.obj") starts with a
+ * twelve byte header:
+ *   OBJMAGIC, OBJVERSION, code length, number of relocations,
+ *   number of symbols, number of external references, main (words)
+ * main is 1 if the module has global variables or statements outside its
+ * subs.  Globals are at fixed addresses and only the first module's main
+ * program is run, so the linker only allows this for the first module.
+ * This is followed by the code and relocation table, as for a bytecode
+ * file, then the symbol table and the external reference table.  Each entry
+ * in these is a subroutine name (OBJNAMELEN bytes, padded with zeros) and
+ * a word.  For a symbol the word is the offset of the entry point of the
+ * sub from the start of the code.  For an external reference it is the
+ * offset of the operand of the call to a sub defined in another module.
+ * The linker fills these in and turns them into relocations.
+ */
+#define OBJMAGIC   0xec
+#define OBJVERSION 2
+#define OBJHDRLEN  12
+#define OBJNAMELEN 8            /* Must match SUBRNUMCHARS in eightball.c */
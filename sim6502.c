@@ -0,0 +1,570 @@
+/**************************************************************************/
+/* EightBall 6502 Simulator                                               */
+/*                                                                        */
+/* The Eight Bit Algorithmic Language                                     */
+/*                                                                        */
+/* Builds with gcc for Linux only.  Used for testing the native code      */
+/* generated by the EightBall compiler (comp "prog.prg").                 */
+/*                                                                        */
+/* Copyright Bobbi Webber-Manners 2018                                    */
+/* Simple NMOS 6502 simulator                                             */
+/*                                                                        */
+/* Formatted with indent -kr -nut                                         */
+/**************************************************************************/
+
+/**************************************************************************/
+/*  GNU PUBLIC LICENCE v3 OR LATER                                        */
+/*                                                                        */
+/*  This program is free software: you can redistribute it and/or modify  */
+/*  it under the terms of the GNU General Public License as published by  */
+/*  the Free Software Foundation, either version 3 of the License, or     */
+/*  (at your option) any later version.                                   */
+/*                                                                        */
+/*  This program is distributed in the hope that it will be useful,       */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*  GNU General Public License for more details.                          */
+/*                                                                        */
+/*  You should have received a copy of the GNU General Public License     */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                        */
+/**************************************************************************/
+
+/*
+ * Loads a program file (two byte load address followed by the code) and
+ * runs it from the load address, or from the address in the SYS statement
+ * if it starts with a Commodore BASIC stub.  The program ends when it
+ * returns (RTS) from its entry point, or executes BRK.
+ *
+ * Two Apple II monitor routines are trapped:
+ *   COUT  ($FDED) - Output char in A to stdout
+ *   RDKEY ($FD0C) - Read char from stdin into A
+ * and two Commodore KERNAL routines, which translate PETSCII:
+ *   CHROUT ($FFD2) - Output char in A to stdout
+ *   GETIN  ($FFE4) - Read char from stdin into A
+ * so programs compiled for the Apple II, C64 or VIC-20 run unchanged.
+ *
+ * The number of instructions and clock cycles executed are printed to
+ * stderr at the end of the run.  Decimal mode is not supported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define COUT   0xfded
+#define RDKEY  0xfd0c
+#define CHROUT 0xffd2
+#define GETIN  0xffe4
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+unsigned char mem[64 * 1024];
+
+unsigned char A, X, Y, S, P;
+unsigned int pc;
+unsigned long cycles;
+unsigned long insns;
+
+/*
+ * Addressing modes
+ */
+enum mode {
+    IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABSX, ABSY, IND, INDX, INDY, REL
+};
+
+/*
+ * Base cycle counts for each opcode.  0 means illegal.
+ */
+unsigned char cyctbl[256] = {
+/*  0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f */
+    7, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0,     /* 0 */
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,     /* 1 */
+    6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0,     /* 2 */
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,     /* 3 */
+    6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0,     /* 4 */
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,     /* 5 */
+    6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0,     /* 6 */
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,     /* 7 */
+    0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0,     /* 8 */
+    2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0,     /* 9 */
+    2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0,     /* a */
+    2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0,     /* b */
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,     /* c */
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,     /* d */
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,     /* e */
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0      /* f */
+};
+
+unsigned int rdw(unsigned int a)
+{
+    return mem[a & 0xffff] | (mem[(a + 1) & 0xffff] << 8);
+}
+
+void push(unsigned char b)
+{
+    mem[0x100 + S--] = b;
+}
+
+unsigned char pull()
+{
+    return mem[0x100 + ++S];
+}
+
+void setnz(unsigned char v)
+{
+    P = (P & ~(FLAG_N | FLAG_Z)) | (v & FLAG_N) | (v ? 0 : FLAG_Z);
+}
+
+/*
+ * Work out the effective address for addressing mode m.  Advances pc past
+ * the operand.  Adds a cycle for crossing a page if penalty is set.
+ */
+unsigned int ea(enum mode m, unsigned char penalty)
+{
+    unsigned int a = 0;
+    unsigned int b;
+
+    switch (m) {
+    case IMP:
+    case ACC:
+        break;
+    case IMM:
+        a = pc++;
+        break;
+    case ZP:
+        a = mem[pc++];
+        break;
+    case ZPX:
+        a = (mem[pc++] + X) & 0xff;
+        break;
+    case ZPY:
+        a = (mem[pc++] + Y) & 0xff;
+        break;
+    case ABS:
+        a = rdw(pc);
+        pc += 2;
+        break;
+    case ABSX:
+    case ABSY:
+        b = rdw(pc);
+        pc += 2;
+        a = (b + (m == ABSX ? X : Y)) & 0xffff;
+        if (penalty && ((a & 0xff00) != (b & 0xff00))) {
+            ++cycles;
+        }
+        break;
+    case IND:
+        /* NMOS bug - high byte does not cross page */
+        b = rdw(pc);
+        pc += 2;
+        a = mem[b] | (mem[(b & 0xff00) | ((b + 1) & 0xff)] << 8);
+        break;
+    case INDX:
+        b = (mem[pc++] + X) & 0xff;
+        a = mem[b] | (mem[(b + 1) & 0xff] << 8);
+        break;
+    case INDY:
+        b = mem[pc++];
+        b = mem[b] | (mem[(b + 1) & 0xff] << 8);
+        a = (b + Y) & 0xffff;
+        if (penalty && ((a & 0xff00) != (b & 0xff00))) {
+            ++cycles;
+        }
+        break;
+    case REL:
+        a = pc++;
+        break;
+    }
+    return a;
+}
+
+/*
+ * Addressing mode for the ALU group (ORA, AND, EOR, ADC, STA, LDA, CMP,
+ * SBC) and for the read-modify-write group (ASL, ROL, LSR, ROR, STX, LDX,
+ * DEC, INC), selected by bits 2-4 of the opcode.
+ */
+enum mode alumodes[] = { INDX, ZP, IMM, ABS, INDY, ZPX, ABSY, ABSX };
+enum mode rmwmodes[] = { IMM, ZP, ACC, ABS, IMP, ZPX, IMP, ABSX };
+
+void adc(unsigned char v)
+{
+    unsigned int r = A + v + (P & FLAG_C);
+
+    P &= ~(FLAG_C | FLAG_V);
+    if (r > 0xff) {
+        P |= FLAG_C;
+    }
+    if (~(A ^ v) & (A ^ r) & 0x80) {
+        P |= FLAG_V;
+    }
+    A = r;
+    setnz(A);
+}
+
+void compare(unsigned char r, unsigned char v)
+{
+    P = (r >= v ? P | FLAG_C : P & ~FLAG_C);
+    setnz(r - v);
+}
+
+void branch(unsigned char cond)
+{
+    unsigned int a = ea(REL, 0);
+    unsigned int t;
+
+    if (cond) {
+        t = (pc + (signed char) mem[a]) & 0xffff;
+        cycles += ((t & 0xff00) != (pc & 0xff00) ? 2 : 1);
+        pc = t;
+    }
+}
+
+/*
+ * Handle trapped monitor routine at pc.  Returns 1 if trapped.
+ */
+unsigned char trap()
+{
+    int c;
+
+    if (pc == COUT) {
+        c = A & 0x7f;
+        putchar(c == 13 ? '\n' : c);
+    } else if (pc == RDKEY) {
+        fflush(stdout);
+        c = getchar();
+        A = ((c == EOF) || (c == '\n') ? 13 : c) | 0x80;
+    } else if (pc == CHROUT) {
+        c = A;
+        if ((c >= 0xc1) && (c <= 0xda)) {
+            c &= 0x7f;
+        } else if ((c >= 'A') && (c <= 'Z')) {
+            c |= 0x20;
+        }
+        if (c == 13) {
+            putchar('\n');
+        } else if (c >= ' ') {
+            putchar(c);
+        }
+    } else if (pc == GETIN) {
+        fflush(stdout);
+        c = getchar();
+        if ((c == EOF) || (c == '\n')) {
+            c = 13;
+        } else if ((c >= 'A') && (c <= 'Z')) {
+            c |= 0x80;
+        } else if ((c >= 'a') && (c <= 'z')) {
+            c &= 0xdf;
+        }
+        /* As the KERNAL does */
+        X = Y = 0;
+        setnz(A = c);
+    } else {
+        return 0;
+    }
+    /* RTS */
+    pc = pull();
+    pc = ((pc | (pull() << 8)) + 1) & 0xffff;
+    cycles += 6;
+    return 1;
+}
+
+/*
+ * Execute one instruction.  Returns 0 when the program has finished.
+ */
+unsigned char step()
+{
+    unsigned char op;
+    unsigned char grp;
+    unsigned char v;
+    unsigned char c;
+    unsigned int a;
+    enum mode m;
+
+    if (trap()) {
+        return (pc != 0);
+    }
+    op = mem[pc++];
+    if (!cyctbl[op]) {
+        fprintf(stderr, "Illegal opcode $%02x at $%04x\n", op, pc - 1);
+        exit(1);
+    }
+    cycles += cyctbl[op];
+    ++insns;
+
+    /* Single byte and control flow instructions */
+    switch (op) {
+    case 0x00:                 /* BRK */
+        return 0;
+    case 0x20:                 /* JSR */
+        a = rdw(pc);
+        pc += 1;
+        push(pc >> 8);
+        push(pc & 0xff);
+        pc = a;
+        return 1;
+    case 0x60:                 /* RTS */
+        pc = pull();
+        pc = ((pc | (pull() << 8)) + 1) & 0xffff;
+        return (pc != 0);
+    case 0x40:                 /* RTI */
+        P = pull();
+        pc = pull();
+        pc |= pull() << 8;
+        return 1;
+    case 0x4c:                 /* JMP abs */
+        pc = ea(ABS, 0);
+        return 1;
+    case 0x6c:                 /* JMP (ind) */
+        pc = ea(IND, 0);
+        return 1;
+    case 0x10:
+        branch(!(P & FLAG_N));
+        return 1;
+    case 0x30:
+        branch(P & FLAG_N);
+        return 1;
+    case 0x50:
+        branch(!(P & FLAG_V));
+        return 1;
+    case 0x70:
+        branch(P & FLAG_V);
+        return 1;
+    case 0x90:
+        branch(!(P & FLAG_C));
+        return 1;
+    case 0xb0:
+        branch(P & FLAG_C);
+        return 1;
+    case 0xd0:
+        branch(!(P & FLAG_Z));
+        return 1;
+    case 0xf0:
+        branch(P & FLAG_Z);
+        return 1;
+    case 0x08:                 /* PHP */
+        push(P | FLAG_B | 0x20);
+        return 1;
+    case 0x28:                 /* PLP */
+        P = pull();
+        return 1;
+    case 0x48:                 /* PHA */
+        push(A);
+        return 1;
+    case 0x68:                 /* PLA */
+        A = pull();
+        setnz(A);
+        return 1;
+    case 0x18:
+        P &= ~FLAG_C;
+        return 1;
+    case 0x38:
+        P |= FLAG_C;
+        return 1;
+    case 0x58:
+        P &= ~FLAG_I;
+        return 1;
+    case 0x78:
+        P |= FLAG_I;
+        return 1;
+    case 0xb8:
+        P &= ~FLAG_V;
+        return 1;
+    case 0xd8:
+        P &= ~FLAG_D;
+        return 1;
+    case 0xf8:
+        P |= FLAG_D;
+        return 1;
+    case 0x88:                 /* DEY */
+        setnz(--Y);
+        return 1;
+    case 0xc8:                 /* INY */
+        setnz(++Y);
+        return 1;
+    case 0xca:                 /* DEX */
+        setnz(--X);
+        return 1;
+    case 0xe8:                 /* INX */
+        setnz(++X);
+        return 1;
+    case 0x8a:                 /* TXA */
+        setnz(A = X);
+        return 1;
+    case 0x98:                 /* TYA */
+        setnz(A = Y);
+        return 1;
+    case 0xaa:                 /* TAX */
+        setnz(X = A);
+        return 1;
+    case 0xa8:                 /* TAY */
+        setnz(Y = A);
+        return 1;
+    case 0xba:                 /* TSX */
+        setnz(X = S);
+        return 1;
+    case 0x9a:                 /* TXS */
+        S = X;
+        return 1;
+    case 0xea:                 /* NOP */
+        return 1;
+    case 0x24:                 /* BIT */
+    case 0x2c:
+        v = mem[ea((op == 0x24 ? ZP : ABS), 0)];
+        P = (P & ~(FLAG_N | FLAG_V | FLAG_Z)) | (v & (FLAG_N | FLAG_V)) | ((A & v) ? 0 : FLAG_Z);
+        return 1;
+    case 0xa0:                 /* LDY */
+    case 0xa4:
+    case 0xac:
+    case 0xb4:
+    case 0xbc:
+        m = (op == 0xa0 ? IMM : op == 0xa4 ? ZP : op == 0xac ? ABS : op == 0xb4 ? ZPX : ABSX);
+        setnz(Y = mem[ea(m, 1)]);
+        return 1;
+    case 0x84:                 /* STY */
+    case 0x8c:
+    case 0x94:
+        mem[ea((op == 0x84 ? ZP : op == 0x8c ? ABS : ZPX), 0)] = Y;
+        return 1;
+    case 0xc0:                 /* CPY */
+    case 0xc4:
+    case 0xcc:
+        compare(Y, mem[ea((op == 0xc0 ? IMM : op == 0xc4 ? ZP : ABS), 0)]);
+        return 1;
+    case 0xe0:                 /* CPX */
+    case 0xe4:
+    case 0xec:
+        compare(X, mem[ea((op == 0xe0 ? IMM : op == 0xe4 ? ZP : ABS), 0)]);
+        return 1;
+    }
+
+    grp = (op >> 5) & 0x07;
+    if ((op & 0x03) == 0x01) {
+        /* ALU group */
+        m = alumodes[(op >> 2) & 0x07];
+        a = ea(m, (grp != 4));
+        v = mem[a];
+        switch (grp) {
+        case 0:
+            setnz(A |= v);
+            break;
+        case 1:
+            setnz(A &= v);
+            break;
+        case 2:
+            setnz(A ^= v);
+            break;
+        case 3:
+            adc(v);
+            break;
+        case 4:
+            mem[a] = A;
+            break;
+        case 5:
+            setnz(A = v);
+            break;
+        case 6:
+            compare(A, v);
+            break;
+        case 7:
+            adc(~v);
+            break;
+        }
+        return 1;
+    }
+
+    /* Read-modify-write group, plus LDX and STX */
+    m = rmwmodes[(op >> 2) & 0x07];
+    if ((grp == 4) || (grp == 5)) {
+        /* STX and LDX use Y rather than X for indexing */
+        m = (m == ZPX ? ZPY : (m == ABSX ? ABSY : m));
+    }
+    a = ea(m, (grp == 5));
+    v = (m == ACC ? A : mem[a]);
+    switch (grp) {
+    case 0:                    /* ASL */
+        P = (v & 0x80 ? P | FLAG_C : P & ~FLAG_C);
+        v <<= 1;
+        break;
+    case 1:                    /* ROL */
+        c = P & FLAG_C;
+        P = (v & 0x80 ? P | FLAG_C : P & ~FLAG_C);
+        v = (v << 1) | c;
+        break;
+    case 2:                    /* LSR */
+        P = (v & 0x01 ? P | FLAG_C : P & ~FLAG_C);
+        v >>= 1;
+        break;
+    case 3:                    /* ROR */
+        c = P & FLAG_C;
+        P = (v & 0x01 ? P | FLAG_C : P & ~FLAG_C);
+        v = (v >> 1) | (c << 7);
+        break;
+    case 4:                    /* STX */
+        mem[a] = X;
+        return 1;
+    case 5:                    /* LDX */
+        setnz(X = v);
+        return 1;
+    case 6:                    /* DEC */
+        --v;
+        break;
+    case 7:                    /* INC */
+        ++v;
+        break;
+    }
+    setnz(v);
+    if (m == ACC) {
+        A = v;
+    } else {
+        mem[a] = v;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    unsigned int load;
+    int c;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s prog.prg\n", argv[0]);
+        return 1;
+    }
+    fp = fopen(argv[1], "rb");
+    if (!fp) {
+        perror(argv[1]);
+        return 1;
+    }
+    load = fgetc(fp);
+    load |= fgetc(fp) << 8;
+    for (pc = load; ((c = fgetc(fp)) != EOF) && (pc <= 0xffff); ++pc) {
+        mem[pc] = c;
+    }
+    fclose(fp);
+
+    /* Return address of $0000 ends the run */
+    S = 0xff;
+    push(0xff);
+    push(0xff);
+    P = 0x20;
+    pc = load;
+    if (mem[load + 4] == 0x9e) {
+        /* BASIC stub: 10 SYS nnnn */
+        pc = 0;
+        for (c = load + 5; (mem[c] >= '0') && (mem[c] <= '9'); ++c) {
+            pc = pc * 10 + mem[c] - '0';
+        }
+    }
+    while (step());
+    fflush(stdout);
+
+    fprintf(stderr, "%lu instructions, %lu cycles\n", insns, cycles);
+    return 0;
+}